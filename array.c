@@ -0,0 +1,418 @@
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ |      array.c -- bulk kernels for int arrays                          |
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+ #include <immintrin.h>
+#endif
+
+#include "cplus.h"
+
+#include "array.h"
+
+/*----------------------------------------------------------------------+
+ |      Portable kernels                                                |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Arithmetic is unsigned, because that wraps around without undefined
+ *  behavior, like the vector instructions
+ */
+#define addOp(x, y)     ((int) ((unsigned) (x) + (unsigned) (y)))
+#define subOp(x, y)     ((int) ((unsigned) (x) - (unsigned) (y)))
+#define mulOp(x, y)     ((int) ((unsigned) (x) * (unsigned) (y)))
+#define leOp(x, y)      ((x) <= (y))
+
+#define scalarElementwise(name, op)\
+static void name(int *dst, const int *a, const int *b, int n)\
+{\
+        for (int i=0; i<n; i++) {\
+                dst[i] = op(a[i], b[i]);\
+        }\
+}\
+\
+static void name##Int(int *dst, const int *a, int b, int n)\
+{\
+        for (int i=0; i<n; i++) {\
+                dst[i] = op(a[i], b);\
+        }\
+}
+
+scalarElementwise(scalarAdd, addOp)
+scalarElementwise(scalarSub, subOp)
+scalarElementwise(scalarMul, mulOp)
+scalarElementwise(scalarLe, leOp)
+
+static
+int scalarSum(const int *a, int n)
+{
+        unsigned sum = 0;
+        for (int i=0; i<n; i++) {
+                sum += (unsigned) a[i];
+        }
+        return (int) sum;
+}
+
+static
+int scalarMin(const int *a, int n)
+{
+        int m = a[0];
+        for (int i=1; i<n; i++) {
+                m = min(m, a[i]);
+        }
+        return m;
+}
+
+static
+int scalarMax(const int *a, int n)
+{
+        int m = a[0];
+        for (int i=1; i<n; i++) {
+                m = max(m, a[i]);
+        }
+        return m;
+}
+
+static
+int scalarDot(const int *a, const int *b, int n)
+{
+        unsigned sum = 0;
+        for (int i=0; i<n; i++) {
+                sum += (unsigned) a[i] * (unsigned) b[i];
+        }
+        return (int) sum;
+}
+
+static const struct xArrayKernels scalarKernels = {
+        .name = "scalar",
+        .add = scalarAdd,
+        .sub = scalarSub,
+        .mul = scalarMul,
+        .le = scalarLe,
+        .addInt = scalarAddInt,
+        .subInt = scalarSubInt,
+        .mulInt = scalarMulInt,
+        .leInt = scalarLeInt,
+        .sum = scalarSum,
+        .minimum = scalarMin,
+        .maximum = scalarMax,
+        .dot = scalarDot,
+};
+
+#if defined(__x86_64__)
+
+/*----------------------------------------------------------------------+
+ |      SSE2 kernels                                                    |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  SSE2 is part of x86-64, so these need no check. It lacks the 32-bit
+ *  multiply, min and max of SSE4.1, which are made from what it has.
+ *  The elements after the last full vector go to the portable kernels.
+ */
+
+// Multiply the even and the odd elements into 64 bits, keep the low halves
+static inline
+__m128i sse2Mul(__m128i x, __m128i y)
+{
+        __m128i even = _mm_mul_epu32(x, y);
+        __m128i odd = _mm_mul_epu32(_mm_srli_epi64(x, 32), _mm_srli_epi64(y, 32));
+        return _mm_unpacklo_epi32(
+                _mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static inline
+__m128i sse2Le(__m128i x, __m128i y)
+{
+        return _mm_andnot_si128(_mm_cmpgt_epi32(x, y), _mm_set1_epi32(1));
+}
+
+static inline
+__m128i sse2Min(__m128i x, __m128i y)
+{
+        __m128i greater = _mm_cmpgt_epi32(x, y);
+        return _mm_or_si128(_mm_and_si128(greater, y), _mm_andnot_si128(greater, x));
+}
+
+static inline
+__m128i sse2Max(__m128i x, __m128i y)
+{
+        __m128i greater = _mm_cmpgt_epi32(x, y);
+        return _mm_or_si128(_mm_and_si128(greater, x), _mm_andnot_si128(greater, y));
+}
+
+#define sse2Elementwise(name, op, scalar)\
+static void name(int *dst, const int *a, const int *b, int n)\
+{\
+        int i = 0;\
+        for (; i+4<=n; i+=4) {\
+                __m128i x = _mm_loadu_si128((const __m128i *) &a[i]);\
+                __m128i y = _mm_loadu_si128((const __m128i *) &b[i]);\
+                _mm_storeu_si128((__m128i *) &dst[i], op(x, y));\
+        }\
+        scalar(&dst[i], &a[i], &b[i], n - i);\
+}\
+\
+static void name##Int(int *dst, const int *a, int b, int n)\
+{\
+        __m128i y = _mm_set1_epi32(b);\
+        int i = 0;\
+        for (; i+4<=n; i+=4) {\
+                __m128i x = _mm_loadu_si128((const __m128i *) &a[i]);\
+                _mm_storeu_si128((__m128i *) &dst[i], op(x, y));\
+        }\
+        scalar##Int(&dst[i], &a[i], b, n - i);\
+}
+
+sse2Elementwise(sse2AddKernel, _mm_add_epi32, scalarAdd)
+sse2Elementwise(sse2SubKernel, _mm_sub_epi32, scalarSub)
+sse2Elementwise(sse2MulKernel, sse2Mul, scalarMul)
+sse2Elementwise(sse2LeKernel, sse2Le, scalarLe)
+
+// Reduce the lanes of `v' with `op' after the vector loop
+#define sse2Lanes(v, op, m) do{\
+        int _lanes[4];\
+        _mm_storeu_si128((__m128i *) _lanes, (v));\
+        for (int _i=0; _i<4; _i++) {\
+                m = op(m, _lanes[_i]);\
+        }\
+}while(0)
+
+static
+int sse2SumKernel(const int *a, int n)
+{
+        __m128i sum = _mm_setzero_si128();
+        int i = 0;
+        for (; i+4<=n; i+=4) {
+                sum = _mm_add_epi32(sum, _mm_loadu_si128((const __m128i *) &a[i]));
+        }
+        int s = scalarSum(&a[i], n - i);
+        sse2Lanes(sum, addOp, s);
+        return s;
+}
+
+static
+int sse2MinKernel(const int *a, int n)
+{
+        __m128i m = _mm_set1_epi32(a[0]);
+        int i = 0;
+        for (; i+4<=n; i+=4) {
+                m = sse2Min(m, _mm_loadu_si128((const __m128i *) &a[i]));
+        }
+        int s = (i < n) ? scalarMin(&a[i], n - i) : a[0];
+        sse2Lanes(m, min, s);
+        return s;
+}
+
+static
+int sse2MaxKernel(const int *a, int n)
+{
+        __m128i m = _mm_set1_epi32(a[0]);
+        int i = 0;
+        for (; i+4<=n; i+=4) {
+                m = sse2Max(m, _mm_loadu_si128((const __m128i *) &a[i]));
+        }
+        int s = (i < n) ? scalarMax(&a[i], n - i) : a[0];
+        sse2Lanes(m, max, s);
+        return s;
+}
+
+static
+int sse2DotKernel(const int *a, const int *b, int n)
+{
+        __m128i sum = _mm_setzero_si128();
+        int i = 0;
+        for (; i+4<=n; i+=4) {
+                __m128i x = _mm_loadu_si128((const __m128i *) &a[i]);
+                __m128i y = _mm_loadu_si128((const __m128i *) &b[i]);
+                sum = _mm_add_epi32(sum, sse2Mul(x, y));
+        }
+        int s = scalarDot(&a[i], &b[i], n - i);
+        sse2Lanes(sum, addOp, s);
+        return s;
+}
+
+static const struct xArrayKernels sse2Kernels = {
+        .name = "sse2",
+        .add = sse2AddKernel,
+        .sub = sse2SubKernel,
+        .mul = sse2MulKernel,
+        .le = sse2LeKernel,
+        .addInt = sse2AddKernelInt,
+        .subInt = sse2SubKernelInt,
+        .mulInt = sse2MulKernelInt,
+        .leInt = sse2LeKernelInt,
+        .sum = sse2SumKernel,
+        .minimum = sse2MinKernel,
+        .maximum = sse2MaxKernel,
+        .dot = sse2DotKernel,
+};
+
+/*----------------------------------------------------------------------+
+ |      AVX2 kernels                                                    |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Compiled for AVX2 whatever the build flags are, and only called when
+ *  the CPU has it
+ */
+#define avx2 __attribute__((target("avx2")))
+
+// A macro, because passing vectors to functions depends on the build flags
+#define avx2Le(x, y)\
+        _mm256_andnot_si256(_mm256_cmpgt_epi32(x, y), _mm256_set1_epi32(1))
+
+#define avx2Elementwise(name, op, scalar)\
+static avx2 void name(int *dst, const int *a, const int *b, int n)\
+{\
+        int i = 0;\
+        for (; i+8<=n; i+=8) {\
+                __m256i x = _mm256_loadu_si256((const __m256i *) &a[i]);\
+                __m256i y = _mm256_loadu_si256((const __m256i *) &b[i]);\
+                _mm256_storeu_si256((__m256i *) &dst[i], op(x, y));\
+        }\
+        scalar(&dst[i], &a[i], &b[i], n - i);\
+}\
+\
+static avx2 void name##Int(int *dst, const int *a, int b, int n)\
+{\
+        __m256i y = _mm256_set1_epi32(b);\
+        int i = 0;\
+        for (; i+8<=n; i+=8) {\
+                __m256i x = _mm256_loadu_si256((const __m256i *) &a[i]);\
+                _mm256_storeu_si256((__m256i *) &dst[i], op(x, y));\
+        }\
+        scalar##Int(&dst[i], &a[i], b, n - i);\
+}
+
+avx2Elementwise(avx2AddKernel, _mm256_add_epi32, scalarAdd)
+avx2Elementwise(avx2SubKernel, _mm256_sub_epi32, scalarSub)
+avx2Elementwise(avx2MulKernel, _mm256_mullo_epi32, scalarMul)
+avx2Elementwise(avx2LeKernel, avx2Le, scalarLe)
+
+#define avx2Lanes(v, op, m) do{\
+        int _lanes[8];\
+        _mm256_storeu_si256((__m256i *) _lanes, (v));\
+        for (int _i=0; _i<8; _i++) {\
+                m = op(m, _lanes[_i]);\
+        }\
+}while(0)
+
+static avx2
+int avx2SumKernel(const int *a, int n)
+{
+        __m256i sum = _mm256_setzero_si256();
+        int i = 0;
+        for (; i+8<=n; i+=8) {
+                sum = _mm256_add_epi32(sum, _mm256_loadu_si256((const __m256i *) &a[i]));
+        }
+        int s = scalarSum(&a[i], n - i);
+        avx2Lanes(sum, addOp, s);
+        return s;
+}
+
+static avx2
+int avx2MinKernel(const int *a, int n)
+{
+        __m256i m = _mm256_set1_epi32(a[0]);
+        int i = 0;
+        for (; i+8<=n; i+=8) {
+                m = _mm256_min_epi32(m, _mm256_loadu_si256((const __m256i *) &a[i]));
+        }
+        int s = (i < n) ? scalarMin(&a[i], n - i) : a[0];
+        avx2Lanes(m, min, s);
+        return s;
+}
+
+static avx2
+int avx2MaxKernel(const int *a, int n)
+{
+        __m256i m = _mm256_set1_epi32(a[0]);
+        int i = 0;
+        for (; i+8<=n; i+=8) {
+                m = _mm256_max_epi32(m, _mm256_loadu_si256((const __m256i *) &a[i]));
+        }
+        int s = (i < n) ? scalarMax(&a[i], n - i) : a[0];
+        avx2Lanes(m, max, s);
+        return s;
+}
+
+static avx2
+int avx2DotKernel(const int *a, const int *b, int n)
+{
+        __m256i sum = _mm256_setzero_si256();
+        int i = 0;
+        for (; i+8<=n; i+=8) {
+                __m256i x = _mm256_loadu_si256((const __m256i *) &a[i]);
+                __m256i y = _mm256_loadu_si256((const __m256i *) &b[i]);
+                sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(x, y));
+        }
+        int s = scalarDot(&a[i], &b[i], n - i);
+        avx2Lanes(sum, addOp, s);
+        return s;
+}
+
+static const struct xArrayKernels avx2Kernels = {
+        .name = "avx2",
+        .add = avx2AddKernel,
+        .sub = avx2SubKernel,
+        .mul = avx2MulKernel,
+        .le = avx2LeKernel,
+        .addInt = avx2AddKernelInt,
+        .subInt = avx2SubKernelInt,
+        .mulInt = avx2MulKernelInt,
+        .leInt = avx2LeKernelInt,
+        .sum = avx2SumKernel,
+        .minimum = avx2MinKernel,
+        .maximum = avx2MaxKernel,
+        .dot = avx2DotKernel,
+};
+
+#endif // __x86_64__
+
+/*----------------------------------------------------------------------+
+ |      xSelectArrayKernels                                             |
+ +----------------------------------------------------------------------*/
+
+static
+bool supported(const struct xArrayKernels *kernels)
+{
+#if defined(__x86_64__)
+        if (kernels == &avx2Kernels) {
+                return __builtin_cpu_supports("avx2");
+        }
+#endif
+        return true;
+}
+
+const struct xArrayKernels *xSelectArrayKernels(const char *name)
+{
+        // Best first
+        static const struct xArrayKernels * const sets[] = {
+#if defined(__x86_64__)
+                &avx2Kernels,
+                &sse2Kernels,
+#endif
+                &scalarKernels,
+        };
+
+        for (int i=0; i<arrayLen(sets); i++) {
+                if (supported(sets[i]) && (name == NULL || 0==strcmp(name, sets[i]->name))) {
+                        return sets[i];
+                }
+        }
+        return NULL;
+}
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
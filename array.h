@@ -0,0 +1,57 @@
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ |      array.h -- bulk kernels for int arrays                          |
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Each operation has a portable implementation and, on x86-64, versions
+ *  that do 4 (SSE2) or 8 (AVX2) elements per instruction. xInit picks the
+ *  best set the CPU supports, as CPUID reports it. All sets give the same
+ *  results: ints wrap around as in the virtual machine, and comparisons
+ *  give 1 or 0 per element, so that masks can be multiplied and summed.
+ *
+ *  The elementwise kernels may write into one of their operands.
+ */
+
+/*----------------------------------------------------------------------+
+ |      Definitions                                                     |
+ +----------------------------------------------------------------------*/
+
+struct xArrayKernels {
+        const char *name;
+
+        // dst[i] = a[i] op b[i]
+        void (*add)(int *dst, const int *a, const int *b, int n);
+        void (*sub)(int *dst, const int *a, const int *b, int n);
+        void (*mul)(int *dst, const int *a, const int *b, int n);
+        void (*le)(int *dst, const int *a, const int *b, int n);
+
+        // dst[i] = a[i] op b
+        void (*addInt)(int *dst, const int *a, int b, int n);
+        void (*subInt)(int *dst, const int *a, int b, int n);
+        void (*mulInt)(int *dst, const int *a, int b, int n);
+        void (*leInt)(int *dst, const int *a, int b, int n);
+
+        int (*sum)(const int *a, int n);
+        int (*minimum)(const int *a, int n);    // For n > 0
+        int (*maximum)(const int *a, int n);    // For n > 0
+        int (*dot)(const int *a, const int *b, int n);
+};
+
+/*----------------------------------------------------------------------+
+ |      Functions                                                       |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  The kernel set with this name ("scalar", "sse2" or "avx2"), or the
+ *  best one when `name' is NULL. Gives NULL when this build or CPU can't
+ *  run the set.
+ */
+const struct xArrayKernels *xSelectArrayKernels(const char *name);
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
@@ -5,35 +5,21 @@
  |                                                                      |
  +----------------------------------------------------------------------*/
 
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "cplus.h"
 
-#include "assemble.h"
 #include "rap.h" // for vm instruction set
+#include "assemble.h"
+#include "verify.h"
 
 /*----------------------------------------------------------------------+
  |      Definitions                                                     |
  +----------------------------------------------------------------------*/
 
-// My own interface
-enum tokenType {
-        tokenOpen,
-        tokenClose,
-        tokenOpcode,
-        tokenSpace,
-        tokenColon,
-        tokenInt,
-        tokenHexInt,
-        tokenFloat,
-        tokenHexFloat,
-        tokenSymbol,
-        tokenGet,
-        tokenSet,
-        tokenEnd,
-};
-
 // Be independent of locales influencing ctype.h (but still assume ASCII-like)
 #define isLower(c) ('a' <= (c) && (c) <= 'z')
 #define isUpper(c) ('A' <= (c) && (c) <= 'Z')
@@ -41,11 +27,40 @@ enum tokenType {
 #define isHexDigit(c) (isDigit(c) || ('a' <= (c) && (c) <= 'f'))
 #define isSymbolChar(c) (isLower(c) || isUpper(c) || isDigit(c) || (c) == '_')
 
+struct hoisted {
+        const char *start;      // Of the expression in the source
+        struct tokenize end;    // Tokenizer after it
+        int offset;             // Of the local holding its value
+        int type;               // Static type of that value
+};
+
+struct reduced {
+        int induction;          // Local stepped by (setl N (inc (getl N)))
+        int factor;
+        int offset;             // Of the local holding factor * induction
+};
+
+struct inserted {
+        int at;                 // Offset of the first local added before a loop
+        int n;                  // Number of them
+};
+
 struct vm {
+        struct xRap *rap;       // For the symbol table
         int sp;
         int maxSp;
-        intList *code;
-        intList jumps;
+        intList *code;          // In the arena of rap
+        intList jumps;          // Idem
+        int loopSp;     // Stack depth at the start of the innermost loop
+        int continuePc; // Where cont jumps to in the innermost loop
+        int constants;  // Start of the trailing vmInt and vmSymbol instructions
+        List(struct hoisted) hoisted;   // For the enclosing loops, in the arena
+        List(struct reduced) reduced;   // Idem
+        List(struct inserted) inserted; // Idem, outer loops first
+        List(int) types;        // Static type of each stack slot, idem
+        struct sourceMap *map; // Or NULL
+        int expression; // Innermost open expression in the map, or -1
+        bool isFunction;        // Compiling the body of a fun
 };
 
 /*----------------------------------------------------------------------+
@@ -57,10 +72,11 @@ const char * const opcodes[] = {
         "int", "t", "f", "z", "flt", "dbl",
         "move", "swap",
         "neg", "add", "sub", "mul", "div", "inc", "dec",                // divm abs max min
-                                                                        // fadd fsub fmul fdiv fneg fabs fmax fmin fexp fln finv fsqt fsig
+        "fadd", "fsub", "fmul", "fdiv", "fneg", "fabs", "fmax", "fmin",
+        "fexp", "fln", "finv", "fsqt", "fsig", "fma", "fle",
         "not", "and", "or", "xor", "shl", "shr", "rol", "ror",          // bcnt blzc btzc bext bdep
 
-        "call", "ret",
+        "call", "ret", "fun",
         "if", "ifn", "ifeq", "ifne", "iflt", "ifgt", "ifle", "ifge",
         "loop", "brk", "cont",
         "getl", "setl",
@@ -72,8 +88,10 @@ typedef err_t Compiler_t(struct tokenize *T, struct vm *out);
 static Compiler_t compileInt, compileT, compileF, compileZ, compileFlt, compileDbl;
 static Compiler_t compileMove, compileSwap;
 static Compiler_t compileNeg, compileAdd, compileSub, compileMul, compileDiv, compileInc, compileDec;
+static Compiler_t compileFadd, compileFsub, compileFmul, compileFdiv, compileFneg, compileFabs, compileFmax, compileFmin;
+static Compiler_t compileFexp, compileFln, compileFinv, compileFsqt, compileFsig, compileFma, compileFle;
 static Compiler_t compileNot, compileAnd, compileOr, compileXor, compileShl, compileShr, compileRol, compileRor;
-static Compiler_t compileCall, compileRet;
+static Compiler_t compileCall, compileRet, compileFun;
 static Compiler_t compileIf, compileIfn, compileIfeq, compileIfne, compileIflt, compileIfgt, compileIfle, compileIfge;
 static Compiler_t compileLoop, compileBrk, compileCont;
 static Compiler_t compileGetl, compileSetl;
@@ -84,14 +102,53 @@ Compiler_t *jumpTable[] = {
         compileInt, compileT, compileF, compileZ, compileFlt, compileDbl,
         compileMove, compileSwap,
         compileNeg, compileAdd, compileSub, compileMul, compileDiv, compileInc, compileDec,
+        compileFadd, compileFsub, compileFmul, compileFdiv, compileFneg, compileFabs, compileFmax, compileFmin,
+        compileFexp, compileFln, compileFinv, compileFsqt, compileFsig, compileFma, compileFle,
         compileNot, compileAnd, compileOr, compileXor, compileShl, compileShr, compileRol, compileRor,
-        compileCall, compileRet,
+        compileCall, compileRet, compileFun,
         compileIf, compileIfn, compileIfeq, compileIfne, compileIflt, compileIfgt, compileIfle, compileIfge,
         compileLoop, compileBrk, compileCont,
         compileGetl, compileSetl,
         compileLe,
 };
 
+/*
+ *  Perfect hash of the opcodes. The characters of a word are packed into
+ *  an unsigned, which is why opcodes can't be longer than 4 characters.
+ *  The multiplier is searched by initAssembler, so the table follows any
+ *  change in opcodes[] automatically.
+ */
+#define maxOpcodeLen    4
+#define opcodeHashBits  8
+
+#define opcodeHash(key, multiplier)\
+        (((key) * (multiplier)) >> (32 - opcodeHashBits))
+
+static unsigned opcodeMultiplier;
+static unsigned opcodeKeys[arrayLen(opcodes)];
+static unsigned char opcodeSlots[1 << opcodeHashBits]; // Opcode index + 1, or 0
+
+/*
+ *  Superinstructions replace a sequence of instructions inside a basic
+ *  block. Their operands are the operands of the sequence, in order.
+ *
+ *  The selection follows the most frequent sequences in the pair/triple
+ *  histogram (rap -H), which prints candidate entries for this table.
+ *  Longer sequences must come first.
+ */
+static const struct superinstruction {
+        int opcode;
+        int len;
+        int sequence[5];
+} superinstructions[] = {
+        { vmGetLocalIntSubtractSetLocalDrop, 5, { vmGetLocal, vmInt, vmSubtractInt, vmSetLocal, vmDrop } },
+        { vmGetLocalIntLessEqualJumpT, 4, { vmGetLocal, vmInt, vmLessEqualInt, vmJumpT } },
+        { vmGetLocalIncrementSetLocal, 3, { vmGetLocal, vmIncrementInt, vmSetLocal } },
+        { vmGetLocalMultiplyInt,       2, { vmGetLocal, vmMultiplyInt } },
+        { vmIntSubtractInt,            2, { vmInt, vmSubtractInt } },
+        { vmDropJump,                  2, { vmDrop, vmJump } },
+};
+
 #define next(T) do{\
         (T)->source += (T)->tokenLen;\
         (T)->tokenId = nextToken(T);\
@@ -123,6 +180,15 @@ int nextToken(struct tokenize *T)
 {
         int n;
 
+        /*
+         *  Tokens never extend past a space. Source with an end pointer
+         *  must therefore end with one, so only the start is checked.
+         */
+        if (T->source == T->end) {
+                T->tokenLen = 0;
+                return tokenEnd;
+        }
+
         switch (*T->source) {
 
         case 'a': case 'b': case 'c': case 'd': case 'e':
@@ -132,6 +198,24 @@ int nextToken(struct tokenize *T)
         case 'u': case 'v': case 'w': case 'x': case 'y':
         case 'z':
 
+#if xOpcodeHash
+                ;
+                unsigned key = (unsigned char) T->source[0];
+                for (n=1; isLower(T->source[n]); n++) {
+                        key |= (unsigned) (unsigned char) T->source[n] << (8 * (n & 3));
+                }
+
+                if (isUpper(T->source[n]) || isDigit(T->source[n]) || n > maxOpcodeLen)
+                        break;
+
+                int slot = opcodeSlots[opcodeHash(key, opcodeMultiplier)];
+                if (slot > 0 && opcodeKeys[slot-1] == key) {
+                        T->tokenLen = n;
+                        T->tokenValue = slot - 1; // side effect
+                        return tokenOpcode;
+                }
+                break;
+#else
                 for (n=1; isLower(T->source[n]); n++)
                         ;
 
@@ -150,20 +234,41 @@ int nextToken(struct tokenize *T)
                         }
                 }
                 break;
+#endif
 
         // TODO: negative values ('-')
         case '0': case '1': case '2': case '3': case '4':
         case '5': case '6': case '7': case '8': case '9':
                 ;
-                int value = T->source[0] - '0';
+                unsigned value = T->source[0] - '0';
                 for (n=1; isDigit(T->source[n]); n++) {
                         // TODO: overflow detection
                         value = (10 * value) + (T->source[n] - '0');
                 }
+
+                // A fraction or an exponent makes it a float: 1.5 2e-3 1.5e3
+                int intLen = n;
+                if (T->source[n] == '.' && isDigit(T->source[n+1])) {
+                        for (n+=2; isDigit(T->source[n]); n++)
+                                ;
+                }
+                if (T->source[n] == 'e') {
+                        int e = n + 1;
+                        if (T->source[e] == '+' || T->source[e] == '-') {
+                                e++;
+                        }
+                        if (isDigit(T->source[e])) {
+                                for (n=e+1; isDigit(T->source[n]); n++)
+                                        ;
+                        }
+                }
                 if (isSymbolChar(T->source[n]))
                         break;
                 T->tokenLen = n;
-                T->tokenValue = value;
+                if (n > intLen) {
+                        return tokenFloat; // The value is taken from the source
+                }
+                T->tokenValue = (int) value;
                 return tokenInt;
 
         case '$':
@@ -220,6 +325,52 @@ int nextToken(struct tokenize *T)
         return -1; // error
 }
 
+/*----------------------------------------------------------------------+
+ |      initAssembler                                                   |
+ +----------------------------------------------------------------------*/
+
+err_t initAssembler(void)
+{
+        err_t err = OK;
+
+        if (opcodeMultiplier != 0) {
+                goto cleanup; // Already done
+        }
+
+        xAssert(arrayLen(opcodes) < 256);
+        for (int i=0; i<arrayLen(opcodes); i++) {
+                const char *k = opcodes[i];
+                xAssert(strlen(k) <= maxOpcodeLen);
+                opcodeKeys[i] = 0;
+                for (int j=0; k[j]!='\0'; j++) {
+                        opcodeKeys[i] |= (unsigned) (unsigned char) k[j] << (8 * j);
+                }
+        }
+
+        // Try odd multipliers from a fixed sequence until there are no collisions
+        unsigned multiplier = 2654435761u;
+        for (int tries=0; tries<100000; tries++) {
+                memset(opcodeSlots, 0, sizeof(opcodeSlots));
+                int i;
+                for (i=0; i<arrayLen(opcodes); i++) {
+                        unsigned h = opcodeHash(opcodeKeys[i], multiplier);
+                        if (opcodeSlots[h] != 0) {
+                                break;
+                        }
+                        opcodeSlots[h] = i + 1;
+                }
+                if (i == arrayLen(opcodes)) {
+                        opcodeMultiplier = multiplier;
+                        goto cleanup;
+                }
+                multiplier = (multiplier * 1664525u + 1013904223u) | 1;
+        }
+        xRaise("No perfect hash for opcodes");
+
+cleanup:
+        return err;
+}
+
 /*----------------------------------------------------------------------+
  |      tokenizeStart                                                   |
  +----------------------------------------------------------------------*/
@@ -227,8 +378,112 @@ int nextToken(struct tokenize *T)
 err_t tokenizeStart(struct tokenize *T)
 {
         err_t err = OK;
+        xAssert(!xOpcodeHash || opcodeMultiplier != 0); // See initAssembler
+        T->start = T->source;
         T->tokenId = nextToken(T);
         skipSpaces(T);
+cleanup:
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      constant folding                                                |
+ +----------------------------------------------------------------------*/
+
+static err_t emitLoadint(struct vm *out, int value);
+static err_t markSource(struct vm *out);
+
+/*
+ *  Get the operands of the last `n' instructions when they all are vmInt
+ *  within the current run of constants
+ */
+static
+bool constantInts(struct vm *out, int n, int values[])
+{
+        if ((out->rap->optimize & xOptimizeConstants) == 0) {
+                return false;
+        }
+
+        // All instructions in the run have length 2
+        int pc = out->code->len - 2 * n;
+        if (pc < out->constants) {
+                return false;
+        }
+        for (int i=0; i<n; i++) {
+                if (out->code->v[pc + 2*i] != vmInt) {
+                        return false;
+                }
+                values[i] = out->code->v[pc + 2*i + 1];
+        }
+        return true;
+}
+
+/*
+ *  Replace the last `n' constants by a single vmInt
+ */
+static
+err_t foldInts(struct vm *out, int n, int value)
+{
+        err_t err = OK;
+
+        out->code->len -= 2 * n;
+        out->sp -= n;
+
+        struct sourceMap *map = out->map;
+        if (map != NULL) {
+                while (map->ranges.len > 0 && map->ranges.v[map->ranges.len-1].pc > out->code->len) {
+                        map->ranges.len--;
+                }
+                err = markSource(out);
+                check(err);
+        }
+
+        err = emitLoadint(out, value);
+        check(err);
+cleanup:
+        return err;
+}
+
+/*
+ *  Call a pure function at compile time when all arguments are constant.
+ *  When it fails, the call is left for run time, where it fails again.
+ */
+static
+err_t foldCall(struct vm *out, int argc, bool *folded)
+{
+        err_t err = OK;
+        *folded = false;
+
+        xValue_t argv[8];
+        int values[arrayLen(argv)];
+        int pc = out->code->len - 2 * argc;
+        if (argc > arrayLen(argv) || pc < out->constants || out->code->v[pc] != vmSymbol) {
+                goto cleanup;
+        }
+
+        const struct xSymbol *symbol = &out->rap->symbols.v[out->code->v[pc+1]];
+        if ((symbol->flags & xPure) == 0 || !constantInts(out, argc - 1, values)) {
+                goto cleanup;
+        }
+
+        argv[0] = symbol->value;
+        for (int i=1; i<argc; i++) {
+                argv[i] = xInt(values[i-1]);
+        }
+        xFunction_t *fn = (xFunction_t *) xVoidFunction(symbol->value);
+        err_t callErr = fn(NULL, argc, argv);
+        if (callErr != OK) {
+                (void) err_free(callErr);
+                goto cleanup;
+        }
+        if (!xIsInt(argv[0])) {
+                goto cleanup;
+        }
+
+        err = foldInts(out, argc, argv[0].Int);
+        check(err);
+        *folded = true;
+cleanup:
         return err;
 }
 
@@ -236,16 +491,116 @@ err_t tokenizeStart(struct tokenize *T)
  |      emit vm code                                                    |
  +----------------------------------------------------------------------*/
 
+/*
+ *  Make room for an instruction, so that its words can be stored with
+ *  emit without further checks. The instruction ends the run of constants,
+ *  unless it is vmInt or vmSymbol.
+ */
+static
+err_t reserve(struct vm *out, int n)
+{
+        err_t err = OK;
+        intList *code = out->code;
+        out->constants = code->len + n;
+        if (code->len + n > code->maxLen) {
+                void *v = code->v;
+                err = xArenaGrow(&out->rap->arena, &v, &code->maxLen, code->len + n, sizeof(int));
+                check(err);
+                code->v = v;
+        }
+cleanup:
+        return err;
+}
+
+#define emit(out, word) ((out)->code->v[(out)->code->len++] = (word))
+
+/*
+ *  Static types, as far as they are known while emitting: a typeId or
+ *  unknownType. Only straight-line code is followed. See inferTypes for
+ *  what is known across jumps.
+ */
+#define unknownType (-1)
+
+static
+int getType(const struct vm *out, int slot)
+{
+        return (slot < out->types.len) ? out->types.v[slot] : unknownType;
+}
+
+static
+err_t setType(struct vm *out, int slot, int type)
+{
+        err_t err = OK;
+        while (out->types.len <= slot) {
+                arenaPush(&out->rap->arena, out->types, unknownType);
+        }
+        out->types.v[slot] = type;
+cleanup:
+        return err;
+}
+
+/*
+ *  Symbols keep a function once it is registered
+ */
+static
+int symbolType(const struct xRap *rap, int symbol)
+{
+        return xIsFunction(rap->symbols.v[symbol].value) ? xFunctionId : unknownType;
+}
+
+/*
+ *  Jumps may land here, so the constants before can't be folded with
+ *  the instructions that follow, and nothing is known about the types
+ */
+static
+void markTarget(struct vm *out)
+{
+        out->constants = out->code->len;
+        for (int i=0; i<out->types.len; i++) {
+                out->types.v[i] = unknownType;
+        }
+}
+
+/*
+ *  Make sure that the value `depth' slots below the top has type `type',
+ *  with a check at run time unless that is already known
+ */
+static
+err_t emitCheckType(struct vm *out, int depth, int type)
+{
+        err_t err = OK;
+
+        int slot = out->sp - 1 - depth;
+        xAssert(slot >= 0);
+        if (getType(out, slot) != type) {
+                err = reserve(out, 3);
+                check(err);
+                emit(out, vmCheckType);
+                emit(out, depth);
+                emit(out, type);
+                err = setType(out, slot, type);
+                check(err);
+        }
+cleanup:
+        return err;
+}
+
 // TODO: move this into vm.c (because typechecking happens there)
 
 static
 err_t emitLoadint(struct vm *out, int value)
 {
         err_t err = OK;
-        listPush(*out->code, vmInt);
-        listPush(*out->code, value);
+        int constants = out->constants;
+        err = reserve(out, 2);
+        check(err);
+        emit(out, vmInt);
+        emit(out, value);
+        out->constants = constants;
         out->sp++;
         out->maxSp = max(out->maxSp, out->sp);
+        err = setType(out, out->sp - 1, xIntId);
+        check(err);
 cleanup:
         return err;
 }
@@ -255,7 +610,19 @@ err_t emitSubtractInt(struct vm *out)
 {
         err_t err = OK;
         xAssert(out->sp >= 2);
-        listPush(*out->code, vmSubtractInt);
+
+        int v[2];
+        if (constantInts(out, 2, v)) {
+                err = foldInts(out, 2, (int) ((unsigned) v[0] - (unsigned) v[1]));
+                goto cleanup;
+        }
+        err = emitCheckType(out, 1, xIntId);
+        check(err);
+        err = emitCheckType(out, 0, xIntId);
+        check(err);
+        err = reserve(out, 1);
+        check(err);
+        emit(out, vmSubtractInt);
         out->sp--;
 cleanup:
         return err;
@@ -266,7 +633,19 @@ err_t emitMultiplyInt(struct vm *out)
 {
         err_t err = OK;
         xAssert(out->sp >= 2);
-        listPush(*out->code, vmMultiplyInt);
+
+        int v[2];
+        if (constantInts(out, 2, v)) {
+                err = foldInts(out, 2, (int) ((unsigned) v[0] * (unsigned) v[1]));
+                goto cleanup;
+        }
+        err = emitCheckType(out, 1, xIntId);
+        check(err);
+        err = emitCheckType(out, 0, xIntId);
+        check(err);
+        err = reserve(out, 1);
+        check(err);
+        emit(out, vmMultiplyInt);
         out->sp--;
 cleanup:
         return err;
@@ -277,7 +656,17 @@ err_t emitIncrementInt(struct vm *out)
 {
         err_t err = OK;
         xAssert(out->sp >= 1);
-        listPush(*out->code, vmIncrementInt);
+
+        int v[1];
+        if (constantInts(out, 1, v)) {
+                err = foldInts(out, 1, (int) ((unsigned) v[0] + 1));
+                goto cleanup;
+        }
+        err = emitCheckType(out, 0, xIntId);
+        check(err);
+        err = reserve(out, 1);
+        check(err);
+        emit(out, vmIncrementInt);
 cleanup:
         return err;
 }
@@ -287,8 +676,75 @@ err_t emitLessEqualInt(struct vm *out)
 {
         err_t err = OK;
         xAssert(out->sp >= 2);
-        listPush(*out->code, vmLessEqualInt);
+        err = emitCheckType(out, 1, xIntId);
+        check(err);
+        err = emitCheckType(out, 0, xIntId);
+        check(err);
+        err = reserve(out, 1);
+        check(err);
+        emit(out, vmLessEqualInt);
         out->sp--;
+        err = setType(out, out->sp - 1, unknownType); // True or False
+        check(err);
+cleanup:
+        return err;
+}
+
+static
+err_t emitDouble(struct vm *out, double value)
+{
+        err_t err = OK;
+        int halves[2];
+        xAssert(sizeof(halves) == sizeof(value));
+        memcpy(halves, &value, sizeof(halves));
+        err = reserve(out, 3);
+        check(err);
+        emit(out, vmDouble);
+        emit(out, halves[0]);
+        emit(out, halves[1]);
+        out->sp++;
+        out->maxSp = max(out->maxSp, out->sp);
+        err = setType(out, out->sp - 1, xDoubleId);
+        check(err);
+cleanup:
+        return err;
+}
+
+/*
+ *  Instructions that take `n' doubles from the stack and leave one result,
+ *  which is a double except for the comparison
+ */
+static
+err_t emitDoubleOp(struct vm *out, int opcode, int n)
+{
+        err_t err = OK;
+        xAssert(out->sp >= n);
+        for (int depth=n-1; depth>=0; depth--) {
+                err = emitCheckType(out, depth, xDoubleId);
+                check(err);
+        }
+        err = reserve(out, 1);
+        check(err);
+        emit(out, opcode);
+        out->sp -= n - 1;
+        err = setType(out, out->sp - 1, (opcode == vmLessEqualDouble) ? unknownType : xDoubleId);
+        check(err);
+cleanup:
+        return err;
+}
+
+static
+err_t emitConversion(struct vm *out, int opcode, int from, int to)
+{
+        err_t err = OK;
+        xAssert(out->sp >= 1);
+        err = emitCheckType(out, 0, from);
+        check(err);
+        err = reserve(out, 1);
+        check(err);
+        emit(out, opcode);
+        err = setType(out, out->sp - 1, to);
+        check(err);
 cleanup:
         return err;
 }
@@ -300,10 +756,14 @@ err_t emitGetLocal(struct vm *out, int offset)
 
         xAssert(offset >= 0);
         xAssert(offset < out->sp);
-        listPush(*out->code, vmGetLocal);
-        listPush(*out->code, offset);
+        err = reserve(out, 2);
+        check(err);
+        emit(out, vmGetLocal);
+        emit(out, offset);
         out->sp++;
         out->maxSp = max(out->maxSp, out->sp);
+        err = setType(out, out->sp - 1, getType(out, offset));
+        check(err);
 cleanup:
         return err;
 }
@@ -314,8 +774,12 @@ err_t emitSetLocal(struct vm *out, int offset)
         err_t err = OK;
         xAssert(offset >= 0);
         xAssert(offset < out->sp);
-        listPush(*out->code, vmSetLocal);
-        listPush(*out->code, offset);
+        err = reserve(out, 2);
+        check(err);
+        emit(out, vmSetLocal);
+        emit(out, offset);
+        err = setType(out, offset, getType(out, out->sp - 1));
+        check(err);
 cleanup:
         return err;
 }
@@ -325,18 +789,21 @@ err_t emitSymbol(struct vm *out, const char *name, int len)
 {
         err_t err = OK;
 
-        int symbol = -1;
-        if (0==strncmp(name, "printInt", len)) { // TODO: strncmp here is wrong!
-                symbol = vmFunctionPrintInt;
+        int symbol = xLookup(out->rap, name, len);
+        if (symbol < 0) {
+                xRaise("Error: undefined symbol");
         }
-        if (0==strncmp(name, "subtractInt", len)) { // TODO: strncmp here is wrong!
-                symbol = vmFunctionSubtractInt;
-        }
-        xAssert(symbol != -1);
 
-        listPush(*out->code, symbol);
+        int constants = out->constants;
+        err = reserve(out, 2);
+        check(err);
+        emit(out, vmSymbol);
+        emit(out, symbol);
+        out->constants = constants;
         out->sp++;
         out->maxSp = max(out->maxSp, out->sp);
+        err = setType(out, out->sp - 1, symbolType(out->rap, symbol));
+        check(err);
 cleanup:
         return err;
 }
@@ -346,9 +813,37 @@ err_t emitCall(struct vm *out, int argc)
 {
         err_t err = OK;
         xAssert(1 <= argc && argc <= out->sp);
-        listPush(*out->code, vmCall);
-        listPush(*out->code, argc);
-        out->sp += argc - 1;
+
+        bool folded;
+        err = foldCall(out, argc, &folded);
+        check(err);
+        if (folded) {
+                goto cleanup;
+        }
+        err = reserve(out, 2);
+        check(err);
+        emit(out, vmCall);
+        emit(out, argc);
+        out->sp -= argc - 1;
+        err = setType(out, out->sp - 1, unknownType);
+        check(err);
+cleanup:
+        return err;
+}
+
+/*
+ *  The callee takes over the frame, so the code that follows is
+ *  unreachable
+ */
+static
+err_t emitTailCall(struct vm *out, int argc)
+{
+        err_t err = OK;
+        xAssert(1 <= argc && argc <= out->sp);
+        err = reserve(out, 2);
+        check(err);
+        emit(out, vmTailCall);
+        emit(out, argc);
 cleanup:
         return err;
 }
@@ -357,7 +852,9 @@ static
 err_t emitReturn(struct vm *out)
 {
         err_t err = OK;
-        listPush(*out->code, vmReturn);
+        err = reserve(out, 1);
+        check(err);
+        emit(out, vmReturn);
 cleanup:
         return err;
 }
@@ -367,8 +864,14 @@ err_t emitDrop(struct vm *out, int n)
 {
         err_t err = OK;
 
-        listPush(*out->code, vmDrop);
-        listPush(*out->code, n);
+        xAssert(0 <= n && n <= out->sp);
+        if (n > 0) {
+                err = reserve(out, 2);
+                check(err);
+                emit(out, vmDrop);
+                emit(out, n);
+                out->sp -= n;
+        }
 cleanup:
         return err;
 }
@@ -379,8 +882,10 @@ err_t emitJump(struct vm *out, int pc)
         err_t err = OK;
 
         int offset = (pc - out->code->len) * sizeof(int);
-        listPush(*out->code, vmJump);
-        listPush(*out->code, offset);
+        err = reserve(out, 2);
+        check(err);
+        emit(out, vmJump);
+        emit(out, offset);
 cleanup:
         return err;
 }
@@ -391,8 +896,10 @@ err_t emitJumpF(struct vm *out, int pc)
         err_t err = OK;
 
         int offset = (pc - out->code->len) * sizeof(int);
-        listPush(*out->code, vmJumpF);
-        listPush(*out->code, offset);
+        err = reserve(out, 2);
+        check(err);
+        emit(out, vmJumpF);
+        emit(out, offset);
 cleanup:
         return err;
 }
@@ -403,131 +910,1545 @@ err_t emitJumpT(struct vm *out, int pc)
         err_t err = OK;
 
         int offset = (pc - out->code->len) * sizeof(int);
-        listPush(*out->code, vmJumpT);
-        listPush(*out->code, offset);
+        err = reserve(out, 2);
+        check(err);
+        emit(out, vmJumpT);
+        emit(out, offset);
 cleanup:
         return err;
 }
 
-/*----------------------------------------------------------------------+
- |      compilation                                                     |
- +----------------------------------------------------------------------*/
-
 static
-err_t compileSymbol(struct tokenize *T, struct vm *out)
+err_t emitLoopInt(struct vm *out, int counter, int limit, int pc)
 {
         err_t err = OK;
 
-        err = emitSymbol(out, T->source+1, T->tokenLen-1);
+        xAssert(0 <= counter && counter < out->sp);
+        xAssert(0 <= limit && limit < out->sp);
+        int offset = (pc - out->code->len) * sizeof(int);
+        err = reserve(out, 4);
         check(err);
-
-        skip(T, tokenSymbol);
+        emit(out, vmLoopInt);
+        emit(out, counter);
+        emit(out, limit);
+        emit(out, offset);
+cleanup:
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      source map                                                      |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Let the instructions from here on belong to the current expression
+ */
+static
+err_t markSource(struct vm *out)
+{
+        err_t err = OK;
+        struct sourceMap *map = out->map;
+
+        struct sourceRange range = {
+                .pc = out->code->len,
+                .expression = out->expression,
+        };
+        int n = map->ranges.len;
+        if (n > 0 && map->ranges.v[n-1].pc == range.pc) {
+                n = --map->ranges.len; // Empty range
+        }
+        if (n == 0 || map->ranges.v[n-1].expression != range.expression) {
+                listPush(map->ranges, range);
+        }
+cleanup:
+        return err;
+}
+
+static
+err_t openSource(struct tokenize *T, struct vm *out)
+{
+        err_t err = OK;
+
+        if (out->map != NULL) {
+                struct sourceExpression expression = {
+                        .start = T->source - T->start,
+                        .end = -1,
+                        .parent = out->expression,
+                };
+                out->expression = out->map->expressions.len;
+                listPush(out->map->expressions, expression);
+                err = markSource(out);
+                check(err);
+        }
+cleanup:
+        return err;
+}
+
+static
+err_t closeSource(struct tokenize *T, struct vm *out)
+{
+        err_t err = OK;
+
+        if (out->map != NULL) {
+                struct sourceExpression *expression = &out->map->expressions.v[out->expression];
+                expression->end = T->source - T->start;
+                out->expression = expression->parent;
+                err = markSource(out);
+                check(err);
+        }
+cleanup:
+        return err;
+}
+
+/*
+ *  Innermost expression containing both `a' and `b'
+ */
+static
+int commonExpression(const struct sourceMap *map, int a, int b)
+{
+        while (a != b && a >= 0 && b >= 0) {
+                if (a > b) {
+                        a = map->expressions.v[a].parent;
+                } else {
+                        b = map->expressions.v[b].parent;
+                }
+        }
+        return (a == b) ? a : -1;
+}
+
+/*
+ *  Follow the rewrite by peephole. `newPc' gives the new location of each
+ *  old instruction. A superinstruction belongs to the innermost expression
+ *  containing all of its parts.
+ */
+static
+err_t relocateSourceMap(struct xArena *arena, struct sourceMap *map,
+        const int *code, int len, const int *newPc)
+{
+        err_t err = OK;
+
+        int n = map->ranges.len;
+        struct sourceRange *old;
+        err = xArenaAlloc(arena, n * sizeof(*old), (void **) &old);
+        check(err);
+        memcpy(old, map->ranges.v, n * sizeof(*old));
+        xAssert(n > 0 && old[0].pc == vmHeaderSize);
+
+        // One range for each new instruction
+        map->ranges.len = 0;
+        for (int pc=vmHeaderSize, r=0; pc<len; pc+=vmInstructions[code[pc]].length) {
+                while (r+1 < n && old[r+1].pc <= pc) {
+                        r++;
+                }
+                struct sourceRange range = {
+                        .pc = newPc[pc],
+                        .expression = old[r].expression,
+                };
+                int k = map->ranges.len;
+                if (k > 0 && map->ranges.v[k-1].pc == range.pc) {
+                        struct sourceRange *last = &map->ranges.v[k-1];
+                        last->expression = commonExpression(map, last->expression, range.expression);
+                } else {
+                        listPush(map->ranges, range);
+                }
+        }
+
+        // Merge them again
+        int m = 0;
+        for (int i=0; i<map->ranges.len; i++) {
+                if (m == 0 || map->ranges.v[m-1].expression != map->ranges.v[i].expression) {
+                        map->ranges.v[m++] = map->ranges.v[i];
+                }
+        }
+        map->ranges.len = m;
+
+cleanup:
+        return err;
+}
+
+int sourceExpressionAt(const struct sourceMap *map, int pc)
+{
+        // Last range starting at or before pc
+        int lo = 0, hi = map->ranges.len;
+        while (lo < hi) {
+                int mid = (lo + hi) / 2;
+                if (map->ranges.v[mid].pc <= pc) {
+                        lo = mid + 1;
+                } else {
+                        hi = mid;
+                }
+        }
+        return (lo > 0) ? map->ranges.v[lo-1].expression : -1;
+}
+
+void freeSourceMap(struct sourceMap *map)
+{
+        freeList(map->expressions);
+        freeList(map->ranges);
+}
+
+/*----------------------------------------------------------------------+
+ |      loop optimization                                               |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Before compiling a loop, its source is scanned for two things:
+ *
+ *  1. Invariant expressions: sub, mul, inc and le over literals and
+ *     locals that the loop doesn't assign. Their values are computed
+ *     before the loop into new locals. All operands must be known to be
+ *     ints, so that the copy can't raise a type error the loop wouldn't.
+ *
+ *  2. Induction variables: int locals that the loop only steps with
+ *     (setl N (inc (getl N))). A product (mul (int c) (getl N)) is then
+ *     kept in a new local, which is advanced by c after each step. This
+ *     only pays off when the product is used more than once, because the
+ *     update costs an instruction too.
+ *
+ *  The new locals stay on the stack until the loop ends. Calls aren't
+ *  hoisted: a native may raise an error where the loop would have ended
+ *  before calling it.
+ *
+ *  3. Counted loops: see matchCountedLoop. They run the test once before
+ *     the first round, and end each round with vmLoopInt.
+ */
+
+enum {
+        kindVariant,
+        kindInvariant,
+        kindConstant,
+};
+
+enum {
+        notAssigned,
+        onlyStepped,
+        assigned,
+};
+
+#define minReducedUses 2
+
+struct scanned {
+        struct tokenize begin;  // At the `('
+        struct tokenize end;    // After it, as compileExpression leaves it
+        Compiler_t *compiler;   // Or NULL
+        int kind;
+        int value;              // Operand of int or getl
+        bool isInt;             // Statically known to be an int
+};
+
+struct reductionSite {
+        struct scanned e;
+        int induction;
+        int factor;
+        bool done;
+};
+
+struct loopScan {
+        struct vm *out;
+        int nrLocals;           // Before the loop
+        char *assigned;         // For each of them
+        List(struct scanned) hoist;
+        List(struct reductionSite) sites;
+        bool stop;              // Syntax error, the compiler reports it
+};
+
+static err_t compileExpression(struct tokenize *T, struct vm *out);
+
+static
+const struct hoisted *findHoisted(const struct vm *out, const char *start)
+{
+        for (int i=out->hoisted.len-1; i>=0; i--) {
+                if (out->hoisted.v[i].start == start) {
+                        return &out->hoisted.v[i];
+                }
+        }
+        return NULL;
+}
+
+static
+bool accept(struct tokenize *S, int tokenId, int value)
+{
+        if (S->tokenId != tokenId || (tokenId == tokenInt && S->tokenValue != value)) {
+                return false;
+        }
+        next(S);
+        skipSpaces(S);
+        return true;
+}
+
+static
+bool acceptOpcode(struct tokenize *S, Compiler_t *compiler)
+{
+        if (S->tokenId != tokenOpcode || jumpTable[S->tokenValue] != compiler) {
+                return false;
+        }
+        next(S);
+        skipSpaces(S);
+        return true;
+}
+
+/*
+ *  After the offset of setl: (inc (getl offset)))
+ */
+static
+bool isStep(struct tokenize S, int offset)
+{
+        return accept(&S, tokenOpen, 0) && acceptOpcode(&S, compileInc)
+            && accept(&S, tokenOpen, 0) && acceptOpcode(&S, compileGetl)
+            && accept(&S, tokenInt, offset) && accept(&S, tokenClose, 0)
+            && accept(&S, tokenClose, 0) && accept(&S, tokenClose, 0);
+}
+
+/*
+ *  The offset of a local that the source gives as `offset'. The source
+ *  doesn't count the locals added before the enclosing loops.
+ */
+static
+int localOffset(const struct vm *out, int offset)
+{
+        for (int i=0; i<out->inserted.len; i++) {
+                if (offset >= out->inserted.v[i].at) {
+                        offset += out->inserted.v[i].n;
+                }
+        }
+        return offset;
+}
+
+/*
+ *  Find the locals that the loop body assigns, including nested loops
+ */
+static
+void scanAssignments(struct loopScan *scan, struct tokenize S)
+{
+        int depth = 0;
+        while (S.tokenId >= 0 && S.tokenId != tokenEnd) {
+                if (S.tokenId == tokenOpen) {
+                        depth++;
+                }
+                if (S.tokenId == tokenClose && depth-- == 0) {
+                        break;
+                }
+                if (S.tokenId == tokenOpcode && jumpTable[S.tokenValue] == compileSetl) {
+                        struct tokenize P = S;
+                        next(&P);
+                        skipSpaces(&P);
+                        int offset = localOffset(scan->out, P.tokenValue);
+                        if (P.tokenId == tokenInt && offset < scan->nrLocals) {
+                                int value = P.tokenValue;
+                                next(&P);
+                                skipSpaces(&P);
+                                if (!isStep(P, value)) {
+                                        scan->assigned[offset] = assigned;
+                                } else if (scan->assigned[offset] == notAssigned) {
+                                        scan->assigned[offset] = onlyStepped;
+                                }
+                        }
+                }
+                next(&S);
+        }
+}
+
+static
+err_t hoistIfWorthwhile(struct loopScan *scan, const struct scanned *e)
+{
+        err_t err = OK;
+
+        // A lone getl gains nothing, and constants are folded already
+        if (e->kind == kindInvariant && e->compiler != NULL && e->compiler != compileGetl) {
+                arenaPush(&scan->out->rap->arena, scan->hoist, *e);
+        }
+cleanup:
+        return err;
+}
+
+static err_t scanExpression(struct loopScan *scan, struct tokenize *S, struct scanned *e);
+
+/*
+ *  The operands of an expression, up to its `)'. Invariant operands are
+ *  hoisted on their own unless the expression may be hoisted as a whole.
+ */
+static
+err_t scanOperands(struct loopScan *scan, struct tokenize *S, bool pure, struct scanned operands[2], int *n)
+{
+        err_t err = OK;
+
+        *n = 0;
+        while (S->tokenId != tokenClose && !scan->stop) {
+                if (S->tokenId == tokenInt || S->tokenId == tokenFloat) {
+                        next(S); // Offset of setl, or a literal of dbl or flt
+                        skipSpaces(S);
+                        continue;
+                }
+
+                struct scanned e;
+                err = scanExpression(scan, S, &e);
+                check(err);
+
+                if (pure && *n < 2) {
+                        operands[*n] = e;
+                } else {
+                        err = hoistIfWorthwhile(scan, &e);
+                        check(err);
+                }
+                (*n)++;
+        }
+cleanup:
+        return err;
+}
+
+/*
+ *  Classify the expression at S and move past it like compileExpression
+ */
+static
+err_t scanExpression(struct loopScan *scan, struct tokenize *S, struct scanned *e)
+{
+        err_t err = OK;
+
+        e->begin = *S;
+        e->compiler = NULL;
+        e->kind = kindVariant;
+        e->isInt = false;
+        struct reductionSite site = { .induction = -1 };
+
+        if (S->tokenId != tokenOpen) {
+                if (S->tokenId == tokenSymbol) {
+                        next(S);
+                        skipSpaces(S);
+                } else {
+                        scan->stop = true;
+                }
+                goto cleanup;
+        }
+
+        // Already computed before an enclosing loop
+        const struct hoisted *h = findHoisted(scan->out, S->source);
+        if (h != NULL) {
+                *S = h->end;
+                e->kind = kindInvariant;
+                e->isInt = (h->type == xIntId);
+                goto cleanup;
+        }
+
+        next(S);
+        skipSpaces(S);
+        if (S->tokenId != tokenOpcode) {
+                scan->stop = true;
+                goto cleanup;
+        }
+        e->compiler = jumpTable[S->tokenValue];
+        if (e->compiler == compileFun) {
+                scan->stop = true; // Its locals aren't those of the loop
+                goto cleanup;
+        }
+        next(S);
+        skipSpaces(S);
+
+        bool isLiteral = (e->compiler == compileInt && S->tokenId == tokenInt);
+        if (isLiteral || e->compiler == compileGetl) {
+                if (S->tokenId != tokenInt) {
+                        scan->stop = true;
+                        goto cleanup;
+                }
+                e->value = (e->compiler == compileInt) ? S->tokenValue : localOffset(scan->out, S->tokenValue);
+                next(S);
+                skipSpaces(S);
+                if (e->compiler == compileInt) {
+                        e->kind = kindConstant;
+                        e->isInt = true;
+                } else if (e->value < scan->nrLocals) {
+                        e->isInt = (getType(scan->out, e->value) == xIntId);
+                        if (scan->assigned[e->value] == notAssigned) {
+                                e->kind = kindInvariant;
+                        }
+                }
+        } else {
+                int arity = (e->compiler == compileInc) ? 1 :
+                        (e->compiler == compileSub || e->compiler == compileMul || e->compiler == compileLe) ? 2 : 0;
+
+                struct scanned operands[2];
+                int n;
+                err = scanOperands(scan, S, arity > 0, operands, &n);
+                check(err);
+
+                if (arity > 0 && n == arity) {
+                        e->kind = kindConstant;
+                        e->isInt = (e->compiler != compileLe); // Else True or False
+                        for (int i=0; i<n; i++) {
+                                if (operands[i].kind == kindVariant || e->kind == kindConstant) {
+                                        e->kind = operands[i].kind;
+                                }
+                                if (!operands[i].isInt) {
+                                        e->kind = kindVariant; // May raise a type error
+                                        e->isInt = false;
+                                }
+                        }
+                }
+
+                // Product of a literal and an induction variable
+                if (e->compiler == compileMul && n == 2) {
+                        const struct scanned *a = &operands[0], *b = &operands[1];
+                        if (b->compiler == compileInt) {
+                                a = &operands[1];
+                                b = &operands[0];
+                        }
+                        if (a->compiler == compileInt && b->compiler == compileGetl && b->isInt
+                         && b->value < scan->nrLocals && scan->assigned[b->value] == onlyStepped) {
+                                site.induction = b->value;
+                                site.factor = a->value;
+                                site.done = false;
+                        }
+                }
+
+                if (arity > 0 && e->kind == kindVariant) {
+                        for (int i=0; i<n && i<2; i++) {
+                                err = hoistIfWorthwhile(scan, &operands[i]);
+                                check(err);
+                        }
+                }
+        }
+
+        if (S->tokenId != tokenClose) {
+                scan->stop = true;
+                goto cleanup;
+        }
+        next(S);
+        skipSpaces(S);
+
+        if (site.induction >= 0) {
+                site.e = *e;
+                site.e.end = *S;
+                arenaPush(&scan->out->rap->arena, scan->sites, site);
+        }
+cleanup:
+        e->end = *S;
+        return err;
+}
+
+/*
+ *  Compute `e' into a new local, and use that for the expressions
+ *  starting at the same place from now on
+ */
+static
+err_t hoist(struct vm *out, const struct scanned *e)
+{
+        err_t err = OK;
+
+        struct tokenize C = e->begin;
+        err = compileExpression(&C, out);
+        check(err);
+
+        struct hoisted h = {
+                .start = e->begin.source,
+                .end = e->end,
+                .offset = out->sp - 1,
+                .type = getType(out, out->sp - 1),
+        };
+        arenaPush(&out->rap->arena, out->hoisted, h);
+cleanup:
+        return err;
+}
+
+/*
+ *  Emit the code before a loop. `T' is at the start of its body.
+ */
+static
+err_t optimizeLoop(struct tokenize *T, struct vm *out, int *nrLocals)
+{
+        err_t err = OK;
+
+        struct loopScan scan = {
+                .out = out,
+                .nrLocals = out->sp,
+                .hoist = emptyList,
+                .sites = emptyList,
+                .stop = false,
+        };
+        *nrLocals = 0;
+
+        err = xArenaAlloc(&out->rap->arena, scan.nrLocals, (void **) &scan.assigned);
+        check(err);
+        memset(scan.assigned, notAssigned, scan.nrLocals);
+
+        scanAssignments(&scan, *T);
+
+        struct tokenize S = *T;
+        struct scanned operands[2];
+        int n;
+        err = scanOperands(&scan, &S, false, operands, &n);
+        check(err);
+        if (scan.stop) {
+                goto cleanup;
+        }
+
+        // Invariant expressions
+        for (int i=0; i<scan.hoist.len; i++) {
+                err = hoist(out, &scan.hoist.v[i]);
+                check(err);
+                (*nrLocals)++;
+        }
+
+        // Products with induction variables
+        for (int i=0; i<scan.sites.len; i++) {
+                struct reductionSite *site = &scan.sites.v[i];
+                int uses = 0;
+                for (int j=i; j<scan.sites.len; j++) {
+                        uses += (scan.sites.v[j].induction == site->induction
+                              && scan.sites.v[j].factor == site->factor);
+                }
+                if (site->done || uses < minReducedUses) {
+                        continue;
+                }
+
+                err = hoist(out, &site->e);
+                check(err);
+                (*nrLocals)++;
+
+                int offset = out->sp - 1;
+                for (int j=i+1; j<scan.sites.len; j++) {
+                        struct reductionSite *other = &scan.sites.v[j];
+                        if (other->induction == site->induction && other->factor == site->factor) {
+                                struct hoisted h = {
+                                        .start = other->e.begin.source,
+                                        .end = other->e.end,
+                                        .offset = offset,
+                                        .type = xIntId,
+                                };
+                                arenaPush(&out->rap->arena, out->hoisted, h);
+                                other->done = true;
+                        }
+                }
+
+                struct reduced r = {
+                        .induction = site->induction,
+                        .factor = site->factor,
+                        .offset = offset,
+                };
+                arenaPush(&out->rap->arena, out->reduced, r);
+        }
+cleanup:
+        return err;
+}
+
+/*
+ *  Load an expression computed before the loop, if this is one
+ */
+static
+err_t loadHoisted(struct tokenize *T, struct vm *out, bool *loaded)
+{
+        err_t err = OK;
+
+        const struct hoisted *h = findHoisted(out, T->source);
+        *loaded = (h != NULL);
+        if (h != NULL) {
+                err = emitGetLocal(out, h->offset);
+                check(err);
+                *T = h->end;
+        }
+cleanup:
+        return err;
+}
+
+/*
+ *  After setl: advance the products that depend on the local
+ */
+static
+err_t stepReduced(struct vm *out, int offset)
+{
+        err_t err = OK;
+
+        for (int i=0; i<out->reduced.len; i++) {
+                const struct reduced *r = &out->reduced.v[i];
+                if (r->induction == offset) {
+                        // There is no add: subtract the negated factor
+                        err = emitGetLocal(out, r->offset);
+                        check(err);
+                        err = emitLoadint(out, (int) (0u - (unsigned) r->factor));
+                        check(err);
+                        err = emitSubtractInt(out);
+                        check(err);
+                        err = emitSetLocal(out, r->offset);
+                        check(err);
+                        err = emitDrop(out, 1);
+                        check(err);
+                }
+        }
+cleanup:
+        return err;
+}
+
+/*
+ *  A counted loop has the form
+ *
+ *      (loop (ifn (le (getl N) limit) (brk)) ... (setl N (inc (getl N))))
+ *
+ *  where the limit is a literal, a local or an expression computed before
+ *  the loop, and nothing else in the body assigns N or the limit.
+ */
+struct countedLoop {
+        int counter;            // Local N
+        int limit;              // Local holding the limit, or -1 for `value'
+        int value;              // Literal limit
+        struct tokenize body;   // After the test
+        const char *step;       // Start of the (setl N ...) that ends the body
+        struct tokenize end;    // After it, at the `)' of the loop
+};
+
+/*
+ *  Move past an expression without compiling it
+ */
+static
+bool skipExpression(struct tokenize *S)
+{
+        int depth = 0;
+        do {
+                if (S->tokenId == tokenOpen) {
+                        depth++;
+                } else if (S->tokenId == tokenClose) {
+                        depth--;
+                } else if (S->tokenId < 0 || S->tokenId == tokenEnd) {
+                        return false;
+                }
+                next(S);
+                skipSpaces(S);
+        } while (depth > 0);
+        return depth == 0;
+}
+
+/*
+ *  Whether a setl between S and `end' may assign the local
+ */
+static
+bool assignsLocal(const struct vm *out, struct tokenize S, const char *end, int offset)
+{
+        while (S.source < end && S.tokenId >= 0 && S.tokenId != tokenEnd) {
+                if (S.tokenId == tokenOpcode && jumpTable[S.tokenValue] == compileSetl) {
+                        struct tokenize P = S;
+                        next(&P);
+                        skipSpaces(&P);
+                        if (P.tokenId != tokenInt || localOffset(out, P.tokenValue) == offset) {
+                                return true;
+                        }
+                }
+                next(&S);
+        }
+        return false;
+}
+
+/*
+ *  Recognize a counted loop. `S' is at the start of the body, and the
+ *  loop has `nrLocals' locals before the ones added for it.
+ */
+static
+bool matchCountedLoop(struct tokenize S, const struct vm *out, int nrLocals, struct countedLoop *c)
+{
+        // (ifn (le (getl N)
+        if (!accept(&S, tokenOpen, 0) || !acceptOpcode(&S, compileIfn)
+         || !accept(&S, tokenOpen, 0) || !acceptOpcode(&S, compileLe)
+         || !accept(&S, tokenOpen, 0) || !acceptOpcode(&S, compileGetl)
+         || S.tokenId != tokenInt) {
+                return false;
+        }
+        int n = S.tokenValue;
+        c->counter = localOffset(out, n);
+        if (!accept(&S, tokenInt, n) || !accept(&S, tokenClose, 0)
+         || c->counter < 0 || c->counter >= nrLocals) {
+                return false;
+        }
+
+        // The limit
+        const struct hoisted *h = findHoisted(out, S.source);
+        if (h != NULL) {
+                for (int i=0; i<out->reduced.len; i++) {
+                        if (out->reduced.v[i].offset == h->offset) {
+                                return false; // Changes with an induction variable
+                        }
+                }
+                c->limit = h->offset;
+                S = h->end;
+        } else {
+                if (!accept(&S, tokenOpen, 0)) {
+                        return false;
+                }
+                bool isInt = acceptOpcode(&S, compileInt);
+                if ((!isInt && !acceptOpcode(&S, compileGetl)) || S.tokenId != tokenInt) {
+                        return false;
+                }
+                c->limit = isInt ? -1 : localOffset(out, S.tokenValue);
+                c->value = S.tokenValue;
+                if (!accept(&S, tokenInt, S.tokenValue) || !accept(&S, tokenClose, 0)
+                 || c->limit >= nrLocals || c->limit == c->counter) {
+                        return false;
+                }
+        }
+
+        // ) (brk))
+        if (!accept(&S, tokenClose, 0)
+         || !accept(&S, tokenOpen, 0) || !acceptOpcode(&S, compileBrk) || !accept(&S, tokenClose, 0)
+         || !accept(&S, tokenClose, 0)) {
+                return false;
+        }
+        c->body = S;
+
+        // The step comes last
+        struct tokenize last = S;
+        while (S.tokenId != tokenClose) {
+                last = S;
+                if (!skipExpression(&S)) {
+                        return false;
+                }
+        }
+        c->step = last.source;
+        c->end = S;
+        if (!accept(&last, tokenOpen, 0) || !acceptOpcode(&last, compileSetl)
+         || !accept(&last, tokenInt, n) || !isStep(last, n)) {
+                return false;
+        }
+
+        // Nor the test result, which stays on the stack above the locals
+        return !assignsLocal(out, c->body, c->step, c->counter)
+            && (c->limit < 0 || !assignsLocal(out, c->body, c->step, c->limit))
+            && !assignsLocal(out, c->body, c->step, nrLocals);
+}
+
+/*
+ *  Compile the body of a counted loop, from the start of the loop. The
+ *  test runs here, before the first round and after cont. Its result
+ *  stays on the stack during the body, as with ifn, so the locals of the
+ *  body keep their offsets. Each round ends with vmLoopInt, which steps
+ *  the counter and jumps back while it is within the limit.
+ */
+static
+err_t compileCountedLoop(struct tokenize *T, struct vm *out, const struct countedLoop *c)
+{
+        err_t err = OK;
+
+        // The ints that vmLoopInt relies on
+        err = emitCheckType(out, out->sp - 1 - c->counter, xIntId);
+        check(err);
+        err = emitCheckType(out, out->sp - 1 - c->limit, xIntId);
+        check(err);
+
+        err = emitGetLocal(out, c->counter);
+        check(err);
+        err = emitGetLocal(out, c->limit);
+        check(err);
+        err = emitLessEqualInt(out);
+        check(err);
+        int jumpPc = out->code->len;
+        err = emitJumpT(out, jumpPc); // dummy operand
+        check(err);
+
+        // Not even one round: leave like brk does
+        int bodySp = out->sp;
+        err = emitDrop(out, 1);
+        check(err);
+        arenaPush(&out->rap->arena, out->jumps, out->code->len);
+        err = emitJump(out, out->code->len);
+        check(err);
+
+        int startBody = out->code->len;
+        out->code->v[jumpPc+1] = (startBody - jumpPc) * sizeof(int);
+        out->sp = bodySp;
+        markTarget(out);
+
+        *T = c->body;
+        while (T->source < c->step) {
+                err = compileExpression(T, out);
+                check(err);
+        }
+        *T = c->end;
+
+        err = emitDrop(out, out->sp - bodySp);
+        check(err);
+        err = stepReduced(out, c->counter);
+        check(err);
+        err = emitLoopInt(out, c->counter, c->limit, startBody);
+        check(err);
+        err = emitDrop(out, 1);
+        check(err);
+cleanup:
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      compilation                                                     |
+ +----------------------------------------------------------------------*/
+
+static
+err_t compileSymbol(struct tokenize *T, struct vm *out)
+{
+        err_t err = OK;
+
+        err = emitSymbol(out, T->source+1, T->tokenLen-1);
+        check(err);
+
+        skip(T, tokenSymbol);
+        skipSpaces(T);
+cleanup:
+        return err;
+}
+
+/*
+ * There are several types of expressions
+ *  ( op ... )          canonical notation
+ *  op : args ...       alias for: (op args ...)
+ *  ? ... arg           alias for: (get ...)
+ *  ! ... arg           alias for: (set ...)
+ */
+
+static
+err_t compileExpression(struct tokenize *T, struct vm *out)
+{
+        err_t err = OK;
+
+        switch (T->tokenId) {
+
+        case tokenOpen:
+                if (out->hoisted.len > 0) {
+                        bool loaded;
+                        err = loadHoisted(T, out, &loaded);
+                        check(err);
+                        if (loaded) break;
+                }
+
+                err = openSource(T, out);
+                check(err);
+
+                skip(T, tokenOpen);
+                skipSpaces(T);
+
+                if (T->tokenId != tokenOpcode) {
+                        xRaise("Opcode expected");
+                }
+
+                err = jumpTable[T->tokenValue](T, out);
+                check(err);
+
+                if (T->tokenId != tokenClose) {
+                        xRaise("Error: too many arguments");\
+                }
+
+                skip(T, tokenClose);
+                err = closeSource(T, out);
+                check(err);
+
+                skipSpaces(T);
+                break;
+
+        case tokenOpcode:
+                xRaise("Not implemented");
+
+        case tokenSymbol:
+                err = compileSymbol(T, out);
+                check(err);
+                break;
+
+        default:
+                xRaise("Expression expected");
+        }
         skipSpaces(T);
 cleanup:
         return err;
 }
 
 /*
- * There are several types of expressions
- *  ( op ... )          canonical notation
- *  op : args ...       alias for: (op args ...)
- *  ? ... arg           alias for: (get ...)
- *  ! ... arg           alias for: (set ...)
+ *  (int <literal>), or (int <expression>) to truncate a double
+ */
+static err_t compileInt(struct tokenize *T, struct vm *out)
+{
+        err_t err = OK;
+
+        skip(T, tokenOpcode);
+        skipSpaces(T);
+
+        if (T->tokenId != tokenInt) {
+                err = compileExpression(T, out);
+                check(err);
+                err = emitConversion(out, vmDoubleToInt, xDoubleId, xIntId);
+                goto cleanup;
+        }
+
+        skip(T, tokenInt);
+        skipSpaces(T);
+
+        err = emitLoadint(out, T->tokenValue);
+        check(err);
+cleanup:
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      type inference                                                  |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Merge the types at a jump target into its state: the depth followed
+ *  by the type of each slot. Gives true when the state changed.
+ */
+static
+bool mergeTypes(int *state, const int *types, int sp)
+{
+        if (state[0] < 0) {
+                state[0] = sp;
+                memcpy(&state[1], types, sp * sizeof(int));
+                return true;
+        }
+
+        bool changed = false;
+        for (int i=0; i<sp; i++) {
+                if (state[1+i] != types[i] && state[1+i] != unknownType) {
+                        state[1+i] = unknownType;
+                        changed = true;
+                }
+        }
+        return changed;
+}
+
+/*
+ *  Find the vmCheckType instructions that can't fail. The types of all
+ *  stack slots are followed through the code and merged where jumps
+ *  land. When a jump back into a loop makes less known at its start, the
+ *  code is followed once more, until nothing changes. The checks are
+ *  marked in `isRedundant' in that last round.
+ */
+static
+err_t inferTypes(struct xRap *rap, const int *code, int len, const char *isTarget, char *isRedundant)
+{
+        err_t err = OK;
+
+        struct xArena *arena = &rap->arena;
+        int nrSlots = code[vmHeaderLocals];
+        int *types, *stateOf, *states;
+
+        err = xArenaAlloc(arena, (nrSlots + 1) * sizeof(int), (void **) &types);
+        check(err);
+        err = xArenaAlloc(arena, (len + 1) * sizeof(int), (void **) &stateOf);
+        check(err);
+
+        int nrStates = 0;
+        for (int pc=vmHeaderSize; pc<=len; pc++) {
+                stateOf[pc] = isTarget[pc] ? (nrSlots + 1) * nrStates++ : -1;
+        }
+        err = xArenaAlloc(arena, (nrSlots + 1) * nrStates * sizeof(int) + 1, (void **) &states);
+        check(err);
+        for (int i=0; i<nrStates; i++) {
+                states[(nrSlots + 1) * i] = -1; // Not reached
+        }
+
+        for (bool changed=true; changed; ) {
+                changed = false;
+                int sp = code[vmHeaderArguments];
+                bool reachable = true;
+                for (int i=0; i<sp; i++) {
+                        types[i] = unknownType;
+                }
+
+                for (int pc=vmHeaderSize; pc<len; pc+=vmInstructions[code[pc]].length) {
+                        isRedundant[pc] = 0;
+                        if (isTarget[pc]) {
+                                int *state = &states[stateOf[pc]];
+                                if (reachable) {
+                                        (void) mergeTypes(state, types, sp);
+                                }
+                                reachable = (state[0] >= 0);
+                                if (reachable) {
+                                        sp = state[0];
+                                        memcpy(types, &state[1], sp * sizeof(int));
+                                }
+                        }
+                        if (!reachable) {
+                                continue;
+                        }
+
+                        const int *ip = &code[pc];
+                        switch (ip[0]) {
+                        case vmInt:
+                                types[sp++] = xIntId;
+                                break;
+
+                        case vmSubtractInt:
+                        case vmMultiplyInt:
+                                xAssert(sp >= 2);
+                                types[--sp - 1] = xIntId;
+                                break;
+
+                        case vmIncrementInt:
+                                xAssert(sp >= 1);
+                                types[sp - 1] = xIntId;
+                                break;
+
+                        case vmLessEqualInt:
+                                xAssert(sp >= 2);
+                                types[--sp - 1] = unknownType; // True or False
+                                break;
+
+                        case vmSymbol:
+                                xAssert(0 <= ip[1] && ip[1] < rap->symbols.len);
+                                types[sp++] = symbolType(rap, ip[1]);
+                                break;
+
+                        case vmCall:
+                                xAssert(1 <= ip[1] && ip[1] <= sp);
+                                sp -= ip[1] - 1;
+                                types[sp - 1] = unknownType;
+                                break;
+
+                        case vmTailCall:
+                                xAssert(1 <= ip[1] && ip[1] <= sp);
+                                reachable = false;
+                                break;
+
+                        case vmReturn:
+                                reachable = false;
+                                break;
+
+                        case vmDrop:
+                                xAssert(0 <= ip[1] && ip[1] <= sp);
+                                sp -= ip[1];
+                                break;
+
+                        case vmLoopInt:
+                                xAssert(0 <= ip[1] && ip[1] < sp);
+                                xAssert(0 <= ip[2] && ip[2] < sp);
+                                // fall through
+                        case vmJump:
+                        case vmJumpF:
+                        case vmJumpT:
+                                ;
+                                int target = pc + ip[vmInstructions[ip[0]].jump] / (int)sizeof(int);
+                                int *state = &states[stateOf[target]];
+                                xAssert(state[0] < 0 || state[0] == sp);
+                                if (mergeTypes(state, types, sp) && target <= pc) {
+                                        changed = true; // Follow the loop again
+                                }
+                                reachable = (ip[0] != vmJump);
+                                break;
+
+                        case vmGetLocal:
+                                xAssert(0 <= ip[1] && ip[1] < sp);
+                                types[sp] = types[ip[1]];
+                                sp++;
+                                break;
+
+                        case vmSetLocal:
+                                xAssert(0 <= ip[1] && ip[1] < sp);
+                                types[ip[1]] = types[sp - 1];
+                                break;
+
+                        case vmCheckType:
+                                xAssert(0 <= ip[1] && ip[1] < sp);
+                                isRedundant[pc] = (types[sp - 1 - ip[1]] == ip[2]);
+                                types[sp - 1 - ip[1]] = ip[2];
+                                break;
+
+                        case vmDouble:
+                                types[sp++] = xDoubleId;
+                                break;
+
+                        case vmMultiplyAddDouble:
+                                xAssert(sp >= 3);
+                                sp -= 2;
+                                types[sp - 1] = xDoubleId;
+                                break;
+
+                        case vmAddDouble:
+                        case vmSubtractDouble:
+                        case vmMultiplyDouble:
+                        case vmDivideDouble:
+                        case vmMaxDouble:
+                        case vmMinDouble:
+                                xAssert(sp >= 2);
+                                types[--sp - 1] = xDoubleId;
+                                break;
+
+                        case vmLessEqualDouble:
+                                xAssert(sp >= 2);
+                                types[--sp - 1] = unknownType; // True or False
+                                break;
+
+                        case vmNegateDouble:
+                        case vmAbsDouble:
+                        case vmExpDouble:
+                        case vmLogDouble:
+                        case vmInverseDouble:
+                        case vmSqrtDouble:
+                        case vmSigmoidDouble:
+                        case vmRoundFloat:
+                        case vmIntToDouble:
+                                xAssert(sp >= 1);
+                                types[sp - 1] = xDoubleId;
+                                break;
+
+                        case vmDoubleToInt:
+                                xAssert(sp >= 1);
+                                types[sp - 1] = xIntId;
+                                break;
+
+                        default:
+                                xAssert(false);
+                        }
+                        xAssert(sp <= nrSlots);
+                }
+        }
+cleanup:
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      peephole                                                        |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Record the opcode pairs and triples within basic blocks
  */
+static
+void countSequences(int *sequences, const int *code, int len, const char *isTarget, const char *isRedundant)
+{
+        const int n = vmNrInstructions;
+        int a = -1, b = -1;
+
+        for (int pc=vmHeaderSize; pc<len; pc+=vmInstructions[code[pc]].length) {
+                if (isTarget[pc]) {
+                        a = b = -1;
+                }
+                if (isRedundant[pc]) {
+                        continue;
+                }
+                int c = code[pc];
+                if (b >= 0) {
+                        sequences[b * n + c]++;
+                }
+                if (a >= 0) {
+                        sequences[n * n + (a * n + b) * n + c]++;
+                }
+                a = b;
+                b = c;
+        }
+}
 
 static
-err_t compileExpression(struct tokenize *T, struct vm *out)
+bool matchSequence(const struct superinstruction *s, const int *code, int pc, int len,
+        const char *isTarget, const char *isRedundant)
+{
+        for (int j=0; j<s->len; j++) {
+                bool target = false;
+                while (pc < len && isRedundant[pc]) {
+                        target |= isTarget[pc];
+                        pc += vmInstructions[code[pc]].length;
+                }
+                if (pc >= len || (j > 0 && (target || isTarget[pc])) || code[pc] != s->sequence[j]) {
+                        return false;
+                }
+                pc += vmInstructions[code[pc]].length;
+        }
+        return true;
+}
+
+/*
+ *  Replace frequent instruction sequences by superinstructions, leave out
+ *  the checks that inferTypes found redundant, and relocate the jumps.
+ *  Sequences never extend over a jump target.
+ */
+static
+err_t peephole(struct xRap *rap, intList *code, struct sourceMap *map)
 {
         err_t err = OK;
 
-        switch (T->tokenId) {
+        struct xArena *arena = &rap->arena;
+        int len = code->len;
+        char *isTarget, *isRedundant;
+        int *newPc;
 
-        case tokenOpen:
-                skip(T, tokenOpen);
-                skipSpaces(T);
+        err = xArenaAlloc(arena, (len + 1) * sizeof(char), (void **) &isTarget);
+        check(err);
+        memset(isTarget, 0, (len + 1) * sizeof(char));
+        err = xArenaAlloc(arena, (len + 1) * sizeof(char), (void **) &isRedundant);
+        check(err);
+        memset(isRedundant, 0, (len + 1) * sizeof(char));
+        err = xArenaAlloc(arena, (len + 1) * sizeof(int), (void **) &newPc);
+        check(err);
 
-                if (T->tokenId != tokenOpcode) {
-                        xRaise("Opcode expected");
+        for (int pc=vmHeaderSize; pc<len; pc+=vmInstructions[code->v[pc]].length) {
+                int jump = vmInstructions[code->v[pc]].jump;
+                if (jump > 0) {
+                        int target = pc + code->v[pc+jump] / (int)sizeof(int);
+                        xAssert(vmHeaderSize <= target && target <= len);
+                        isTarget[target] = 1;
                 }
+        }
 
-                err = jumpTable[T->tokenValue](T, out);
+        if (rap->optimize & xOptimizeTypes) {
+                err = inferTypes(rap, code->v, len, isTarget, isRedundant);
                 check(err);
+        }
 
-                if (T->tokenId != tokenClose) {
-                        xRaise("Error: too many arguments");\
+        if (rap->sequences != NULL) {
+                countSequences(rap->sequences, code->v, len, isTarget, isRedundant);
+        }
+
+        if ((rap->optimize & (xOptimizeSuperinstructions | xOptimizeTypes)) == 0) {
+                goto cleanup;
+        }
+        bool fuse = (rap->optimize & xOptimizeSuperinstructions) != 0;
+
+        // Rewrite into a fresh list. The code doesn't grow, so one check
+        // for room suffices.
+        intList in = *code;
+        *code = (intList) emptyList;
+        void *v = NULL;
+        err = xArenaGrow(arena, &v, &code->maxLen, len, sizeof(int));
+        check(err);
+        code->v = v;
+        for (int i=0; i<vmHeaderSize; i++) {
+                code->v[code->len++] = in.v[i];
+        }
+
+        for (int pc=vmHeaderSize; pc<len; ) {
+                newPc[pc] = code->len;
+
+                if (isRedundant[pc]) {
+                        pc += vmInstructions[in.v[pc]].length;
+                        continue;
                 }
 
-                skip(T, tokenClose);
-                skipSpaces(T);
-                break;
+                const struct superinstruction *s = NULL;
+                for (int i=0; i<arrayLen(superinstructions) && s==NULL && fuse; i++) {
+                        if (matchSequence(&superinstructions[i], in.v, pc, len, isTarget, isRedundant)) {
+                                s = &superinstructions[i];
+                        }
+                }
 
-        case tokenOpcode:
-                xRaise("Not implemented");
+                if (s != NULL) {
+                        int start = code->len;
+                        code->v[code->len++] = s->opcode;
+                        for (int j=0; j<s->len; j++) {
+                                while (isRedundant[pc]) {
+                                        newPc[pc] = start;
+                                        pc += vmInstructions[in.v[pc]].length;
+                                }
+                                int length = vmInstructions[in.v[pc]].length;
+                                int jump = vmInstructions[in.v[pc]].jump;
+                                for (int k=1; k<length; k++) {
+                                        // Jumps become absolute for now
+                                        code->v[code->len++] = in.v[pc+k] + ((k == jump) ? pc * (int)sizeof(int) : 0);
+                                }
+                                newPc[pc] = start;
+                                pc += length;
+                        }
+                        xAssert(code->len - start == vmInstructions[s->opcode].length);
+                } else {
+                        int length = vmInstructions[in.v[pc]].length;
+                        int jump = vmInstructions[in.v[pc]].jump;
+                        for (int k=0; k<length; k++) {
+                                code->v[code->len++] = in.v[pc+k] + ((k == jump && k > 0) ? pc * (int)sizeof(int) : 0);
+                        }
+                        pc += length;
+                }
+        }
+        newPc[len] = code->len;
+
+        // Relocate jumps
+        for (int pc=vmHeaderSize; pc<code->len; pc+=vmInstructions[code->v[pc]].length) {
+                int jump = vmInstructions[code->v[pc]].jump;
+                if (jump > 0) {
+                        int target = code->v[pc+jump] / (int)sizeof(int);
+                        code->v[pc+jump] = (newPc[target] - pc) * sizeof(int);
+                }
+        }
 
-        case tokenSymbol:
-                err = compileSymbol(T, out);
+        if (map != NULL) {
+                err = relocateSourceMap(arena, map, in.v, len, newPc);
                 check(err);
-                break;
-
-        default:
-                xRaise("Expression expected");
         }
-        skipSpaces(T);
+
 cleanup:
         return err;
 }
 
-static err_t compileInt(struct tokenize *T, struct vm *out)
+/*
+ *  Print the most frequent sequences as candidate superinstructions
+ */
+void printSequences(FILE *fp, const int *sequences)
+{
+        const int n = vmNrInstructions;
+        int printed[20];
+        const int top = arrayLen(printed);
+
+        fprintf(fp, "Most frequent instruction sequences:\n");
+        for (int i=0; i<top; i++) {
+                int best = -1;
+                for (int j=0; j<n*n + n*n*n; j++) {
+                        bool seen = false;
+                        for (int k=0; k<i; k++) {
+                                seen |= (printed[k] == j);
+                        }
+                        if (!seen && sequences[j] > 0 && (best < 0 || sequences[j] > sequences[best])) {
+                                best = j;
+                        }
+                }
+                if (best < 0) break;
+                printed[i] = best;
+
+                int len = (best < n*n) ? 2 : 3;
+                int k = (best < n*n) ? best : best - n*n;
+                int sequence[3] = { k / (n*n), (k / n) % n, k % n };
+                if (len == 2) {
+                        sequence[0] = sequence[1];
+                        sequence[1] = sequence[2];
+                }
+
+                fprintf(fp, "%8d  { vm..., %d, {", sequences[best], len);
+                for (int j=0; j<len; j++) {
+                        fprintf(fp, " %s%s", vmInstructions[sequence[j]].name, (j < len-1) ? "," : "");
+                }
+                fprintf(fp, " } },\n");
+        }
+}
+
+/*----------------------------------------------------------------------+
+ |      compileLine                                                     |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  End the code with vmReturn, then optimize and verify it
+ */
+static
+err_t finishCode(struct vm *out)
 {
         err_t err = OK;
 
-        skip(T, tokenOpcode);
-        skipSpaces(T);
+        err = emitReturn(out);
+        check(err);
 
-        skip(T, tokenInt);
-        skipSpaces(T);
+        out->code->v[vmHeaderLocals] = out->maxSp;
 
-        err = emitLoadint(out, T->tokenValue);
+        err = peephole(out->rap, out->code, out->map);
+        check(err);
+
+        err = xVerifyCode(out->rap, out->code->v, out->code->len);
         check(err);
 cleanup:
         return err;
 }
 
-err_t compileLine(struct tokenize *T, intList *code)
+err_t compileLine(struct xRap *rap, struct tokenize *T, intList *code, struct sourceMap *map)
 {
         err_t err = OK;
 
+        // Everything but the result lives in the arena until the next line
+        xArenaReset(&rap->arena);
+        intList work = emptyList;
+
         struct vm out = {
+                .rap = rap,
                 .sp = 0,
                 .maxSp = 0,
-                .code = code,
+                .code = &work,
                 .jumps = emptyList,
+                .loopSp = -1,
+                .continuePc = -1,
+                .constants = 0,
+                .hoisted = emptyList,
+                .reduced = emptyList,
+                .inserted = emptyList,
+                .types = emptyList,
+                .map = map,
+                .expression = -1,
+                .isFunction = false,
         };
 
-        code->len = 0;
-        listPush(*code, 0); // dummy, to become local storage length
+        err = reserve(&out, vmHeaderSize);
+        check(err);
+        emit(&out, 0); // dummy, to become local storage length
+        emit(&out, 0); // flags
+        emit(&out, 0); // arguments
+
+        if (map != NULL) {
+                map->expressions.len = 0;
+                map->ranges.len = 0;
+                err = markSource(&out);
+                check(err);
+        }
 
         while (T->tokenId != tokenClose && T->tokenId != tokenEnd) {
                 err = compileExpression(T, &out);
                 check(err);
         }
 
-        err = emitReturn(&out);
+        if (out.maxSp == 0) {
+                // Only definitions
+                err = emitLoadint(&out, 0);
+                check(err);
+        }
+
+        err = finishCode(&out);
         check(err);
 
-        code->v[0] = out.maxSp;
+        // Copy the result out, reusing the caller's list when it is large enough
+        code->len = 0;
+        if (work.len > code->maxLen) {
+                void *v = code->v;
+                err = list_ensure_len(&v, &code->maxLen, work.len, sizeof(int), firstListSize / sizeof(int));
+                check(err);
+                code->v = v;
+        }
+        memcpy(code->v, work.v, work.len * sizeof(int));
+        code->len = work.len;
 cleanup:
-
-        freeList(out.jumps);
-
         return err;
 }
 
+bool isDefinition(struct tokenize *T)
+{
+        struct tokenize S = *T;
+        while (S.tokenId >= 0 && S.tokenId != tokenEnd) {
+                if (S.tokenId == tokenOpcode && jumpTable[S.tokenValue] == compileFun) {
+                        return true;
+                }
+                next(&S);
+        }
+        return false;
+}
+
 static err_t compileT(struct tokenize *T, struct vm *out) { err_t err; xRaise("Not implemented"); cleanup: return err; }
 static err_t compileF(struct tokenize *T, struct vm *out) { err_t err; xRaise("Not implemented"); cleanup: return err; }
 static err_t compileZ(struct tokenize *T, struct vm *out) { err_t err; xRaise("Not implemented"); cleanup: return err; }
-static err_t compileFlt(struct tokenize *T, struct vm *out) { err_t err; xRaise("Not implemented"); cleanup: return err; }
-static err_t compileDbl(struct tokenize *T, struct vm *out) { err_t err; xRaise("Not implemented"); cleanup: return err; }
+
+/*
+ *  (dbl <number>) and (flt <number>) are literals, where flt rounds to
+ *  single precision. With an expression instead, dbl converts an int and
+ *  flt rounds a double.
+ */
+static
+err_t compileFloating(struct tokenize *T, struct vm *out, bool single)
+{
+        err_t err = OK;
+
+        skip(T, tokenOpcode);
+        skipSpaces(T);
+
+        if (T->tokenId == tokenInt || T->tokenId == tokenFloat) {
+                double value = strtod(T->source, NULL);
+                next(T);
+                skipSpaces(T);
+                err = emitDouble(out, single ? (double) (float) value : value);
+                check(err);
+        } else {
+                err = compileExpression(T, out);
+                check(err);
+                if (single) {
+                        err = emitDoubleOp(out, vmRoundFloat, 1);
+                } else {
+                        err = emitConversion(out, vmIntToDouble, xIntId, xDoubleId);
+                }
+                check(err);
+        }
+cleanup:
+        return err;
+}
+
+static err_t compileFlt(struct tokenize *T, struct vm *out) { return compileFloating(T, out, true); }
+static err_t compileDbl(struct tokenize *T, struct vm *out) { return compileFloating(T, out, false); }
 
 static err_t compileMove(struct tokenize *T, struct vm *out) { err_t err; xRaise("Not implemented"); cleanup: return err; }
 static err_t compileSwap(struct tokenize *T, struct vm *out) { err_t err; xRaise("Not implemented"); cleanup: return err; }
@@ -585,6 +2506,42 @@ cleanup:
 
 static err_t compileDec(struct tokenize *T, struct vm *out) { err_t err; xRaise("Not implemented"); cleanup: return err; }
 
+/*
+ *  Floating point: all operands are doubles
+ */
+static
+err_t compileDoubleOp(struct tokenize *T, struct vm *out, int opcode, int n)
+{
+        err_t err = OK;
+
+        skip(T, tokenOpcode);
+        skipSpaces(T);
+        for (int i=0; i<n; i++) {
+                err = compileExpression(T, out);
+                check(err);
+        }
+        err = emitDoubleOp(out, opcode, n);
+        check(err);
+cleanup:
+        return err;
+}
+
+static err_t compileFadd(struct tokenize *T, struct vm *out) { return compileDoubleOp(T, out, vmAddDouble, 2); }
+static err_t compileFsub(struct tokenize *T, struct vm *out) { return compileDoubleOp(T, out, vmSubtractDouble, 2); }
+static err_t compileFmul(struct tokenize *T, struct vm *out) { return compileDoubleOp(T, out, vmMultiplyDouble, 2); }
+static err_t compileFdiv(struct tokenize *T, struct vm *out) { return compileDoubleOp(T, out, vmDivideDouble, 2); }
+static err_t compileFneg(struct tokenize *T, struct vm *out) { return compileDoubleOp(T, out, vmNegateDouble, 1); }
+static err_t compileFabs(struct tokenize *T, struct vm *out) { return compileDoubleOp(T, out, vmAbsDouble, 1); }
+static err_t compileFmax(struct tokenize *T, struct vm *out) { return compileDoubleOp(T, out, vmMaxDouble, 2); }
+static err_t compileFmin(struct tokenize *T, struct vm *out) { return compileDoubleOp(T, out, vmMinDouble, 2); }
+static err_t compileFexp(struct tokenize *T, struct vm *out) { return compileDoubleOp(T, out, vmExpDouble, 1); }
+static err_t compileFln(struct tokenize *T, struct vm *out) { return compileDoubleOp(T, out, vmLogDouble, 1); }
+static err_t compileFinv(struct tokenize *T, struct vm *out) { return compileDoubleOp(T, out, vmInverseDouble, 1); }
+static err_t compileFsqt(struct tokenize *T, struct vm *out) { return compileDoubleOp(T, out, vmSqrtDouble, 1); }
+static err_t compileFsig(struct tokenize *T, struct vm *out) { return compileDoubleOp(T, out, vmSigmoidDouble, 1); }
+static err_t compileFma(struct tokenize *T, struct vm *out) { return compileDoubleOp(T, out, vmMultiplyAddDouble, 3); }
+static err_t compileFle(struct tokenize *T, struct vm *out) { return compileDoubleOp(T, out, vmLessEqualDouble, 2); }
+
 static err_t compileNot(struct tokenize *T, struct vm *out) { err_t err; xRaise("Not implemented"); cleanup: return err; }
 static err_t compileAnd(struct tokenize *T, struct vm *out) { err_t err; xRaise("Not implemented"); cleanup: return err; }
 static err_t compileOr(struct tokenize *T, struct vm *out) { err_t err; xRaise("Not implemented"); cleanup: return err; }
@@ -614,7 +2571,46 @@ cleanup:
         return err;
 }       
 
-static err_t compileRet(struct tokenize *T, struct vm *out) { err_t err; xRaise("Not implemented"); cleanup: return err; }
+/*
+ *  Return a value from a function, or end the program with it. A call
+ *  in a function becomes a tail call, which reuses the frame.
+ */
+static err_t compileRet(struct tokenize *T, struct vm *out)
+{
+        err_t err = OK;
+
+        skip(T, tokenOpcode); // "ret"
+        skipSpaces(T);
+
+        int sp = out->sp;
+        struct tokenize S = *T;
+        if (out->isFunction && accept(&S, tokenOpen, 0) && acceptOpcode(&S, compileCall)) {
+                *T = S;
+                int argc = 0;
+                do {
+                        err = compileExpression(T, out);
+                        check(err);
+                        argc++;
+                } while (T->tokenId != tokenClose);
+
+                skip(T, tokenClose);
+                skipSpaces(T);
+
+                err = emitTailCall(out, argc);
+                check(err);
+        } else {
+                err = compileExpression(T, out);
+                check(err);
+                err = emitSetLocal(out, 0);
+                check(err);
+                err = emitReturn(out);
+                check(err);
+        }
+
+        out->sp = sp; // For the code that follows, which is unreachable
+cleanup:
+        return err;
+}
 
 static err_t compileIf(struct tokenize *T, struct vm *out) { err_t err; xRaise("Not implemented"); cleanup: return err; }
 
@@ -632,20 +2628,20 @@ static err_t compileIfn(struct tokenize *T, struct vm *out)
         err = emitJumpT(out, jumpPc); // dummy operand
         check(err);
 
-        int n = 0;
+        int bodySp = out->sp;
         while (T->tokenId != tokenClose) {
-                err = compileExpression(T, out); // condition
+                err = compileExpression(T, out);
                 check(err);
-                n++;
         }
 
-        err = emitDrop(out, n);
+        err = emitDrop(out, out->sp - bodySp);
         check(err);
 
         xAssert(out->code->v[jumpPc+0] == vmJumpT);
         xAssert(out->code->v[jumpPc+1] == 0);
 
         out->code->v[jumpPc+1] = (out->code->len - jumpPc) * sizeof(int);
+        markTarget(out);
 cleanup:
         return err;
 }
@@ -662,25 +2658,57 @@ static err_t compileLoop(struct tokenize *T, struct vm *out)
         err_t err = OK;
 
         int oldJumpsLen = out->jumps.len;
+        int oldLoopSp = out->loopSp;
+        int oldContinuePc = out->continuePc;
+        int oldHoistedLen = out->hoisted.len;
+        int oldReducedLen = out->reduced.len;
+        int oldInsertedLen = out->inserted.len;
 
         skip(T, tokenOpcode); // "loop"
         skipSpaces(T);
 
-        int startLoop = out->code->len;
-
-        // Loop body
-        int n = 0;
-        do {
-                err = compileExpression(T, out);
+        int sp = out->sp;
+        int nrLocals = 0; // Computed before the loop
+        struct countedLoop counted = { .counter = -1 };
+        bool isCounted = false;
+        if (out->rap->optimize & xOptimizeLoops) {
+                err = optimizeLoop(T, out, &nrLocals);
                 check(err);
-                n++;
-        } while (T->tokenId != tokenClose);
+                isCounted = matchCountedLoop(*T, out, sp, &counted);
+        }
+        if (isCounted && counted.limit < 0) {
+                err = emitLoadint(out, counted.value);
+                check(err);
+                counted.limit = out->sp - 1;
+                nrLocals++;
+        }
+        if (nrLocals > 0) {
+                // Out of sight of the source
+                struct inserted inserted = { .at = sp, .n = nrLocals };
+                arenaPush(&out->rap->arena, out->inserted, inserted);
+        }
 
-        // Jump back
-        emitDrop(out, n);
-        emitJump(out, startLoop);
+        int startLoop = out->code->len;
+        out->loopSp = out->sp;
+        out->continuePc = startLoop;
+        markTarget(out);
 
-        out->sp -= n;
+        if (isCounted) {
+                err = compileCountedLoop(T, out, &counted);
+                check(err);
+        } else {
+                // Loop body
+                do {
+                        err = compileExpression(T, out);
+                        check(err);
+                } while (T->tokenId != tokenClose);
+
+                // Jump back
+                err = emitDrop(out, out->sp - out->loopSp);
+                check(err);
+                err = emitJump(out, startLoop);
+                check(err);
+        }
 
         // Fill in the operands of vmJump instructions that break the loop
         int endLoop = out->code->len;
@@ -690,9 +2718,17 @@ static err_t compileLoop(struct tokenize *T, struct vm *out)
                 xAssert(out->code->v[pc+1] == 0);
                 out->code->v[pc+1] = (endLoop - pc) * sizeof(int);
         }
+        markTarget(out);
 
+        err = emitDrop(out, nrLocals);
+        check(err);
 cleanup:
         out->jumps.len = oldJumpsLen;
+        out->loopSp = oldLoopSp;
+        out->continuePc = oldContinuePc;
+        out->hoisted.len = oldHoistedLen;
+        out->reduced.len = oldReducedLen;
+        out->inserted.len = oldInsertedLen;
 
         return err;
 }
@@ -704,16 +2740,50 @@ static err_t compileBrk(struct tokenize *T, struct vm *out)
         skip(T, tokenOpcode); // "brk"
         skipSpaces(T);
 
-        // TODO: drop?!
+        if (out->loopSp < 0) {
+                xRaise("Error: brk outside loop");
+        }
+
+        // Leave the stack as it was at the start of the loop
+        int sp = out->sp;
+        err = emitDrop(out, out->sp - out->loopSp);
+        check(err);
 
         // Remember this location so we can fill in the operand later when we know it
-        listPush(out->jumps, out->code->len);
-        emitJump(out, out->code->len); // Operand is just a dummy for now
+        arenaPush(&out->rap->arena, out->jumps, out->code->len);
+        err = emitJump(out, out->code->len); // Operand is just a dummy for now
+        check(err);
+
+        out->sp = sp; // For the code that follows, which is unreachable
 cleanup:
         return err;
 }
 
-static err_t compileCont(struct tokenize *T, struct vm *out) { err_t err; xRaise("Not implemented"); cleanup: return err; }
+/*
+ *  Start the next round of the innermost loop. In a counted loop, that
+ *  is the test: the body didn't reach the step.
+ */
+static err_t compileCont(struct tokenize *T, struct vm *out)
+{
+        err_t err = OK;
+
+        skip(T, tokenOpcode); // "cont"
+        skipSpaces(T);
+
+        if (out->loopSp < 0) {
+                xRaise("Error: cont outside loop");
+        }
+
+        int sp = out->sp;
+        err = emitDrop(out, out->sp - out->loopSp);
+        check(err);
+        err = emitJump(out, out->continuePc);
+        check(err);
+
+        out->sp = sp; // For the code that follows, which is unreachable
+cleanup:
+        return err;
+}
 
 static err_t compileGetl(struct tokenize *T, struct vm *out)
 {
@@ -725,7 +2795,7 @@ static err_t compileGetl(struct tokenize *T, struct vm *out)
         skip(T, tokenInt);
         skipSpaces(T);
 
-        err = emitGetLocal(out, T->tokenValue);
+        err = emitGetLocal(out, localOffset(out, T->tokenValue));
         check(err);
 cleanup:
         return err;
@@ -741,13 +2811,16 @@ static err_t compileSetl(struct tokenize *T, struct vm *out)
         skip(T, tokenInt);
         skipSpaces(T);
 
-        int offset = T->tokenValue;
+        int offset = localOffset(out, T->tokenValue);
 
         err = compileExpression(T, out);
         check(err);
 
         err = emitSetLocal(out, offset);
         check(err);
+
+        err = stepReduced(out, offset);
+        check(err);
 cleanup:
         return err;
 }
@@ -768,6 +2841,92 @@ cleanup:
         return err;
 }
 
+/*
+ *  (fun `name n body ...) defines a function of n arguments when it is
+ *  compiled, and leaves nothing on the stack. The body gets its own
+ *  frame: local 0 is the function itself, followed by the arguments. It
+ *  gives the value of its last expression, or 0 when there is none.
+ */
+static err_t compileFun(struct tokenize *T, struct vm *out)
+{
+        err_t err = OK;
+        int *copy = NULL;
+
+        skip(T, tokenOpcode); // "fun"
+        skipSpaces(T);
+
+        // Before the body, so that it can call itself
+        if (T->tokenId != tokenSymbol) {
+                xRaise("Error: bad syntax (tokenSymbol expected)");
+        }
+        int symbol;
+        err = xIntern(out->rap, T->source+1, T->tokenLen-1, &symbol);
+        check(err);
+        skip(T, tokenSymbol);
+        skipSpaces(T);
+
+        int nrArguments = T->tokenValue;
+        skip(T, tokenInt);
+        skipSpaces(T);
+        if (nrArguments < 0 || nrArguments >= xStackSize) {
+                xRaise("Error: bad number of arguments");
+        }
+
+        intList work = emptyList;
+        struct vm body = {
+                .rap = out->rap,
+                .sp = 1 + nrArguments,
+                .maxSp = 1 + nrArguments,
+                .code = &work,
+                .jumps = emptyList,
+                .loopSp = -1,
+                .continuePc = -1,
+                .constants = 0,
+                .hoisted = emptyList,
+                .reduced = emptyList,
+                .inserted = emptyList,
+                .types = emptyList,
+                .map = NULL,
+                .expression = -1,
+                .isFunction = true,
+        };
+
+        err = reserve(&body, vmHeaderSize);
+        check(err);
+        emit(&body, 0); // locals
+        emit(&body, 0); // flags
+        emit(&body, 1 + nrArguments);
+
+        while (T->tokenId != tokenClose) {
+                err = compileExpression(T, &body);
+                check(err);
+        }
+
+        if (body.sp == 1 + nrArguments) {
+                err = emitLoadint(&body, 0);
+                check(err);
+        }
+        err = emitSetLocal(&body, 0);
+        check(err);
+
+        err = finishCode(&body);
+        check(err);
+
+        // The code outlives the arena
+        copy = malloc(work.len * sizeof(int));
+        if (copy == NULL) {
+                xRaise("Out of memory");
+        }
+        memcpy(copy, work.v, work.len * sizeof(int));
+
+        err = xDefine(out->rap, symbol, copy, work.len);
+        check(err);
+        copy = NULL;
+cleanup:
+        free(copy);
+        return err;
+}
+
 /*----------------------------------------------------------------------+
  |                                                                      |
  +----------------------------------------------------------------------*/
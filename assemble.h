@@ -5,8 +5,35 @@
  |                                                                      |
  +----------------------------------------------------------------------*/
 
+/*
+ *  Opcode recognition, selectable at build time
+ *   0  linear search through opcodes[]
+ *   1  perfect hash over the packed characters of the word
+ */
+#ifndef xOpcodeHash
+ #define xOpcodeHash 1
+#endif
+
+enum tokenType {
+        tokenOpen,
+        tokenClose,
+        tokenOpcode,
+        tokenSpace,
+        tokenColon,
+        tokenInt,
+        tokenHexInt,
+        tokenFloat,
+        tokenHexFloat,
+        tokenSymbol,
+        tokenGet,
+        tokenSet,
+        tokenEnd,
+};
+
 struct tokenize {
+        const char *start;      // Set by tokenizeStart, for source offsets
         const char *source;
+        const char *end;        // Or NULL when the source is null terminated
         int tokenLen;
         int tokenId;
         int tokenValue;
@@ -16,13 +43,66 @@ struct tokenize {
  |      Functions                                                       |
  +----------------------------------------------------------------------*/
 
+/*
+ *  Build the opcode tables. Called by xInit.
+ */
+err_t initAssembler(void);
+
 err_t tokenizeStart(struct tokenize *T);
 
+/*
+ *  Identify the token at T->source. Gives its tokenType, or -1.
+ */
+int nextToken(struct tokenize *T);
+
 /*----------------------------------------------------------------------+
  |      compile                                                         |
  +----------------------------------------------------------------------*/
 
-err_t compileLine(struct tokenize *T, intList *code);
+/*
+ *  Source positions of compiled code, for profilers. Offsets are relative
+ *  to the start of the tokenizer. Expressions are numbered in order of
+ *  their opening parenthesis, so parents come before their children.
+ */
+struct sourceExpression {
+        int start;              // Offset of the `('
+        int end;                // Offset after the `)'
+        int parent;             // Index of the enclosing expression, or -1
+};
+
+struct sourceRange {
+        int pc;                 // Instructions from here up to the next range
+        int expression;         // Innermost expression they belong to, or -1
+};
+
+struct sourceMap {
+        List(struct sourceExpression) expressions;
+        List(struct sourceRange) ranges; // By increasing pc
+};
+
+/*
+ *  Compile up to the end of the source or an unmatched `)'. Fills `map'
+ *  unless it is NULL. The code is verified, see verify.h.
+ */
+err_t compileLine(struct xRap *rap, struct tokenize *T, intList *code, struct sourceMap *map);
+
+/*
+ *  Whether the source from T up to its end uses `fun'. Such programs
+ *  define their functions while they are compiled.
+ */
+bool isDefinition(struct tokenize *T);
+
+/*
+ *  Innermost expression of the instruction at `pc', or -1
+ */
+int sourceExpressionAt(const struct sourceMap *map, int pc);
+
+void freeSourceMap(struct sourceMap *map);
+
+/*
+ *  Print the most frequent sequences in the histogram of struct xRap
+ */
+void printSequences(FILE *fp, const int *sequences);
 
 /*----------------------------------------------------------------------+
  |                                                                      |
@@ -0,0 +1,796 @@
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ |      bench.c -- benchmark suite for the compiler and the VM          |
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Output is one JSON object per line: first the build configuration,
+ *  then one per workload with the time per operation over a number of
+ *  runs, after one warm-up run. Instruction counts are only available
+ *  when built with xCountInstructions, as `make bench' does.
+ */
+
+#define _POSIX_C_SOURCE 199309L // For clock_gettime
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cplus.h"
+
+#include "rap.h"
+
+#include "array.h"
+#include "assemble.h"
+#include "bytecode.h"
+#include "library.h"
+
+/*----------------------------------------------------------------------+
+ |      Definitions                                                     |
+ +----------------------------------------------------------------------*/
+
+#define maxRuns 100
+
+struct bench {
+        struct xRap *rap;
+        int runs;
+        int nrFilters;
+        char **filters;         // Run only workloads starting with one of these
+};
+
+struct result {
+        char name[32];
+        const char *unit;       // What one operation is
+        long ops;               // Operations per run
+        double ns[maxRuns];     // Time of each run
+        double instructions;    // Executed per run
+        char extra[64];         // More JSON members, or empty
+};
+
+static const char usage[] =
+        "Usage: rapbench [-n runs] [workload ...]\n"
+        "  -n runs    repetitions of each workload (default 5)\n"
+        "  workload   run only the workloads with names starting with this\n";
+
+/*----------------------------------------------------------------------+
+ |      Helpers                                                         |
+ +----------------------------------------------------------------------*/
+
+static
+double now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static
+bool selected(const struct bench *b, const char *name)
+{
+        if (b->nrFilters == 0) {
+                return true;
+        }
+        for (int i=0; i<b->nrFilters; i++) {
+                if (0==strncmp(name, b->filters[i], strlen(b->filters[i]))) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+static
+void report(const struct bench *b, const struct result *r)
+{
+        double mean = 0.0;
+        double min = HUGE_VAL;
+        for (int i=0; i<b->runs; i++) {
+                double ns = r->ns[i] / r->ops;
+                mean += ns;
+                min = (ns < min) ? ns : min;
+        }
+        mean /= b->runs;
+
+        double variance = 0.0;
+        for (int i=0; i<b->runs; i++) {
+                double d = r->ns[i] / r->ops - mean;
+                variance += d * d;
+        }
+        variance /= (b->runs > 1) ? b->runs - 1 : 1;
+
+        printf("{\"name\":\"%s\",\"unit\":\"%s\",\"ops\":%ld,\"runs\":%d,"
+                "\"mean_ns\":%.3f,\"stddev_ns\":%.3f,\"min_ns\":%.3f,\"ops_per_s\":%.0f",
+                r->name, r->unit, r->ops, b->runs,
+                mean, sqrt(variance), min, 1e9 / mean);
+
+        if (xCountInstructions && r->instructions > 0) {
+                printf(",\"instructions\":%.1f,\"instructions_per_s\":%.0f",
+                        r->instructions / r->ops,
+                        r->instructions / r->ops / mean * 1e9);
+        }
+        if (r->extra[0] != '\0') {
+                printf(",%s", r->extra);
+        }
+        printf("}\n");
+        fflush(stdout);
+}
+
+/*
+ *  Compile one line of source and prepare it for xExecute
+ */
+static
+err_t compile(struct bench *b, const char *source, intList *code)
+{
+        err_t err = OK;
+
+        struct tokenize tokenize = {
+                .source = source,
+        };
+
+        err = tokenizeStart(&tokenize);
+        check(err);
+
+        err = compileLine(b->rap, &tokenize, code, NULL);
+        check(err);
+
+        err = xThreadCode(code->v, code->len);
+        check(err);
+cleanup:
+        return err;
+}
+
+/*
+ *  Time `invocations' calls of xExecute per run. Without a unit in `r',
+ *  the operation is one call.
+ */
+static
+err_t execute(struct bench *b, struct result *r, const char *source, int invocations)
+{
+        err_t err = OK;
+
+        intList code = emptyList;
+
+        if (!selected(b, r->name)) {
+                goto cleanup;
+        }
+
+        err = compile(b, source, &code);
+        check(err);
+
+        xValue_t result[2];
+
+        for (int run=-1; run<b->runs; run++) {
+                unsigned long long instructions = b->rap->instructions;
+                double start = now();
+                for (int i=0; i<invocations; i++) {
+                        err = xExecute(code.v, arrayLen(result) - 1, result + 1);
+                        check(err);
+                }
+                double stop = now();
+                if (run >= 0) {
+                        r->ns[run] = stop - start;
+                        r->instructions = b->rap->instructions - instructions;
+                }
+        }
+        xAssert(xIsInt(result[1]));
+
+        if (r->unit == NULL) {
+                r->unit = "execute";
+                r->ops = invocations;
+        }
+        report(b, r);
+
+cleanup:
+        freeList(code);
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      Execution workloads                                             |
+ +----------------------------------------------------------------------*/
+
+// Tight counted loop
+static
+err_t benchLoop(struct bench *b)
+{
+        struct result r = { .name = "loop" };
+        return execute(b, &r,
+                "(int 0)(loop(ifn(le(getl 0)(int 9999999))(brk))(setl 0(inc(getl 0))))",
+                1);
+}
+
+// Native function call in each iteration, through vmCall
+static
+err_t benchCalls(struct bench *b)
+{
+        struct result r = { .name = "calls" };
+        return execute(b, &r,
+                "(int 0)(int 0)(loop(ifn(le(getl 0)(int 999999))(brk))"
+                "(setl 1(call `subtractInt(getl 1)(int 1)))(setl 0(inc(getl 0))))",
+                1);
+}
+
+// Rap function calls that return, through vmCall and vmReturn
+static
+err_t benchRecursion(struct bench *b)
+{
+        struct result r = { .name = "recursion", .unit = "call", .ops = 10000 };
+        return execute(b, &r,
+                "(fun `down 1 (ifn (le (getl 1) (int 0)) (ret (inc (call `down (sub (getl 1) (int 1)))))) (int 0))"
+                "(call `down (int 9999))",
+                1);
+}
+
+// The same as tail calls, through vmTailCall
+static
+err_t benchTailCalls(struct bench *b)
+{
+        struct result r = { .name = "tailcalls", .unit = "call", .ops = 1000000 };
+        return execute(b, &r,
+                "(fun `count 2 (ifn (le (getl 1) (int 0)) (ret (call `count (sub (getl 1) (int 1)) (inc (getl 2))))) (getl 2))"
+                "(call `count (int 999999) (int 0))",
+                1);
+}
+
+// Overhead of xExecute itself
+static
+err_t benchShort(struct bench *b)
+{
+        struct result r = { .name = "short" };
+        return execute(b, &r,
+                "(call `subtractInt (int 2015) (sub (int 1973) (int 1)))",
+                100000);
+}
+
+// Unboxed floating point: a logistic score summed over a loop
+static
+err_t benchDoubles(struct bench *b)
+{
+        struct result r = { .name = "doubles", .unit = "iteration", .ops = 1000000 };
+        return execute(b, &r,
+                "(int 0)(dbl 0)(loop(ifn(le(getl 0)(int 999999))(brk))"
+                "(setl 1(fadd(getl 1)(fsig(fma(dbl(getl 0))(dbl 0.000001)(dbl 0.5)))))(setl 0(inc(getl 0))))",
+                1);
+}
+
+/*
+ *  A loop that increments `nrLocals' locals per iteration. The total
+ *  number of updates is the same for each size, so the time per update
+ *  shows how well the frame fits in the caches.
+ */
+static
+err_t benchLocals(struct bench *b, int nrLocals)
+{
+        err_t err = OK;
+
+        char *source = NULL;
+
+        struct result r = {
+                .unit = "update",
+                .ops = 1L << 24,
+        };
+        snprintf(r.name, sizeof(r.name), "locals-%d", nrLocals);
+        snprintf(r.extra, sizeof(r.extra), "\"frame_bytes\":%zu", nrLocals * sizeof(xValue_t));
+        if (!selected(b, r.name)) {
+                goto cleanup;
+        }
+
+        int iterations = r.ops / nrLocals;
+
+        size_t size = 64 + nrLocals * 48;
+        source = malloc(size);
+        if (source == NULL) {
+                xRaise("Out of memory");
+        }
+
+        char *s = source;
+        for (int i=0; i<nrLocals; i++) {
+                s += sprintf(s, "(int 0)");
+        }
+        s += sprintf(s, "(loop(ifn(le(getl 0)(int %d))(brk))", iterations - 1);
+        for (int i=1; i<nrLocals; i++) {
+                s += sprintf(s, "(setl %d(inc(getl %d)))", i, i);
+        }
+        s += sprintf(s, "(setl 0(inc(getl 0))))");
+
+        err = execute(b, &r, source, 1);
+        check(err);
+
+cleanup:
+        free(source);
+        return err;
+}
+
+/*
+ *  Arrays with pseudo-random elements, bound to symbols so that the
+ *  workloads can refer to them
+ */
+static
+err_t bindArray(struct bench *b, const char *name, int len, unsigned seed, struct xArray **array)
+{
+        err_t err = OK;
+
+        err = xNewArray(b->rap, len, array);
+        check(err);
+        for (int i=0; i<len; i++) {
+                seed = seed * 1103515245u + 12345u;
+                (*array)->v[i] = (int) (seed >> 8) - (1 << 23);
+        }
+
+        int index;
+        err = xIntern(b->rap, name, strlen(name), &index);
+        check(err);
+        b->rap->symbols.v[index].value = xArray(*array);
+cleanup:
+        return err;
+}
+
+/*
+ *  All kernel sets must give the results of the portable one for the
+ *  first `n' elements. `scratch' has room for 4n.
+ */
+static
+err_t checkKernels(const struct xArrayKernels *k, const int *a, const int *b, int n, int *scratch)
+{
+        err_t err = OK;
+
+        const struct xArrayKernels *s = xSelectArrayKernels("scalar");
+        int *expected = &scratch[2 * n];
+
+        void (* const pairs[][2])(int *, const int *, const int *, int) = {
+                { k->add, s->add }, { k->sub, s->sub }, { k->mul, s->mul }, { k->le, s->le },
+        };
+        void (* const ints[][2])(int *, const int *, int, int) = {
+                { k->addInt, s->addInt }, { k->subInt, s->subInt },
+                { k->mulInt, s->mulInt }, { k->leInt, s->leInt },
+        };
+        for (int i=0; i<arrayLen(pairs); i++) {
+                pairs[i][0](scratch, a, b, n);
+                pairs[i][1](expected, a, b, n);
+                ints[i][0](&scratch[n], a, b[0], n);
+                ints[i][1](&expected[n], a, b[0], n);
+                if (0!=memcmp(scratch, expected, 2 * n * sizeof(int))) {
+                        xRaise("Array kernels differ");
+                }
+        }
+        if (k->sum(a, n) != s->sum(a, n)
+         || k->dot(a, b, n) != s->dot(a, b, n)
+         || (n > 0 && k->minimum(a, n) != s->minimum(a, n))
+         || (n > 0 && k->maximum(a, n) != s->maximum(a, n))) {
+                xRaise("Array kernels differ");
+        }
+cleanup:
+        return err;
+}
+
+/*
+ *  Bulk array functions on a million elements, with each kernel set the
+ *  CPU supports. `bytes' is the memory traffic per element, so that
+ *  bytes / mean_ns gives GB/s. The kernels are checked first, for all
+ *  lengths up to a few vectors and for the whole arrays.
+ */
+static
+err_t benchArrays(struct bench *b)
+{
+        err_t err = OK;
+
+        static const char * const sets[] = { "scalar", "sse2", "avx2" };
+        static const struct {
+                const char *name;
+                const char *source;
+                int bytes;
+        } workloads[] = {
+                { "add",        "(int 0)(call `arrayAdd `c `a `b)",     12 },
+                { "addint",     "(int 0)(call `arrayAdd `c `a (int 7))", 8 },
+                { "mul",        "(int 0)(call `arrayMul `c `a `b)",     12 },
+                { "le",         "(int 0)(call `arrayLe `c `a `b)",      12 },
+                { "sum",        "(call `arraySum `a)",                  4 },
+                { "max",        "(call `arrayMax `a)",                  4 },
+                { "dot",        "(call `arrayDot `a `b)",               8 },
+        };
+
+        const struct xArrayKernels *kernels = b->rap->kernels;
+        const int len = 1000003;
+        const int invocations = 20;
+
+        char names[arrayLen(sets)][arrayLen(workloads)][32];
+        bool any = false;
+        for (int i=0; i<arrayLen(sets); i++) {
+                for (int j=0; j<arrayLen(workloads); j++) {
+                        snprintf(names[i][j], sizeof(names[i][j]), "array-%s-%s", workloads[j].name, sets[i]);
+                        any |= selected(b, names[i][j]);
+                }
+        }
+        if (!any) {
+                goto cleanup;
+        }
+
+        struct xArray *a, *bArray, *c, *scratch;
+        err = bindArray(b, "a", len, 1, &a);
+        check(err);
+        err = bindArray(b, "b", len, 2, &bArray);
+        check(err);
+        err = bindArray(b, "c", len, 3, &c);
+        check(err);
+        err = xNewArray(b->rap, 4 * len, &scratch);
+        check(err);
+
+        for (int i=0; i<arrayLen(sets); i++) {
+                const struct xArrayKernels *k = xSelectArrayKernels(sets[i]);
+                if (k == NULL) {
+                        continue;
+                }
+                for (int n=0; n<=40; n++) {
+                        err = checkKernels(k, a->v, bArray->v, n, scratch->v);
+                        check(err);
+                }
+                err = checkKernels(k, a->v, bArray->v, len, scratch->v);
+                check(err);
+
+                b->rap->kernels = k;
+                for (int j=0; j<arrayLen(workloads); j++) {
+                        struct result r = {
+                                .unit = "element",
+                                .ops = (long) len * invocations,
+                        };
+                        strcpy(r.name, names[i][j]);
+                        snprintf(r.extra, sizeof(r.extra), "\"bytes\":%d", workloads[j].bytes);
+                        err = execute(b, &r, workloads[j].source, invocations);
+                        check(err);
+                }
+        }
+
+cleanup:
+        b->rap->kernels = kernels;
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      Compiler workloads                                              |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Generated-looking source of about `size' bytes, as lines separated by
+ *  null characters and ending with an empty line. With `parse' only the
+ *  lines the compiler accepts are used.
+ */
+static
+err_t generateSource(size_t size, bool parse, char **source, int *nrLines)
+{
+        err_t err = OK;
+
+        static const char * const lines[] = {
+                "(int 123)",
+                "(call `printInt (call `subtractInt (int 2015) (sub (int 1973) (int 1))))",
+                "(int 1) (loop (ifn (le (getl 0) (int 10)) (brk)) (call `printInt (mul (int 7)(getl 0))) (setl 0 (inc (getl 0))))",
+                "(int 1)(int 2)(int 3)(int 4) (loop (ifn (le (getl 0) (int 1000)) (brk)) (setl 1 (inc (getl 1))) "
+                        "(setl 2 (mul (getl 1) (getl 2))) (setl 3 (sub (getl 3) (int 1))) (setl 0 (inc (getl 0))))",
+                // Tokens only
+                "(int $7f) (move) (swap) (neg (add (dec (getl 0)) (div (int 9) (int 3))))",
+                "(loop (ifeq (cont)) (ifne (brk)) (not (and (or (xor (shl (shr (rol (ror (int 1))))))))))",
+        };
+        const int nrParsable = 4;
+
+        char *s = malloc(size + 1);
+        if (s == NULL) {
+                xRaise("Out of memory");
+        }
+        *source = s;
+        *nrLines = 0;
+
+        for (int i=0; ; i++) {
+                const char *line = lines[i % (parse ? nrParsable : arrayLen(lines))];
+                size_t len = strlen(line);
+                if (s + len + 1 > *source + size) {
+                        break;
+                }
+                memcpy(s, line, len);
+                s += len;
+                *s++ = '\0';
+                (*nrLines)++;
+        }
+        *s = '\0';
+
+cleanup:
+        return err;
+}
+
+static
+err_t benchCompile(struct bench *b)
+{
+        err_t err = OK;
+
+        char *source = NULL;
+        intList code = emptyList;
+
+        struct result r = { .name = "compile", .unit = "line" };
+        if (!selected(b, r.name)) {
+                goto cleanup;
+        }
+
+        size_t size = 4 << 20;
+        int nrLines;
+        err = generateSource(size, true, &source, &nrLines);
+        check(err);
+        r.ops = nrLines;
+
+        for (int run=-1; run<b->runs; run++) {
+                double start = now();
+                for (const char *line=source; *line!='\0'; line+=strlen(line)+1) {
+                        struct tokenize tokenize = {
+                                .source = line,
+                        };
+                        err = tokenizeStart(&tokenize);
+                        check(err);
+                        err = compileLine(b->rap, &tokenize, &code, NULL);
+                        check(err);
+                }
+                double stop = now();
+                if (run >= 0) {
+                        r.ns[run] = stop - start;
+                }
+        }
+
+        snprintf(r.extra, sizeof(r.extra), "\"bytes\":%zu", size);
+        report(b, &r);
+
+cleanup:
+        freeList(code);
+        free(source);
+        return err;
+}
+
+/*
+ *  Compact encoding of the compiled lines, see bytecode.h. The sizes of
+ *  both encodings are reported with it.
+ */
+static
+err_t benchEncode(struct bench *b)
+{
+        err_t err = OK;
+
+        char *source = NULL;
+        intList code = emptyList;
+        byteList bytes = emptyList;
+
+        struct result r = { .name = "encode", .unit = "line" };
+        if (!selected(b, r.name)) {
+                goto cleanup;
+        }
+
+        size_t size = 1 << 20;
+        int nrLines;
+        err = generateSource(size, true, &source, &nrLines);
+        check(err);
+        r.ops = nrLines;
+
+        for (int run=-1; run<b->runs; run++) {
+                size_t codeBytes = 0;
+                size_t compactBytes = 0;
+                double ns = 0.0;
+                for (const char *line=source; *line!='\0'; line+=strlen(line)+1) {
+                        struct tokenize tokenize = {
+                                .source = line,
+                        };
+                        err = tokenizeStart(&tokenize);
+                        check(err);
+                        err = compileLine(b->rap, &tokenize, &code, NULL);
+                        check(err);
+
+                        double start = now();
+                        err = xEncodeBytes(code.v, code.len, &bytes);
+                        check(err);
+                        ns += now() - start;
+
+                        codeBytes += code.len * sizeof(int);
+                        compactBytes += bytes.len;
+                }
+                if (run >= 0) {
+                        r.ns[run] = ns;
+                }
+                snprintf(r.extra, sizeof(r.extra), "\"code_bytes\":%zu,\"compact_bytes\":%zu",
+                        codeBytes, compactBytes);
+        }
+
+        report(b, &r);
+
+cleanup:
+        freeList(bytes);
+        freeList(code);
+        free(source);
+        return err;
+}
+
+static
+err_t benchTokenize(struct bench *b)
+{
+        err_t err = OK;
+
+        char *source = NULL;
+
+        struct result r = { .name = "tokenize", .unit = "token" };
+        if (!selected(b, r.name)) {
+                goto cleanup;
+        }
+
+        size_t size = 16 << 20;
+        int nrLines;
+        err = generateSource(size, false, &source, &nrLines);
+        check(err);
+
+        for (int run=-1; run<b->runs; run++) {
+                long nrTokens = 0;
+                double start = now();
+                for (const char *line=source; *line!='\0'; line++) {
+                        struct tokenize T = {
+                                .source = line,
+                        };
+                        for (;;) {
+                                T.tokenId = nextToken(&T);
+                                if (T.tokenId == tokenEnd) {
+                                        break;
+                                }
+                                if (T.tokenId < 0) {
+                                        xRaise("Tokenizer error");
+                                }
+                                nrTokens++;
+                                T.source += T.tokenLen;
+                        }
+                        line = T.source;
+                }
+                double stop = now();
+                if (run >= 0) {
+                        r.ns[run] = stop - start;
+                }
+                r.ops = nrTokens;
+        }
+
+        snprintf(r.extra, sizeof(r.extra), "\"bytes\":%zu", size);
+        report(b, &r);
+
+cleanup:
+        free(source);
+        return err;
+}
+
+/*
+ *  Symbol lookup with `nrSymbols' functions registered next to the library
+ */
+static
+err_t benchSymbols(struct bench *b, int nrSymbols)
+{
+        err_t err = OK;
+
+        struct result r = {
+                .unit = "lookup",
+                .ops = 1L << 22,
+        };
+        snprintf(r.name, sizeof(r.name), "symbols-%d", nrSymbols);
+        if (!selected(b, r.name)) {
+                return OK;
+        }
+
+        char *names = NULL;
+        const int nameSize = 16;
+
+        struct xRap rap;
+        err = xInit(&rap);
+        check(err);
+
+        names = malloc(nrSymbols * nameSize);
+        if (names == NULL) {
+                xRaise("Out of memory");
+        }
+        for (int i=0; i<nrSymbols; i++) {
+                char *name = &names[i * nameSize];
+                snprintf(name, nameSize, "native%d", i);
+                err = xRegister(&rap, name, xPrintInt, 0);
+                check(err);
+        }
+
+        for (int run=-1; run<b->runs; run++) {
+                long found = 0;
+                double start = now();
+                for (long i=0; i<r.ops; i++) {
+                        const char *name = &names[(i % nrSymbols) * nameSize];
+                        found += (xLookup(&rap, name, strlen(name)) >= 0);
+                }
+                double stop = now();
+                xAssert(found == r.ops);
+                if (run >= 0) {
+                        r.ns[run] = stop - start;
+                }
+        }
+
+        snprintf(r.extra, sizeof(r.extra), "\"slots\":%d", rap.symbolMask + 1);
+        report(b, &r);
+
+cleanup:
+        free(names);
+        xFree(&rap);
+        xCurrentRap = b->rap;
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      main                                                            |
+ +----------------------------------------------------------------------*/
+
+int main(int argc, char *argv[])
+{
+        err_t err = OK;
+
+        struct xRap rap;
+        err = xInit(&rap);
+        check(err);
+
+        struct bench b = {
+                .rap = &rap,
+                .runs = 5,
+                .nrFilters = 0,
+                .filters = NULL,
+        };
+
+        for (int i=1; i<argc; i++) {
+                if (0==strcmp(argv[i], "-n") && i+1 < argc) {
+                        b.runs = atoi(argv[++i]);
+                        if (b.runs < 1 || b.runs > maxRuns) {
+                                fputs(usage, stderr);
+                                xRaise("Invalid number of runs");
+                        }
+                } else if (argv[i][0] == '-') {
+                        fputs(usage, stderr);
+                        xRaise("Invalid option");
+                } else {
+                        b.filters = &argv[i];
+                        b.nrFilters = argc - i;
+                        break;
+                }
+        }
+
+        printf("{\"name\":\"config\",\"value_bytes\":%zu,\"xDispatch\":%d,\"xWideValues\":%d,"
+                "\"xOpcodeHash\":%d,\"xCountInstructions\":%d,\"xProfile\":%d}\n",
+                sizeof(xValue_t), xDispatch, xWideValues, xOpcodeHash, xCountInstructions, xProfile);
+
+        static err_t (* const workloads[])(struct bench *b) = {
+                benchLoop,
+                benchCalls,
+                benchRecursion,
+                benchTailCalls,
+                benchShort,
+                benchDoubles,
+                benchCompile,
+                benchEncode,
+                benchTokenize,
+        };
+
+        for (int i=0; i<arrayLen(workloads); i++) {
+                err = workloads[i](&b);
+                check(err);
+        }
+
+        static const int sizes[] = { 16, 1024, 65536 };
+        for (int i=0; i<arrayLen(sizes); i++) {
+                err = benchLocals(&b, sizes[i]);
+                check(err);
+        }
+        for (int i=0; i<arrayLen(sizes); i++) {
+                err = benchSymbols(&b, sizes[i]);
+                check(err);
+        }
+        err = benchArrays(&b);
+        check(err);
+
+cleanup:
+        xFree(&rap);
+        return xExitMain(err);
+}
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
@@ -0,0 +1,421 @@
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ |      bytecode.c -- compact encoding of stack machine code            |
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cplus.h"
+#include "rap.h"
+
+#include "bytecode.h"
+
+/*----------------------------------------------------------------------+
+ |      Encoding                                                        |
+ +----------------------------------------------------------------------*/
+
+static
+unsigned zigzag(int value)
+{
+        return ((unsigned) value << 1) ^ (unsigned) -(value < 0);
+}
+
+static
+int varintLen(int value)
+{
+        unsigned u = zigzag(value);
+        int n = 1;
+        while (u >= 0x80) {
+                u >>= 7;
+                n++;
+        }
+        return n;
+}
+
+/*
+ *  Append `value' in `n' bytes, which may be more than it needs
+ */
+static
+err_t putVarint(byteList *out, int value, int n)
+{
+        err_t err = OK;
+
+        unsigned u = zigzag(value);
+        for (int i=1; i<n; i++) {
+                listPush(*out, (u & 0x7f) | 0x80);
+                u >>= 7;
+        }
+        xAssert(u < 0x80);
+        listPush(*out, u);
+cleanup:
+        return err;
+}
+
+static
+int targetOf(const int *code, int pc)
+{
+        int jump = vmInstructions[code[pc]].jump;
+        return pc + code[pc+jump] / (int)sizeof(int);
+}
+
+err_t xEncodeBytes(const int *code, int len, byteList *out)
+{
+        err_t err = OK;
+
+        int *at = malloc((len + 1) * sizeof(int));      // Byte position of each instruction
+        char *jumpLen = calloc(len + 1, sizeof(char));  // Bytes for the jump offset
+
+        if (at == NULL || jumpLen == NULL) {
+                xRaise("Out of memory");
+        }
+
+        xAssert(len >= vmHeaderSize);
+        xAssert((code[vmHeaderFlags] & (vmFlagThreaded | vmFlagVerified)) == vmFlagVerified);
+        xAssert(code[vmHeaderArguments] == 0); // Programs only
+
+        for (int pc=vmHeaderSize; pc<len; pc+=vmInstructions[code[pc]].length) {
+                jumpLen[pc] = 1;
+        }
+
+        // Offsets only grow when the code between grows, so this ends
+        for (bool changed=true; changed; ) {
+                int n = 0;
+                for (int pc=vmHeaderSize; pc<len; pc+=vmInstructions[code[pc]].length) {
+                        const struct vmInstruction *instruction = &vmInstructions[code[pc]];
+                        at[pc] = n++;
+                        for (int i=1; i<instruction->length; i++) {
+                                n += (i == instruction->jump) ? jumpLen[pc] : varintLen(code[pc+i]);
+                        }
+                }
+                at[len] = n;
+
+                changed = false;
+                for (int pc=vmHeaderSize; pc<len; pc+=vmInstructions[code[pc]].length) {
+                        if (vmInstructions[code[pc]].jump > 0) {
+                                int n = varintLen(at[targetOf(code, pc)] - at[pc]);
+                                if (n > jumpLen[pc]) {
+                                        jumpLen[pc] = n;
+                                        changed = true;
+                                }
+                        }
+                }
+        }
+
+        out->len = 0;
+        err = putVarint(out, code[vmHeaderLocals], varintLen(code[vmHeaderLocals]));
+        check(err);
+
+        for (int pc=vmHeaderSize; pc<len; pc+=vmInstructions[code[pc]].length) {
+                const struct vmInstruction *instruction = &vmInstructions[code[pc]];
+                listPush(*out, code[pc]);
+                for (int i=1; i<instruction->length; i++) {
+                        if (i == instruction->jump) {
+                                err = putVarint(out, at[targetOf(code, pc)] - at[pc], jumpLen[pc]);
+                        } else {
+                                err = putVarint(out, code[pc+i], varintLen(code[pc+i]));
+                        }
+                        check(err);
+                }
+        }
+
+cleanup:
+        free(jumpLen);
+        free(at);
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      The decoder                                                     |
+ +----------------------------------------------------------------------*/
+
+static inline
+int decode(const unsigned char **pc)
+{
+        const unsigned char *p = *pc;
+        unsigned u = *p++;
+        if (u >= 0x80) {
+                u &= 0x7f;
+                for (int shift=7; ; shift+=7) {
+                        unsigned b = *p++;
+                        u |= (b & 0x7f) << shift;
+                        if (b < 0x80) {
+                                break;
+                        }
+                }
+        }
+        *pc = p;
+        return (int) (u >> 1) ^ -(int) (u & 1);
+}
+
+#define fetch() decode(&pc)
+
+/*
+ *  Builtin function to jump to compact code
+ */
+err_t xExecuteBytes(void *data, int argc, xValue_t argv[])
+{
+        err_t err = OK;
+
+        struct xRap *rap = xCurrentRap;
+        const unsigned char *pc = data;
+        int nrSlots = fetch();
+
+        xValue_t *locals = NULL;
+        xAssert(nrSlots > 0);
+        err = xPushFrame(rap, nrSlots, &locals);
+        check(err);
+
+        xValue_t *sp = &locals[0];
+
+        for (;;) {
+                const unsigned char *ip = pc++;
+                int offset, argc2, counter, halves[2];
+                double d;
+
+                switch (*ip) {
+                case vmInt:
+                        *sp++ = xInt(fetch());
+                        continue;
+
+                case vmSubtractInt:
+                        sp--;
+                        sp[-1].Int -= sp[0].Int;
+                        continue;
+
+                case vmMultiplyInt:
+                        sp--;
+                        sp[-1].Int *= sp[0].Int;
+                        continue;
+
+                case vmIncrementInt:
+                        sp[-1].Int++;
+                        continue;
+
+                case vmLessEqualInt:
+                        sp--;
+                        sp[-1] = xBool(sp[-1].Int <= sp[0].Int);
+                        continue;
+
+                case vmSymbol:
+                        *sp++ = rap->symbols.v[fetch()].value;
+                        continue;
+
+                case vmCall:
+                        argc2 = fetch();
+                        sp -= argc2;
+                        err = xCall(argc2, sp);
+                        check(err);
+                        sp++;
+                        continue;
+
+                case vmTailCall:
+                        argc2 = fetch();
+                        sp -= argc2;
+                        err = xCall(argc2, sp);
+                        check(err);
+                        argv[0] = *sp;
+                        goto cleanup;
+
+                case vmReturn:
+                        argv[0] = locals[0];
+                        goto cleanup;
+
+                case vmDrop:
+                        sp -= fetch();
+                        continue;
+
+                case vmJump:
+                        offset = fetch();
+                        pc = ip + offset;
+                        continue;
+
+                case vmJumpF:
+                        offset = fetch();
+                        if (xIsFalse(sp[-1])) {
+                                pc = ip + offset;
+                        }
+                        continue;
+
+                case vmJumpT:
+                        offset = fetch();
+                        if (xIsTrue(sp[-1])) {
+                                pc = ip + offset;
+                        }
+                        continue;
+
+                case vmGetLocal:
+                        *sp++ = locals[fetch()];
+                        continue;
+
+                case vmSetLocal:
+                        locals[fetch()] = sp[-1];
+                        continue;
+
+                case vmCheckType:
+                        offset = fetch();
+                        if (xTypeId(sp[-1 - offset]) != (xTypeId_t) fetch()) {
+                                xRaise("Type error");
+                        }
+                        continue;
+
+                case vmLoopInt:
+                        counter = fetch();
+                        locals[counter].Int++;
+                        if (locals[counter].Int <= locals[fetch()].Int) {
+                                offset = fetch();
+                                pc = ip + offset;
+                        } else {
+                                (void) fetch();
+                        }
+                        continue;
+
+                case vmDouble:
+                        halves[0] = fetch();
+                        halves[1] = fetch();
+                        memcpy(&d, halves, sizeof(d));
+                        *sp++ = xDouble(d);
+                        continue;
+
+                case vmAddDouble:
+                        sp--;
+                        sp[-1].Double += sp[0].Double;
+                        continue;
+
+                case vmSubtractDouble:
+                        sp--;
+                        sp[-1].Double -= sp[0].Double;
+                        continue;
+
+                case vmMultiplyDouble:
+                        sp--;
+                        sp[-1].Double *= sp[0].Double;
+                        continue;
+
+                case vmDivideDouble:
+                        sp--;
+                        sp[-1].Double /= sp[0].Double;
+                        continue;
+
+                case vmMultiplyAddDouble:
+                        sp -= 2;
+                        sp[-1].Double = fma(sp[-1].Double, sp[0].Double, sp[1].Double);
+                        continue;
+
+                case vmMaxDouble:
+                        sp--;
+                        sp[-1].Double = fmax(sp[-1].Double, sp[0].Double);
+                        continue;
+
+                case vmMinDouble:
+                        sp--;
+                        sp[-1].Double = fmin(sp[-1].Double, sp[0].Double);
+                        continue;
+
+                case vmLessEqualDouble:
+                        sp--;
+                        sp[-1] = xBool(sp[-1].Double <= sp[0].Double);
+                        continue;
+
+                case vmNegateDouble:
+                        sp[-1].Double = -sp[-1].Double;
+                        continue;
+
+                case vmAbsDouble:
+                        sp[-1].Double = fabs(sp[-1].Double);
+                        continue;
+
+                case vmExpDouble:
+                        sp[-1].Double = exp(sp[-1].Double);
+                        continue;
+
+                case vmLogDouble:
+                        sp[-1].Double = log(sp[-1].Double);
+                        continue;
+
+                case vmInverseDouble:
+                        sp[-1].Double = 1.0 / sp[-1].Double;
+                        continue;
+
+                case vmSqrtDouble:
+                        sp[-1].Double = sqrt(sp[-1].Double);
+                        continue;
+
+                case vmSigmoidDouble:
+                        sp[-1].Double = 1.0 / (1.0 + exp(-sp[-1].Double));
+                        continue;
+
+                case vmRoundFloat:
+                        sp[-1].Double = (float) sp[-1].Double;
+                        continue;
+
+                case vmIntToDouble:
+                        sp[-1] = xDouble(sp[-1].Int);
+                        continue;
+
+                case vmDoubleToInt:
+                        if (!(sp[-1].Double > INT_MIN - 1.0 && sp[-1].Double < INT_MAX + 1.0)) {
+                                xRaise("Double out of int range");
+                        }
+                        sp[-1] = xInt((int) sp[-1].Double);
+                        continue;
+
+                case vmGetLocalIntLessEqualJumpT:
+                        offset = fetch();
+                        *sp = xBool(locals[offset].Int <= fetch());
+                        offset = fetch();
+                        if (xIsTrue(*sp++)) {
+                                pc = ip + offset;
+                        }
+                        continue;
+
+                case vmGetLocalIncrementSetLocal:
+                        *sp = locals[fetch()];
+                        sp->Int++;
+                        locals[fetch()] = *sp;
+                        sp++;
+                        continue;
+
+                case vmGetLocalMultiplyInt:
+                        sp[-1].Int *= locals[fetch()].Int;
+                        continue;
+
+                case vmIntSubtractInt:
+                        sp[-1].Int -= fetch();
+                        continue;
+
+                case vmDropJump:
+                        sp -= fetch();
+                        offset = fetch();
+                        pc = ip + offset;
+                        continue;
+
+                case vmGetLocalIntSubtractSetLocalDrop:
+                        *sp = locals[fetch()];
+                        sp->Int -= fetch();
+                        locals[fetch()] = *sp;
+                        sp += 1 - fetch();
+                        continue;
+
+                default:
+                        xAssert(false);
+                }
+        }
+
+cleanup:
+        if (locals != NULL) {
+                xPopFrame(rap, locals);
+        }
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
@@ -0,0 +1,41 @@
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ |      bytecode.h -- compact encoding of stack machine code            |
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  The same instructions as the int code, in fewer bytes. Opcodes take
+ *  one byte. Operands are zigzag coded (0, -1, 1, -2, ...) and then
+ *  stored seven bits per byte, least significant first, with the high
+ *  bit set in all bytes but the last. Most operands fit in one byte.
+ *
+ *  Jump offsets are in bytes from the start of the jump instruction, as
+ *  in the int code. Their length depends on the distance, so the encoder
+ *  grows them until all fit, padding those that end up shorter.
+ *
+ *  Code layout: number of stack slots, instructions
+ *
+ *  Only programs are encoded. They call Rap functions through xCall.
+ */
+
+/*----------------------------------------------------------------------+
+ |      Functions                                                       |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Encode code that has passed xVerifyCode. The decoder relies on that
+ *  and leaves out the checks.
+ */
+err_t xEncodeBytes(const int *code, int len, byteList *out);
+
+/*
+ *  Builtin function to jump to compact code
+ */
+xFunction_t xExecuteBytes;
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
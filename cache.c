@@ -0,0 +1,284 @@
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ |      cache.c -- compiled programs by source                          |
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cplus.h"
+
+#include "cache.h"
+
+#define isSpace(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+#define isParen(c) ((c) == '(' || (c) == ')')
+
+/*----------------------------------------------------------------------+
+ |      Helpers                                                         |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Put the key for `source' in the scratch list. Parentheses and the
+ *  backquote of symbols end the token before them, so no white space is
+ *  needed around them.
+ */
+static
+err_t normalize(struct xCache *cache, const char *source, size_t len, unsigned *hash)
+{
+        err_t err = OK;
+        charList *key = &cache->scratch;
+
+        key->len = 0;
+        bool space = false;
+        for (size_t i=0; i<len; i++) {
+                char c = source[i];
+                if (isSpace(c)) {
+                        space = true;
+                        continue;
+                }
+                if (space && key->len > 0 && !isParen(key->v[key->len-1]) && !isParen(c) && c != '`') {
+                        listPush(*key, ' ');
+                }
+                space = false;
+                listPush(*key, c);
+        }
+
+        // FNV-1a
+        *hash = 2166136261u;
+        for (int i=0; i<key->len; i++) {
+                *hash = (*hash ^ (unsigned char) key->v[i]) * 16777619u;
+        }
+cleanup:
+        return err;
+}
+
+static
+struct cacheEntry **findSlot(struct xCache *cache, unsigned hash, const charList *key)
+{
+        struct cacheEntry **p = &cache->slots[hash & cache->slotMask];
+        while (*p != NULL) {
+                struct cacheEntry *e = *p;
+                if (e->hash == hash && e->keyLen == key->len && 0==memcmp(e->key, key->v, key->len)) {
+                        break;
+                }
+                p = &e->chain;
+        }
+        return p;
+}
+
+static
+void unlinkEntry(struct cacheEntry *e)
+{
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+}
+
+static
+void linkEntry(struct xCache *cache, struct cacheEntry *e)
+{
+        e->next = cache->lru.next;
+        e->prev = &cache->lru;
+        cache->lru.next->prev = e;
+        cache->lru.next = e;
+}
+
+static
+void freeEntry(struct cacheEntry *e)
+{
+        free(e->key);
+        free(e->code);
+        free(e);
+}
+
+/*
+ *  Drop the least recently used entry
+ */
+static
+void evict(struct xCache *cache)
+{
+        struct cacheEntry *e = cache->lru.prev;
+
+        struct cacheEntry **p = &cache->slots[e->hash & cache->slotMask];
+        while (*p != e) {
+                p = &(*p)->chain;
+        }
+        *p = e->chain;
+        unlinkEntry(e);
+
+        cache->used -= e->size;
+        cache->nrEntries--;
+        cache->evictions++;
+        freeEntry(e);
+}
+
+/*
+ *  Keep the chains short: at most one entry per two slots
+ */
+static
+err_t growSlots(struct xCache *cache)
+{
+        err_t err = OK;
+
+        int nrSlots = cache->slotMask + 1;
+        if (2 * (cache->nrEntries + 1) <= nrSlots) {
+                goto cleanup;
+        }
+        int newNrSlots = (nrSlots > 0) ? 2 * nrSlots : 64;
+
+        struct cacheEntry **slots = calloc(newNrSlots, sizeof(*slots));
+        if (slots == NULL) {
+                xRaise("Out of memory");
+        }
+        for (int i=0; i<nrSlots; i++) {
+                struct cacheEntry *e = cache->slots[i];
+                while (e != NULL) {
+                        struct cacheEntry *chain = e->chain;
+                        int j = e->hash & (newNrSlots - 1);
+                        e->chain = slots[j];
+                        slots[j] = e;
+                        e = chain;
+                }
+        }
+        free(cache->slots);
+        cache->slots = slots;
+        cache->slotMask = newNrSlots - 1;
+cleanup:
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      Functions                                                       |
+ +----------------------------------------------------------------------*/
+
+void xInitCache(struct xCache *cache, size_t budget)
+{
+        *cache = (struct xCache) {
+                .budget = budget,
+                .used = 0,
+                .slots = NULL,
+                .slotMask = -1,
+                .nrEntries = 0,
+                .scratch = emptyList,
+        };
+        cache->lru.next = &cache->lru;
+        cache->lru.prev = &cache->lru;
+}
+
+void xFreeCache(struct xCache *cache)
+{
+        while (cache->nrEntries > 0) {
+                evict(cache);
+        }
+        free(cache->slots);
+        freeList(cache->scratch);
+        xInitCache(cache, 0);
+}
+
+err_t xCacheLookup(struct xCache *cache, const char *source, size_t len,
+        const int **code, int *codeLen)
+{
+        err_t err = OK;
+
+        *code = NULL;
+        *codeLen = 0;
+
+        if (cache->nrEntries == 0) {
+                cache->misses++;
+                goto cleanup;
+        }
+
+        unsigned hash;
+        err = normalize(cache, source, len, &hash);
+        check(err);
+
+        struct cacheEntry *e = *findSlot(cache, hash, &cache->scratch);
+        if (e == NULL) {
+                cache->misses++;
+                goto cleanup;
+        }
+
+        unlinkEntry(e);
+        linkEntry(cache, e);
+        cache->hits++;
+        *code = e->code;
+        *codeLen = e->len;
+cleanup:
+        return err;
+}
+
+err_t xCacheInsert(struct xCache *cache, const char *source, size_t len, intList *code)
+{
+        err_t err = OK;
+        struct cacheEntry *e = NULL;
+
+        unsigned hash;
+        err = normalize(cache, source, len, &hash);
+        check(err);
+
+        const charList *key = &cache->scratch;
+        if (cache->nrEntries > 0 && *findSlot(cache, hash, key) != NULL) {
+                goto cleanup; // Already there
+        }
+
+        size_t size = sizeof(*e) + key->len + code->len * sizeof(code->v[0]);
+        if (size > cache->budget) {
+                goto cleanup;
+        }
+
+        while (cache->used + size > cache->budget) {
+                evict(cache);
+        }
+
+        err = growSlots(cache);
+        check(err);
+
+        struct cacheEntry **p = findSlot(cache, hash, key);
+
+        e = malloc(sizeof(*e));
+        if (e == NULL) {
+                xRaise("Out of memory");
+        }
+        *e = (struct cacheEntry) {
+                .hash = hash,
+                .key = malloc(key->len + 1),
+                .keyLen = key->len,
+                .code = NULL,
+                .len = code->len,
+                .size = size,
+                .chain = NULL,
+        };
+        if (e->key == NULL) {
+                xRaise("Out of memory");
+        }
+        memcpy(e->key, key->v, key->len);
+
+        e->code = code->v;
+        *code = (intList) emptyList;
+
+        *p = e;
+        linkEntry(cache, e);
+        cache->used += size;
+        cache->nrEntries++;
+        e = NULL;
+cleanup:
+        if (e != NULL) {
+                freeEntry(e);
+        }
+        return err;
+}
+
+void xPrintCacheStatistics(FILE *fp, const struct xCache *cache)
+{
+        fprintf(fp, "Cache: %llu hits, %llu misses, %llu evictions, %d programs in %zu of %zu bytes\n",
+                cache->hits, cache->misses, cache->evictions,
+                cache->nrEntries, cache->used, cache->budget);
+}
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
@@ -0,0 +1,62 @@
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ |      cache.h -- compiled programs by source                          |
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Programs that differ only in white space compile to the same code. The
+ *  key is the source with white space removed where it doesn't separate
+ *  tokens, and collapsed to one space elsewhere. The least recently used
+ *  programs are evicted to stay within the memory budget.
+ */
+
+struct cacheEntry {
+        unsigned hash;
+        char *key;              // Normalized source
+        int keyLen;
+        int *code;              // As built by compileLine
+        int len;
+        size_t size;            // Memory used by the entry
+        struct cacheEntry *chain; // Next in the hash slot
+        struct cacheEntry *next, *prev; // In order of use, most recent first
+};
+
+struct xCache {
+        size_t budget;
+        size_t used;
+        struct cacheEntry **slots;
+        int slotMask;           // Number of slots - 1
+        int nrEntries;
+        struct cacheEntry lru;  // Head of the use order
+        charList scratch;       // Key being looked up
+        unsigned long long hits, misses, evictions;
+};
+
+/*----------------------------------------------------------------------+
+ |      Functions                                                       |
+ +----------------------------------------------------------------------*/
+
+void xInitCache(struct xCache *cache, size_t budget);
+
+void xFreeCache(struct xCache *cache);
+
+/*
+ *  Find the code for a source. Gives NULL when it isn't cached.
+ */
+err_t xCacheLookup(struct xCache *cache, const char *source, size_t len,
+        const int **code, int *codeLen);
+
+/*
+ *  Add the code for a source, taking over `code' unless it exceeds the
+ *  budget on its own. The code remains valid until the next insertion.
+ */
+err_t xCacheInsert(struct xCache *cache, const char *source, size_t len, intList *code);
+
+void xPrintCacheStatistics(FILE *fp, const struct xCache *cache);
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
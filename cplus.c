@@ -7,6 +7,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "cplus.h"
 
@@ -89,6 +90,113 @@ cleanup:
         return err;
 }
 
+/*----------------------------------------------------------------------+
+ |      Arenas                                                          |
+ +----------------------------------------------------------------------*/
+
+#define arenaAlign(n) (((n) + 15) & ~(size_t) 15)
+
+err_t xArenaAlloc(struct xArena *arena, size_t size, void **p)
+{
+        err_t err = OK;
+
+        size = arenaAlign(size);
+        struct xArenaBlock *block = arena->block;
+        if (block == NULL || size > block->size - arena->len) {
+                size_t newSize = (block != NULL) ? 2 * block->size : firstArenaSize;
+                newSize = max(newSize, size);
+                block = malloc(sizeof(*block) + newSize);
+                if (block == NULL) {
+                        xRaise("Out of memory");
+                }
+                block->next = arena->block;
+                block->size = newSize;
+                arena->block = block;
+                arena->len = 0;
+                arena->total += newSize;
+        }
+
+        *p = &block->data[arena->len];
+        arena->len += size;
+        arena->last = *p;
+cleanup:
+        return err;
+}
+
+err_t xArenaGrow(struct xArena *arena, void **v, int *maxLen, int minLen, int unit)
+{
+        err_t err = OK;
+
+        if (minLen <= *maxLen) {
+                goto cleanup;
+        }
+        xAssert(0 < minLen && minLen <= 0x3fffffff / unit);
+
+        int newLen = max(*maxLen, (firstListSize + unit - 1) / unit);
+        while (newLen < minLen) {
+                newLen *= 2;
+        }
+
+        // The latest allocation extends in place when the block has room
+        struct xArenaBlock *block = arena->block;
+        if (*v != NULL && *v == arena->last) {
+                size_t start = (char *) *v - block->data;
+                size_t size = arenaAlign((size_t) newLen * unit);
+                if (size <= block->size - start) {
+                        arena->len = start + size;
+                        *maxLen = newLen;
+                        goto cleanup;
+                }
+        }
+
+        void *newv;
+        err = xArenaAlloc(arena, (size_t) newLen * unit, &newv);
+        check(err);
+        if (*maxLen > 0) {
+                memcpy(newv, *v, (size_t) *maxLen * unit);
+        }
+        *v = newv;
+        *maxLen = newLen;
+cleanup:
+        return err;
+}
+
+static
+void freeBlocks(struct xArena *arena)
+{
+        while (arena->block != NULL) {
+                struct xArenaBlock *next = arena->block->next;
+                free(arena->block);
+                arena->block = next;
+        }
+}
+
+void xArenaReset(struct xArena *arena)
+{
+        if (arena->block != NULL && arena->block->next != NULL) {
+                // Replace the blocks by one that holds everything
+                size_t total = arena->total;
+                freeBlocks(arena);
+                struct xArenaBlock *block = malloc(sizeof(*block) + total);
+                if (block != NULL) {
+                        block->next = NULL;
+                        block->size = total;
+                        arena->block = block;
+                } else {
+                        total = 0; // Try again at the next allocation
+                }
+                arena->total = total;
+        }
+        arena->len = 0;
+        arena->last = NULL;
+}
+
+void xFreeArena(struct xArena *arena)
+{
+        freeBlocks(arena);
+        *arena = (struct xArena) emptyArena;
+}
+
 /*----------------------------------------------------------------------+
  |                                                                      |
  +----------------------------------------------------------------------*/
@@ -106,6 +106,54 @@ typedef List(unsigned long long) unsignedLongLongList;
 
 err_t list_ensure_len(void **v, int *maxLen, int minLen, int unit, int newLen);
 
+/*----------------------------------------------------------------------+
+ |      Arenas                                                          |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Bump allocation for short-lived data, all released at once by
+ *  xArenaReset. After a reset the memory stays, joined into one block,
+ *  so repeating the same work doesn't call malloc again.
+ */
+
+struct xArenaBlock {
+        struct xArenaBlock *next;       // Older block
+        size_t size;
+        char data[];
+};
+
+struct xArena {
+        struct xArenaBlock *block;      // Current, or NULL
+        size_t len;                     // Used in the current block
+        size_t total;                   // Size of all blocks
+        void *last;                     // Latest allocation, can grow in place
+};
+
+#define emptyArena { (void*)0, 0, 0, (void*)0 }
+
+#define firstArenaSize (4096)
+
+err_t xArenaAlloc(struct xArena *arena, size_t size, void **p);
+
+/*
+ *  Like list_ensure_len, for a list in an arena
+ */
+err_t xArenaGrow(struct xArena *arena, void **v, int *maxLen, int minLen, int unit);
+
+void xArenaReset(struct xArena *arena);
+
+void xFreeArena(struct xArena *arena);
+
+#define arenaPush(arena, list, value) do{\
+        if ((list).len >= (list).maxLen) {\
+                void *_v = (list).v;\
+                err = xArenaGrow((arena), &_v, &(list).maxLen, (list).len + 1, sizeof((list).v[0]));\
+                check(err);\
+                (list).v = _v;\
+        }\
+        (list).v[(list).len++] = (value);\
+}while(0)
+
 /*----------------------------------------------------------------------+
  |      Main support                                                    |
  +----------------------------------------------------------------------*/
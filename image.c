@@ -0,0 +1,361 @@
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ |      image.c -- precompiled code files                               |
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
+#define _POSIX_C_SOURCE 200809L // For mmap and friends
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cplus.h"
+#include "rap.h"
+
+#include "image.h"
+
+/*----------------------------------------------------------------------+
+ |      Helpers                                                         |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  FNV-1a, continued from `hash'
+ */
+static
+unsigned checksum(unsigned hash, const void *data, size_t size)
+{
+        const unsigned char *p = data;
+        for (size_t i=0; i<size; i++) {
+                hash = (hash ^ p[i]) * 16777619u;
+        }
+        return hash;
+}
+
+#define checksumStart 2166136261u
+
+/*----------------------------------------------------------------------+
+ |      xWriteImage                                                     |
+ +----------------------------------------------------------------------*/
+
+err_t xWriteImage(const struct xRap *rap, const char *path, const intList *code, const intList *starts)
+{
+        err_t err = OK;
+
+        List(struct imageProgram) programs = emptyList;
+        List(struct imageSymbol) symbols = emptyList;
+        charList strings = emptyList;
+        FILE *fp = NULL;
+
+        for (int i=0; i<starts->len; i++) {
+                struct imageProgram program = {
+                        .start = starts->v[i],
+                        .len = ((i+1 < starts->len) ? starts->v[i+1] : code->len) - starts->v[i],
+                };
+                xAssert(program.len >= vmHeaderSize);
+                xAssert(code->v[program.start + vmHeaderFlags] == 0);
+                listPush(programs, program);
+
+                int end = program.start + program.len;
+                for (int pc=program.start+vmHeaderSize; pc<end; ) {
+                        int opcode = code->v[pc];
+                        xAssert(0 <= opcode && opcode < vmNrInstructions);
+
+                        if (opcode == vmSymbol) {
+                                xAssert(pc + 1 < end);
+                                int index = code->v[pc+1];
+                                xAssert(0 <= index && index < rap->symbols.len);
+                                const char *name = rap->symbols.v[index].name;
+
+                                // As xLoadImage requires, so that the file loads
+                                if (!xIsFunction(rap->symbols.v[index].value)) {
+                                        xRaise("Image can only refer to builtin functions");
+                                }
+
+                                // Share the string with earlier references
+                                int offset = 0;
+                                while (offset < strings.len && 0!=strcmp(&strings.v[offset], name)) {
+                                        offset += strlen(&strings.v[offset]) + 1;
+                                }
+                                if (offset == strings.len) {
+                                        for (int j=0; j<=strlen(name); j++) {
+                                                listPush(strings, name[j]);
+                                        }
+                                }
+                                struct imageSymbol symbol = { .pc = pc, .name = offset };
+                                listPush(symbols, symbol);
+                        }
+                        pc += vmInstructions[opcode].length;
+                        xAssert(pc <= end);
+                }
+        }
+
+        struct imageHeader header = {
+                .magic = imageMagic,
+                .version = imageVersion,
+                .byteOrder = imageByteOrder,
+                .nrPrograms = programs.len,
+                .nrWords = code->len,
+                .nrSymbols = symbols.len,
+                .stringsLen = strings.len,
+        };
+
+        const struct { const void *v; size_t size; } sections[] = {
+                { programs.v,   programs.len * sizeof(programs.v[0]) },
+                { code->v,      code->len * sizeof(code->v[0]) },
+                { symbols.v,    symbols.len * sizeof(symbols.v[0]) },
+                { strings.v,    strings.len * sizeof(strings.v[0]) },
+        };
+
+        header.checksum = checksumStart;
+        for (int i=0; i<arrayLen(sections); i++) {
+                header.checksum = checksum(header.checksum, sections[i].v, sections[i].size);
+        }
+
+        fp = fopen(path, "wb");
+        if (fp == NULL) {
+                xRaise("Cannot create image file");
+        }
+
+        if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+                xRaise("Write error on image file");
+        }
+        for (int i=0; i<arrayLen(sections); i++) {
+                if (sections[i].size > 0 && fwrite(sections[i].v, sections[i].size, 1, fp) != 1) {
+                        xRaise("Write error on image file");
+                }
+        }
+
+        int r = fclose(fp);
+        fp = NULL;
+        if (r != 0) {
+                xRaise("Write error on image file");
+        }
+
+cleanup:
+        if (fp != NULL) {
+                fclose(fp);
+        }
+        freeList(programs);
+        freeList(symbols);
+        freeList(strings);
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      xLoadImage                                                      |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Make the mapping writable. It is private, so this only copies the
+ *  pages that are written to.
+ */
+static
+err_t makeWritable(struct xImage *image)
+{
+        err_t err = OK;
+        if (!image->writable) {
+                if (mprotect(image->map, image->size, PROT_READ | PROT_WRITE) != 0) {
+                        xRaise("Cannot make image writable");
+                }
+                image->writable = true;
+        }
+cleanup:
+        return err;
+}
+
+err_t xLoadImage(struct xRap *rap, const char *path, struct xImage *image)
+{
+        err_t err = OK;
+
+        *image = (struct xImage) { .map = NULL };
+
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                xRaise("Cannot open image file");
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+                xRaise("Cannot stat image file");
+        }
+        if (st.st_size < sizeof(struct imageHeader)) {
+                xRaise("Image file too short");
+        }
+
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+                xRaise("Cannot map image file");
+        }
+        image->map = map;
+        image->size = st.st_size;
+
+        /*
+         *  Check the header and the section sizes
+         */
+        const struct imageHeader *header = map;
+
+        if (0!=memcmp(header->magic, imageMagic, sizeof(header->magic))) {
+                xRaise("Not an image file");
+        }
+        if (header->version != imageVersion) {
+                xRaise("Unsupported image file version");
+        }
+        if (header->byteOrder != imageByteOrder) {
+                xRaise("Image file has wrong byte order");
+        }
+        xAssert(header->nrPrograms >= 0);
+        xAssert(header->nrWords >= 0);
+        xAssert(header->nrSymbols >= 0);
+        xAssert(header->stringsLen >= 0);
+
+        size_t expected = sizeof(*header)
+                + header->nrPrograms * sizeof(struct imageProgram)
+                + header->nrWords * sizeof(int)
+                + header->nrSymbols * sizeof(struct imageSymbol)
+                + header->stringsLen;
+        if (image->size != expected) {
+                xRaise("Image file has wrong size");
+        }
+
+        const char *body = (const char *) (header + 1);
+        if (checksum(checksumStart, body, image->size - sizeof(*header)) != header->checksum) {
+                xRaise("Image file checksum error");
+        }
+
+        image->nrPrograms = header->nrPrograms;
+        image->programs = (const struct imageProgram *) body;
+        image->code = (int *) (image->programs + header->nrPrograms);
+
+        const struct imageSymbol *symbols = (const struct imageSymbol *) (image->code + header->nrWords);
+        const char *strings = (const char *) (symbols + header->nrSymbols);
+
+        if (header->stringsLen > 0 && strings[header->stringsLen - 1] != '\0') {
+                xRaise("Image file has bad strings");
+        }
+
+        /*
+         *  Check the programs. Each symbol must be at an instruction start,
+         *  and each instruction that refers to a symbol must have one.
+         */
+        int pc = 0;
+        int s = 0;
+        for (int i=0; i<image->nrPrograms; i++) {
+                const struct imageProgram *program = &image->programs[i];
+                xAssert(program->start == pc);
+                xAssert(program->len >= vmHeaderSize);
+                xAssert(program->len <= header->nrWords - pc);
+
+                const int *code = &image->code[program->start];
+                xAssert(code[vmHeaderLocals] > 0);
+                xAssert(code[vmHeaderFlags] == 0);
+                xAssert(code[vmHeaderArguments] == 0);
+
+                int end = pc + program->len;
+                for (pc+=vmHeaderSize; pc<end; ) {
+                        int opcode = image->code[pc];
+                        xAssert(0 <= opcode && opcode < vmNrInstructions);
+
+                        if (s < header->nrSymbols && symbols[s].pc == pc) {
+                                if (opcode != vmSymbol) {
+                                        xRaise("Image file has stray symbols");
+                                }
+                                s++;
+                        } else if (opcode == vmSymbol) {
+                                xRaise("Image file has unbound symbol");
+                        }
+
+                        int jump = vmInstructions[opcode].jump;
+                        if (jump > 0) {
+                                xAssert(pc + jump < end);
+                                int target = pc - program->start + image->code[pc + jump] / (int) sizeof(int);
+                                xAssert(vmHeaderSize <= target && target < program->len);
+                        }
+
+                        pc += vmInstructions[opcode].length;
+                        xAssert(pc <= end);
+                }
+        }
+        xAssert(pc == header->nrWords);
+        if (s != header->nrSymbols) {
+                xRaise("Image file has stray symbols");
+        }
+
+        /*
+         *  Relocate the symbol references to the symbol table of `rap'
+         */
+        for (int i=0; i<header->nrSymbols; i++) {
+                xAssert(0 <= symbols[i].name && symbols[i].name < header->stringsLen);
+                const char *name = &strings[symbols[i].name];
+
+                // Only builtins: the image doesn't hold the code of Rap functions
+                int index = xLookup(rap, name, strlen(name));
+                if (index < 0 || !xIsFunction(rap->symbols.v[index].value)) {
+                        xRaise("Image file refers to undefined symbol");
+                }
+
+                int *operand = &image->code[symbols[i].pc + 1];
+                if (*operand != index) {
+                        err = makeWritable(image);
+                        check(err);
+                        *operand = index;
+                }
+        }
+
+cleanup:
+        if (fd >= 0) {
+                close(fd);
+        }
+        if (err != OK) {
+                xUnloadImage(image);
+        }
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      xThreadImage                                                    |
+ +----------------------------------------------------------------------*/
+
+err_t xThreadImage(struct xImage *image, int i)
+{
+        err_t err = OK;
+
+        xAssert(0 <= i && i < image->nrPrograms);
+
+        if (xDispatch == 2) {
+                // Direct threading writes the handler offsets into the code
+                err = makeWritable(image);
+                check(err);
+        }
+
+        const struct imageProgram *program = &image->programs[i];
+        err = xThreadCode(&image->code[program->start], program->len);
+        check(err);
+
+cleanup:
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      xUnloadImage                                                    |
+ +----------------------------------------------------------------------*/
+
+void xUnloadImage(struct xImage *image)
+{
+        if (image->map != NULL) {
+                (void) munmap(image->map, image->size);
+        }
+        *image = (struct xImage) { .map = NULL };
+}
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
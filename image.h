@@ -0,0 +1,90 @@
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ |      image.h -- precompiled code files                               |
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  File layout, all in native byte order:
+ *
+ *      struct imageHeader
+ *      struct imageProgram     programs[nrPrograms]
+ *      int                     code[nrWords]
+ *      struct imageSymbol      symbols[nrSymbols]
+ *      char                    strings[stringsLen]
+ *
+ *  Each program is complete stack machine code, header included, as
+ *  produced by compileLine. It has no superinstructions, so that the
+ *  register VM and the JIT can run it too. The symbols locate the
+ *  vmSymbol instructions with the name they refer to, so the loader can
+ *  relocate their operands to its own symbol table. They must name builtin functions: programs
+ *  that use functions defined with `fun' are refused when writing.
+ */
+
+#define imageMagic      "rap\032"
+#define imageVersion    6
+#define imageByteOrder  0x01020304
+
+struct imageHeader {
+        char magic[4];
+        int version;
+        int byteOrder;          // imageByteOrder as written
+        int nrPrograms;
+        int nrWords;            // Length of the code section
+        int nrSymbols;
+        int stringsLen;
+        unsigned checksum;      // Of everything following the header
+};
+
+struct imageProgram {
+        int start;              // Index into the code section
+        int len;
+};
+
+struct imageSymbol {
+        int pc;                 // Index into the code section
+        int name;               // Offset into the strings
+};
+
+/*
+ *  A loaded file. The code is executed in place from the mapping.
+ */
+struct xImage {
+        void *map;
+        size_t size;
+        int nrPrograms;
+        const struct imageProgram *programs;
+        int *code;
+        bool writable;          // Private pages may be copied on write
+};
+
+/*----------------------------------------------------------------------+
+ |      Functions                                                       |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Write programs to a file. `starts' holds the index of each program in
+ *  `code'. The programs may not yet be prepared by xThreadCode, and must
+ *  be compiled without xOptimizeSuperinstructions.
+ */
+err_t xWriteImage(const struct xRap *rap, const char *path, const intList *code, const intList *starts);
+
+/*
+ *  Map a file read-only, check it and bind its symbols in `rap'. Pages
+ *  are only copied when the code must be modified: for relocation, or by
+ *  xThreadCode.
+ */
+err_t xLoadImage(struct xRap *rap, const char *path, struct xImage *image);
+
+/*
+ *  Prepare program `i' of a loaded image for xExecute
+ */
+err_t xThreadImage(struct xImage *image, int i);
+
+void xUnloadImage(struct xImage *image);
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
@@ -0,0 +1,682 @@
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ |      jit.c -- native code for the integer instruction subset         |
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
+#define _DEFAULT_SOURCE // For MAP_ANONYMOUS
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "cplus.h"
+#include "rap.h"
+
+#include "jit.h"
+
+/*----------------------------------------------------------------------+
+ |      Definitions                                                     |
+ +----------------------------------------------------------------------*/
+
+typedef err_t xNative_t(xValue_t *locals);
+
+/*
+ *  Each stack slot has a fixed place in the frame, addressed from rbx.
+ *  The tag is the dword holding the type: the typeId itself in wide
+ *  values, or the upper half of a compact value.
+ */
+#define slot(i)         ((i) * (int) sizeof(xValue_t))
+#define intOffset       ((int) offsetof(xValue_t, Int))
+
+#if xWideValues
+ #define tagOffset      ((int) offsetof(xValue_t, typeId))
+ #define tagOf(typeId)  ((int32_t) (typeId))
+#else
+ #define tagOffset      ((int) offsetof(xValue_t, u.s.tag))
+ #define tagOf(typeId)  ((int32_t) (uint32_t) (xTag(typeId) >> 32))
+#endif
+
+struct jit {
+        const struct xRap *rap;
+        byteList code;
+        intList fixups;         // Pairs of rel32 offset and target pc or exit
+        int *native;            // Native offset of each instruction
+        int typeError;          // Native offset of the type error exit
+        int exit;               // Native offset of the common exit
+};
+
+/*----------------------------------------------------------------------+
+ |      x86-64 code emission                                            |
+ +----------------------------------------------------------------------*/
+
+#if defined(__x86_64__)
+
+static
+err_t bytes(struct jit *j, int n, ...)
+{
+        err_t err = OK;
+
+        va_list ap;
+        va_start(ap, n);
+        for (int i=0; i<n; i++) {
+                unsigned char b = va_arg(ap, unsigned);
+                listPush(j->code, b);
+        }
+cleanup:
+        va_end(ap);
+        return err;
+}
+
+static
+err_t int32(struct jit *j, int32_t value)
+{
+        err_t err = OK;
+        for (int i=0; i<4; i++) {
+                listPush(j->code, (unsigned char) ((uint32_t) value >> (8 * i)));
+        }
+cleanup:
+        return err;
+}
+
+static
+err_t int64(struct jit *j, uint64_t value)
+{
+        err_t err = OK;
+        for (int i=0; i<8; i++) {
+                listPush(j->code, (unsigned char) (value >> (8 * i)));
+        }
+cleanup:
+        return err;
+}
+
+/*
+ *  Instruction templates. `disp' is relative to the frame in rbx.
+ */
+
+// op r32, [rbx+disp32]  with ModRM mod=10 rm=rbx
+static
+err_t modrm(struct jit *j, int opcode, int reg, int disp)
+{
+        err_t err = OK;
+        if (opcode > 0xff) {
+                err = bytes(j, 1, opcode >> 8);
+                check(err);
+        }
+        err = bytes(j, 2, opcode & 0xff, 0x83 | (reg << 3));
+        check(err);
+        err = int32(j, disp);
+        check(err);
+cleanup:
+        return err;
+}
+
+enum { eax, ecx, edx, ebx, esp, ebp, esi, edi };
+
+// mov dword [rbx+disp], imm32
+static
+err_t storeImmediate(struct jit *j, int disp, int32_t value)
+{
+        err_t err = OK;
+        err = modrm(j, 0xc7, 0, disp);
+        check(err);
+        err = int32(j, value);
+        check(err);
+cleanup:
+        return err;
+}
+
+/*
+ *  Copy a complete value between two slots through eax. Dword moves,
+ *  because the fields are mostly written as dwords and a wider load
+ *  would defeat store forwarding.
+ */
+static
+err_t copyValue(struct jit *j, int to, int from)
+{
+        err_t err = OK;
+        for (int i=0; i<sizeof(xValue_t); i+=4) {
+                err = modrm(j, 0x8b, eax, slot(from) + i);      // mov eax, [rbx+from+i]
+                check(err);
+                err = modrm(j, 0x89, eax, slot(to) + i);        // mov [rbx+to+i], eax
+                check(err);
+        }
+cleanup:
+        return err;
+}
+
+/*
+ *  Set ZF when slot `i' has type `typeId'. Compact values keep the typeId
+ *  in the top 16 bits only, because function values have payload below.
+ */
+static
+err_t compareType(struct jit *j, int i, int typeId)
+{
+        err_t err = OK;
+#if xWideValues
+        err = modrm(j, 0x81, 7, slot(i) + tagOffset);                   // cmp tag, imm32
+        check(err);
+        err = int32(j, tagOf(typeId));
+        check(err);
+#else
+        err = modrm(j, 0x0fb7, eax, slot(i) + tagOffset + 2);           // movzx eax, word [tag+2]
+        check(err);
+        err = bytes(j, 1, 0x3d);                                        // cmp eax, imm32
+        check(err);
+        err = int32(j, xTagBase + typeId);
+        check(err);
+#endif
+cleanup:
+        return err;
+}
+
+// Store the boolean for the condition in eax (0 or 1) into slot `i'
+static
+err_t storeBool(struct jit *j, int i)
+{
+        err_t err = OK;
+#if !xWideValues
+        err = bytes(j, 3, 0xc1, 0xe0, 16);                              // shl eax, 16
+        check(err);
+        err = storeImmediate(j, slot(i) + intOffset, 0);
+        check(err);
+#endif
+        err = bytes(j, 1, 0x05);                                        // add eax, tag(xFalseId)
+        check(err);
+        err = int32(j, tagOf(xFalseId));
+        check(err);
+        err = modrm(j, 0x89, eax, slot(i) + tagOffset);                 // mov tag, eax
+        check(err);
+cleanup:
+        return err;
+}
+
+// Store a constant value into slot `i'
+static
+err_t storeValue(struct jit *j, int i, xValue_t value)
+{
+        err_t err = OK;
+        err = bytes(j, 2, 0x48, 0xb8);                                  // mov rax, imm64
+        check(err);
+#if xWideValues
+        uint64_t payload;
+        memcpy(&payload, &value.u, sizeof(payload));
+        err = int64(j, payload);
+        check(err);
+        err = storeImmediate(j, slot(i) + tagOffset, tagOf(xTypeId(value)));
+        check(err);
+        err = bytes(j, 1, 0x48);                                        // mov [payload], rax
+        check(err);
+        err = modrm(j, 0x89, eax, slot(i) + (int) offsetof(xValue_t, u));
+        check(err);
+#else
+        err = int64(j, value.u.bits);
+        check(err);
+        err = bytes(j, 1, 0x48);                                        // mov [slot], rax
+        check(err);
+        err = modrm(j, 0x89, eax, slot(i));
+        check(err);
+#endif
+cleanup:
+        return err;
+}
+
+// Load the function pointer of slot `i' into rax
+static
+err_t loadFunction(struct jit *j, int i)
+{
+        err_t err = OK;
+        err = bytes(j, 1, 0x48);                                        // mov rax, [function]
+        check(err);
+#if xWideValues
+        err = modrm(j, 0x8b, eax, slot(i) + (int) offsetof(xValue_t, VoidFunction));
+        check(err);
+#else
+        err = modrm(j, 0x8b, eax, slot(i));
+        check(err);
+        err = bytes(j, 8, 0x48, 0xc1, 0xe0, 16, 0x48, 0xc1, 0xe8, 16);  // shl rax, 16; shr rax, 16
+        check(err);
+#endif
+cleanup:
+        return err;
+}
+
+// mov rax, imm64; call rax
+static
+err_t callAbsolute(struct jit *j, void (*fn)(void))
+{
+        err_t err = OK;
+        err = bytes(j, 2, 0x48, 0xb8);
+        check(err);
+        err = int64(j, (uint64_t) (uintptr_t) fn);
+        check(err);
+        err = bytes(j, 2, 0xff, 0xd0);
+        check(err);
+cleanup:
+        return err;
+}
+
+enum { toTypeError = -1, toExit = -2 };
+
+// Jump with a rel32 operand to the instruction at `pc', or to an exit
+static
+err_t jumpTo(struct jit *j, int opcode, int pc)
+{
+        err_t err = OK;
+        if (opcode > 0xff) {
+                err = bytes(j, 2, opcode >> 8, opcode & 0xff);
+        } else {
+                err = bytes(j, 1, opcode);
+        }
+        check(err);
+        listPush(j->fixups, j->code.len);
+        listPush(j->fixups, pc);
+        err = int32(j, 0);
+        check(err);
+cleanup:
+        return err;
+}
+
+enum { jmp = 0xe9, je = 0x0f84, jne = 0x0f85, jle = 0x0f8e };
+
+/*----------------------------------------------------------------------+
+ |      Translation                                                     |
+ +----------------------------------------------------------------------*/
+
+static
+err_t typeError(void)
+{
+        err_t err = OK;
+        xRaise("Type error");
+cleanup:
+        return err;
+}
+
+/*
+ *  Doubles aren't translated. Compact doubles have no tag to compare, so
+ *  neither are the checks for them.
+ */
+static
+bool isSupported(const int *ip)
+{
+        switch (ip[0]) {
+        case vmInt: case vmSubtractInt: case vmMultiplyInt: case vmIncrementInt:
+        case vmLessEqualInt: case vmSymbol:
+        case vmCall: case vmReturn: case vmDrop: case vmJump: case vmJumpF:
+        case vmJumpT: case vmGetLocal: case vmSetLocal:
+        case vmLoopInt:
+                return true;
+        case vmCheckType:
+                return ip[2] != xDoubleId;
+        default:
+                return false;
+        }
+}
+
+static
+err_t translate(struct jit *j, const int *code, int len)
+{
+        err_t err = OK;
+
+        int nrLocals = code[vmHeaderLocals];
+        int *depth = malloc((len + 1) * sizeof(int));
+        if (depth == NULL) {
+                xRaise("Out of memory");
+        }
+
+        for (int pc=0; pc<=len; pc++) {
+                depth[pc] = -1;
+        }
+
+        // push rbx; mov rbx, rdi
+        err = bytes(j, 4, 0x53, 0x48, 0x89, 0xfb);
+        check(err);
+
+        int sp = 0;
+        bool reachable = true;
+
+        for (int pc=vmHeaderSize; pc<len; pc+=vmInstructions[code[pc]].length) {
+                const int *ip = &code[pc];
+                j->native[pc] = j->code.len;
+
+                if (depth[pc] >= 0) {
+                        xAssert(!reachable || sp == depth[pc]);
+                        sp = depth[pc];
+                        reachable = true;
+                }
+                if (!reachable) {
+                        continue;
+                }
+                depth[pc] = sp;
+
+                switch (ip[0]) {
+                case vmInt:
+                        xAssert(sp < nrLocals);
+                        err = storeImmediate(j, slot(sp) + tagOffset, tagOf(xIntId));
+                        check(err);
+                        err = storeImmediate(j, slot(sp) + intOffset, ip[1]);
+                        check(err);
+                        sp++;
+                        break;
+
+                case vmSubtractInt:
+                        xAssert(sp >= 2);
+                        err = modrm(j, 0x8b, eax, slot(sp-1) + intOffset);      // mov eax, b
+                        check(err);
+                        err = modrm(j, 0x29, eax, slot(sp-2) + intOffset);      // sub a, eax
+                        check(err);
+                        sp--;
+                        break;
+
+                case vmMultiplyInt:
+                        xAssert(sp >= 2);
+                        err = modrm(j, 0x8b, eax, slot(sp-2) + intOffset);      // mov eax, a
+                        check(err);
+                        err = modrm(j, 0x0faf, eax, slot(sp-1) + intOffset);    // imul eax, b
+                        check(err);
+                        err = modrm(j, 0x89, eax, slot(sp-2) + intOffset);      // mov a, eax
+                        check(err);
+                        sp--;
+                        break;
+
+                case vmIncrementInt:
+                        xAssert(sp >= 1);
+                        err = modrm(j, 0x83, 0, slot(sp-1) + intOffset);        // add a, 1
+                        check(err);
+                        err = bytes(j, 1, 1);
+                        check(err);
+                        break;
+
+                case vmLessEqualInt:
+                        xAssert(sp >= 2);
+                        err = modrm(j, 0x8b, eax, slot(sp-2) + intOffset);      // mov eax, a
+                        check(err);
+                        err = modrm(j, 0x3b, eax, slot(sp-1) + intOffset);      // cmp eax, b
+                        check(err);
+                        err = bytes(j, 6, 0x0f, 0x9e, 0xc0, 0x0f, 0xb6, 0xc0);  // setle al; movzx eax, al
+                        check(err);
+                        err = storeBool(j, sp-2);
+                        check(err);
+                        sp--;
+                        break;
+
+                case vmSymbol:
+                        // Bind the current value: later registrations are not seen
+                        xAssert(sp < nrLocals);
+                        xAssert(0 <= ip[1] && ip[1] < j->rap->symbols.len);
+                        err = storeValue(j, sp, j->rap->symbols.v[ip[1]].value);
+                        check(err);
+                        sp++;
+                        break;
+
+                case vmCall:
+                        // Builtins directly through their pointer, others with xCall
+                        xAssert(1 <= ip[1] && ip[1] <= sp);
+                        int base = sp - ip[1];
+                        err = compareType(j, base, xFunctionId);
+                        check(err);
+                        err = bytes(j, 2, 0x0f, 0x85);                          // jne other
+                        check(err);
+                        int other = j->code.len;
+                        err = int32(j, 0);
+                        check(err);
+                        err = bytes(j, 3, 0x31, 0xff, 0xbe);                    // xor edi, edi; mov esi, argc
+                        check(err);
+                        err = int32(j, ip[1]);
+                        check(err);
+                        err = bytes(j, 1, 0x48);                                // lea rdx, [rbx+base]
+                        check(err);
+                        err = modrm(j, 0x8d, edx, slot(base));
+                        check(err);
+                        err = loadFunction(j, base);
+                        check(err);
+                        err = bytes(j, 4, 0xff, 0xd0, 0xeb, 0);                 // call rax; jmp called
+                        check(err);
+                        int called = j->code.len;
+
+                        int32_t rel = j->code.len - (other + 4);                // other:
+                        memcpy(&j->code.v[other], &rel, sizeof(rel));
+                        err = bytes(j, 1, 0xbf);                                // mov edi, argc
+                        check(err);
+                        err = int32(j, ip[1]);
+                        check(err);
+                        err = bytes(j, 1, 0x48);                                // lea rsi, [rbx+base]
+                        check(err);
+                        err = modrm(j, 0x8d, esi, slot(base));
+                        check(err);
+                        err = callAbsolute(j, (void (*)(void)) xCall);
+                        check(err);
+                        xAssert(j->code.len - called <= 0x7f);
+                        j->code.v[called - 1] = j->code.len - called;           // called:
+                        err = bytes(j, 3, 0x48, 0x85, 0xc0);                    // test rax, rax
+                        check(err);
+                        err = jumpTo(j, jne, toExit);
+                        check(err);
+                        sp = base + 1;
+                        break;
+
+                case vmReturn:
+                        err = bytes(j, 2, 0x31, 0xc0);                          // xor eax, eax
+                        check(err);
+                        err = jumpTo(j, jmp, toExit);
+                        check(err);
+                        reachable = false;
+                        break;
+
+                case vmDrop:
+                        xAssert(0 <= ip[1] && ip[1] <= sp);
+                        sp -= ip[1];
+                        break;
+
+                case vmJump:
+                case vmJumpF:
+                case vmJumpT:
+                        ;
+                        int target = pc + ip[1] / (int)sizeof(int);
+                        xAssert(vmHeaderSize <= target && target < len);
+                        xAssert(depth[target] < 0 || depth[target] == sp);
+                        depth[target] = sp;
+                        if (ip[0] == vmJump) {
+                                err = jumpTo(j, jmp, target);
+                                check(err);
+                                reachable = false;
+                        } else {
+                                xAssert(sp >= 1);
+                                err = compareType(j, sp-1, (ip[0] == vmJumpT) ? xTrueId : xFalseId);
+                                check(err);
+                                err = jumpTo(j, je, target);
+                                check(err);
+                        }
+                        break;
+
+                case vmGetLocal:
+                        xAssert(0 <= ip[1] && ip[1] < sp);
+                        xAssert(sp < nrLocals);
+                        err = copyValue(j, sp, ip[1]);
+                        check(err);
+                        sp++;
+                        break;
+
+                case vmSetLocal:
+                        xAssert(0 <= ip[1] && ip[1] < sp);
+                        if (ip[1] != sp - 1) {
+                                err = copyValue(j, ip[1], sp - 1);
+                                check(err);
+                        }
+                        break;
+
+                case vmCheckType:
+                        xAssert(0 <= ip[1] && ip[1] < sp);
+                        err = compareType(j, sp - 1 - ip[1], ip[2]);
+                        check(err);
+                        err = jumpTo(j, jne, toTypeError);
+                        check(err);
+                        break;
+
+                case vmLoopInt:
+                        xAssert(0 <= ip[1] && ip[1] < sp);
+                        xAssert(0 <= ip[2] && ip[2] < sp);
+                        target = pc + ip[3] / (int)sizeof(int);
+                        xAssert(vmHeaderSize <= target && target < len);
+                        xAssert(depth[target] < 0 || depth[target] == sp);
+                        depth[target] = sp;
+                        err = modrm(j, 0x8b, eax, slot(ip[1]) + intOffset);    // mov eax, counter
+                        check(err);
+                        err = bytes(j, 3, 0x83, 0xc0, 1);                       // add eax, 1
+                        check(err);
+                        err = modrm(j, 0x89, eax, slot(ip[1]) + intOffset);    // mov counter, eax
+                        check(err);
+                        err = modrm(j, 0x3b, eax, slot(ip[2]) + intOffset);    // cmp eax, limit
+                        check(err);
+                        err = jumpTo(j, jle, target);
+                        check(err);
+                        break;
+
+                default:
+                        xAssert(false);
+                }
+        }
+        j->native[len] = j->code.len;
+
+        // Exits: rax holds the result
+        j->typeError = j->code.len;
+        err = callAbsolute(j, (void (*)(void)) typeError);
+        check(err);
+        j->exit = j->code.len;
+        err = bytes(j, 2, 0x5b, 0xc3);                                          // pop rbx; ret
+        check(err);
+
+        // Fill in the rel32 operands
+        for (int i=0; i<j->fixups.len; i+=2) {
+                int at = j->fixups.v[i];
+                int to = j->fixups.v[i+1];
+                int native = (to >= 0) ? j->native[to] :
+                             (to == toTypeError) ? j->typeError : j->exit;
+                int32_t rel = native - (at + 4);
+                memcpy(&j->code.v[at], &rel, sizeof(rel));
+        }
+
+cleanup:
+        free(depth);
+
+        return err;
+}
+
+#endif // __x86_64__
+
+/*----------------------------------------------------------------------+
+ |      Interface                                                       |
+ +----------------------------------------------------------------------*/
+
+err_t xCompileNative(const struct xRap *rap, const int *code, int len, struct xNative **native)
+{
+        err_t err = OK;
+
+        *native = NULL;
+
+#if defined(__x86_64__)
+        struct jit j = {
+                .rap = rap,
+                .code = emptyList,
+                .fixups = emptyList,
+                .native = NULL,
+                .typeError = 0,
+                .exit = 0,
+        };
+
+        xAssert(len >= vmHeaderSize);
+        xAssert(code[vmHeaderArguments] == 0); // Programs only
+        for (int pc=vmHeaderSize; pc<len; pc+=vmInstructions[code[pc]].length) {
+                xAssert(0 <= code[pc] && code[pc] < vmNrInstructions);
+                if (!isSupported(&code[pc])) {
+                        goto cleanup; // Leave it to xExecute
+                }
+        }
+
+        j.native = malloc((len + 1) * sizeof(int));
+        if (j.native == NULL) {
+                xRaise("Out of memory");
+        }
+
+        err = translate(&j, code, len);
+        check(err);
+
+        // Map writable, then switch to executable
+        size_t size = j.code.len;
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+                xRaise("mmap failed");
+        }
+        memcpy(p, j.code.v, size);
+        if (mprotect(p, size, PROT_READ | PROT_EXEC) != 0) {
+                munmap(p, size);
+                xRaise("mprotect failed");
+        }
+
+        *native = malloc(sizeof(**native));
+        if (*native == NULL) {
+                munmap(p, size);
+                xRaise("Out of memory");
+        }
+        **native = (struct xNative) {
+                .code = p,
+                .size = size,
+                .nrLocals = code[vmHeaderLocals],
+        };
+
+cleanup:
+        free(j.native);
+        freeList(j.fixups);
+        freeList(j.code);
+#endif
+        return err;
+}
+
+void xFreeNative(struct xNative *native)
+{
+        if (native != NULL) {
+                munmap(native->code, native->size);
+                free(native);
+        }
+}
+
+/*
+ *  Builtin function to jump to native code
+ */
+err_t xExecuteNative(void *data, int argc, xValue_t argv[])
+{
+        err_t err = OK;
+
+        struct xNative *native = data;
+
+        xValue_t *locals = NULL;
+        err = xPushFrame(xCurrentRap, native->nrLocals, &locals);
+        check(err);
+
+        union {
+                void *p;
+                xNative_t *fn;
+        } entry = { .p = native->code }; // ISO C has no object to function pointer cast
+
+        err = entry.fn(locals);
+        check(err);
+
+        argv[0] = locals[0];
+cleanup:
+        if (locals != NULL) {
+                xPopFrame(xCurrentRap, locals);
+        }
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
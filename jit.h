@@ -0,0 +1,31 @@
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ |      jit.h -- native code for the integer instruction subset         |
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
+struct xNative {
+        void *code;             // Executable mapping
+        size_t size;            // Size of the mapping
+        int nrLocals;
+};
+
+/*
+ *  Translate stack machine code into native code. Gives NULL when the
+ *  code uses instructions or a platform the JIT doesn't support. The
+ *  caller must then use xExecute instead.
+ */
+err_t xCompileNative(const struct xRap *rap, const int *code, int len, struct xNative **native);
+
+void xFreeNative(struct xNative *native);
+
+/*
+ *  Builtin function to jump to native code, `data' is a struct xNative
+ */
+xFunction_t xExecuteNative;
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
@@ -5,11 +5,14 @@
  |                                                                      |
  +----------------------------------------------------------------------*/
 
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "cplus.h"
 #include "rap.h"
 
+#include "array.h"
 #include "library.h"
 
 /*----------------------------------------------------------------------+
@@ -44,7 +47,7 @@ err_t xPrintInt(void *data, int argc, xValue_t argv[])
         xAssert(argc == 2);
         xAssert(xIsInt(argv[1]));
 
-        int n = printf("%d\n", argv[1].Int);
+        int n = fprintf(xCurrentRap->out, "%d\n", argv[1].Int);
         if (n < 0) {
                 xRaise("printf failed"); // printf doesn't use errno
         }
@@ -55,6 +58,294 @@ cleanup:
         return err;
 }
 
+/*----------------------------------------------------------------------+
+ |      xPrintDouble                                                    |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  With the fewest digits that read back as the same double
+ */
+err_t xPrintDouble(void *data, int argc, xValue_t argv[])
+{
+        err_t err = OK;
+
+        xAssert(argc == 2);
+        xAssert(xIsDouble(argv[1]));
+
+        double d = argv[1].Double;
+        char buffer[32];
+        for (int precision=15; precision<=17; precision++) {
+                snprintf(buffer, sizeof(buffer), "%.*g", precision, d);
+                if (strtod(buffer, NULL) == d) {
+                        break;
+                }
+        }
+
+        int n = fprintf(xCurrentRap->out, "%s\n", buffer);
+        if (n < 0) {
+                xRaise("printf failed"); // printf doesn't use errno
+        }
+
+        argv[0] = xInt(n);
+
+cleanup:
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      Arrays                                                          |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  The bulk functions run the kernels that xInit selected, see array.h.
+ *  The elementwise ones take the array to write to first, which may be
+ *  one of the operands, and return it. Their second operand may also be
+ *  an int, which then applies to all elements.
+ */
+
+/*----------------------------------------------------------------------+
+ |      xMakeArray                                                      |
+ +----------------------------------------------------------------------*/
+
+err_t xMakeArray(void *data, int argc, xValue_t argv[])
+{
+        err_t err = OK;
+
+        xAssert(argc == 3);
+        xAssert(xIsInt(argv[1]));
+        xAssert(xIsInt(argv[2]));
+
+        struct xArray *array;
+        err = xNewArray(xCurrentRap, argv[1].Int, &array);
+        check(err);
+
+        for (int i=0; i<array->len; i++) {
+                array->v[i] = argv[2].Int;
+        }
+        argv[0] = xArray(array);
+cleanup:
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      xArrayLen                                                       |
+ +----------------------------------------------------------------------*/
+
+err_t xArrayLen(void *data, int argc, xValue_t argv[])
+{
+        err_t err = OK;
+
+        xAssert(argc == 2);
+        xAssert(xIsArray(argv[1]));
+
+        argv[0] = xInt(xArrayOf(argv[1])->len);
+cleanup:
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      xArrayGet                                                       |
+ +----------------------------------------------------------------------*/
+
+err_t xArrayGet(void *data, int argc, xValue_t argv[])
+{
+        err_t err = OK;
+
+        xAssert(argc == 3);
+        xAssert(xIsArray(argv[1]));
+        xAssert(xIsInt(argv[2]));
+
+        const struct xArray *array = xArrayOf(argv[1]);
+        if ((unsigned) argv[2].Int >= (unsigned) array->len) {
+                xRaise("Array index out of range");
+        }
+        argv[0] = xInt(array->v[argv[2].Int]);
+cleanup:
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      xArraySet                                                       |
+ +----------------------------------------------------------------------*/
+
+// Returns the value
+err_t xArraySet(void *data, int argc, xValue_t argv[])
+{
+        err_t err = OK;
+
+        xAssert(argc == 4);
+        xAssert(xIsArray(argv[1]));
+        xAssert(xIsInt(argv[2]));
+        xAssert(xIsInt(argv[3]));
+
+        struct xArray *array = xArrayOf(argv[1]);
+        if ((unsigned) argv[2].Int >= (unsigned) array->len) {
+                xRaise("Array index out of range");
+        }
+        array->v[argv[2].Int] = argv[3].Int;
+        argv[0] = argv[3];
+cleanup:
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      Elementwise functions                                           |
+ +----------------------------------------------------------------------*/
+
+typedef void (elementwise_t)(int *dst, const int *a, const int *b, int n);
+typedef void (broadcast_t)(int *dst, const int *a, int b, int n);
+
+static
+err_t elementwise(int argc, xValue_t argv[], elementwise_t *kernel, broadcast_t *intKernel)
+{
+        err_t err = OK;
+
+        xAssert(argc == 4);
+        xAssert(xIsArray(argv[1]));
+        xAssert(xIsArray(argv[2]));
+
+        struct xArray *dst = xArrayOf(argv[1]);
+        const struct xArray *a = xArrayOf(argv[2]);
+        if (a->len != dst->len) {
+                xRaise("Array lengths differ");
+        }
+
+        if (xIsInt(argv[3])) {
+                intKernel(dst->v, a->v, argv[3].Int, a->len);
+        } else {
+                xAssert(xIsArray(argv[3]));
+                const struct xArray *b = xArrayOf(argv[3]);
+                if (b->len != dst->len) {
+                        xRaise("Array lengths differ");
+                }
+                kernel(dst->v, a->v, b->v, a->len);
+        }
+        argv[0] = argv[1];
+cleanup:
+        return err;
+}
+
+err_t xArrayAdd(void *data, int argc, xValue_t argv[])
+{
+        const struct xArrayKernels *k = xCurrentRap->kernels;
+        return elementwise(argc, argv, k->add, k->addInt);
+}
+
+err_t xArraySubtract(void *data, int argc, xValue_t argv[])
+{
+        const struct xArrayKernels *k = xCurrentRap->kernels;
+        return elementwise(argc, argv, k->sub, k->subInt);
+}
+
+err_t xArrayMultiply(void *data, int argc, xValue_t argv[])
+{
+        const struct xArrayKernels *k = xCurrentRap->kernels;
+        return elementwise(argc, argv, k->mul, k->mulInt);
+}
+
+// 1 where the element is less or equal, otherwise 0
+err_t xArrayLessEqual(void *data, int argc, xValue_t argv[])
+{
+        const struct xArrayKernels *k = xCurrentRap->kernels;
+        return elementwise(argc, argv, k->le, k->leInt);
+}
+
+/*----------------------------------------------------------------------+
+ |      Reductions                                                      |
+ +----------------------------------------------------------------------*/
+
+typedef int (reduce_t)(const int *a, int n);
+
+static
+err_t reduce(int argc, xValue_t argv[], reduce_t *kernel, bool emptyOk)
+{
+        err_t err = OK;
+
+        xAssert(argc == 2);
+        xAssert(xIsArray(argv[1]));
+
+        const struct xArray *a = xArrayOf(argv[1]);
+        if (a->len == 0 && !emptyOk) {
+                xRaise("Empty array");
+        }
+        argv[0] = xInt(kernel(a->v, a->len));
+cleanup:
+        return err;
+}
+
+err_t xArraySum(void *data, int argc, xValue_t argv[])
+{
+        return reduce(argc, argv, xCurrentRap->kernels->sum, true);
+}
+
+err_t xArrayMin(void *data, int argc, xValue_t argv[])
+{
+        return reduce(argc, argv, xCurrentRap->kernels->minimum, false);
+}
+
+err_t xArrayMax(void *data, int argc, xValue_t argv[])
+{
+        return reduce(argc, argv, xCurrentRap->kernels->maximum, false);
+}
+
+err_t xArrayDot(void *data, int argc, xValue_t argv[])
+{
+        err_t err = OK;
+
+        xAssert(argc == 3);
+        xAssert(xIsArray(argv[1]));
+        xAssert(xIsArray(argv[2]));
+
+        const struct xArray *a = xArrayOf(argv[1]);
+        const struct xArray *b = xArrayOf(argv[2]);
+        if (a->len != b->len) {
+                xRaise("Array lengths differ");
+        }
+        argv[0] = xInt(xCurrentRap->kernels->dot(a->v, b->v, a->len));
+cleanup:
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      xRegisterLibrary                                                |
+ +----------------------------------------------------------------------*/
+
+err_t xRegisterLibrary(struct xRap *rap)
+{
+        err_t err = OK;
+
+        static const struct {
+                const char *name;
+                xFunction_t *fn;
+                unsigned flags;
+        } functions[] = {
+                { "printInt",           xPrintInt,      0 },
+                { "printDbl",           xPrintDouble,   0 },
+                { "subtractInt",        xSubtractInt,   xPure },
+                // Arrays can change, so none of these is pure
+                { "makeArray",          xMakeArray,     0 },
+                { "arrayLen",           xArrayLen,      0 },
+                { "arrayGet",           xArrayGet,      0 },
+                { "arraySet",           xArraySet,      0 },
+                { "arrayAdd",           xArrayAdd,      0 },
+                { "arraySub",           xArraySubtract, 0 },
+                { "arrayMul",           xArrayMultiply, 0 },
+                { "arrayLe",            xArrayLessEqual, 0 },
+                { "arraySum",           xArraySum,      0 },
+                { "arrayMin",           xArrayMin,      0 },
+                { "arrayMax",           xArrayMax,      0 },
+                { "arrayDot",           xArrayDot,      0 },
+        };
+
+        for (int i=0; i<arrayLen(functions); i++) {
+                err = xRegister(rap, functions[i].name, functions[i].fn, functions[i].flags);
+                check(err);
+        }
+
+cleanup:
+        return err;
+}
+
 /*----------------------------------------------------------------------+
  |                                                                      |
  +----------------------------------------------------------------------*/
@@ -1,4 +1,21 @@
-
 xFunction_t xPrintInt;
+xFunction_t xPrintDouble;
 xFunction_t xSubtractInt;
 
+xFunction_t xMakeArray;         // makeArray len value
+xFunction_t xArrayLen;          // arrayLen array
+xFunction_t xArrayGet;          // arrayGet array index
+xFunction_t xArraySet;          // arraySet array index value
+xFunction_t xArrayAdd;          // arrayAdd dst a b, b may be an int
+xFunction_t xArraySubtract;     // arraySub dst a b
+xFunction_t xArrayMultiply;     // arrayMul dst a b
+xFunction_t xArrayLessEqual;    // arrayLe dst a b, gives 1 or 0 per element
+xFunction_t xArraySum;          // arraySum array
+xFunction_t xArrayMin;          // arrayMin array
+xFunction_t xArrayMax;          // arrayMax array
+xFunction_t xArrayDot;          // arrayDot a b
+
+/*
+ *  Register the functions above under their Rap names
+ */
+err_t xRegisterLibrary(struct xRap *rap);
@@ -5,74 +5,949 @@
  |                                                                      |
  +----------------------------------------------------------------------*/
 
+#define _POSIX_C_SOURCE 200809L // For open_memstream
+
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
 
 #include "cplus.h"
 
 #include "rap.h"
 
 #include "assemble.h"
+#include "bytecode.h"
+#include "cache.h"
+#include "image.h"
+#include "jit.h"
 #include "library.h"
+#include "reader.h"
+#include "regvm.h"
+#include "sampler.h"
+#include "verify.h"
 
 /*----------------------------------------------------------------------+
- |      main                                                            |
+ |      Options                                                         |
+ +----------------------------------------------------------------------*/
+
+static const char usage[] =
+        "Usage: rap [-O mask] [-H] [-r | -j | -b] [-c file | -l file] [-s file] [-C bytes] [-t threads]\n"
+        "  -O mask    enable assembler optimizations (bit 0: superinstructions,\n"
+        "             bit 1: constant folding, bit 2: loop optimization,\n"
+        "             bit 3: type inference)\n"
+        "  -H         print the most frequent instruction sequences at exit\n"
+        "  -r         execute on the register VM instead of the stack VM\n"
+        "  -j         compile to native code where possible\n"
+        "  -b         execute a compact byte encoding of the code\n"
+        "  -c file    compile only, writing the code to an image file\n"
+        "  -l file    execute the code from an image file instead of stdin\n"
+        "  -s file    sample the stack VM, print the hot spots at exit and write\n"
+        "             folded stacks to a file (needs a build with SAMPLING=1)\n"
+        "  -C bytes   memory for reusing the code of repeated programs, and print\n"
+        "             the cache statistics at exit (default 16 MB, 0 disables)\n"
+        "  -t threads run the programs on several threads, keeping the output\n"
+        "             in input order (not with -H, -c, -l or -s)\n";
+
+/*----------------------------------------------------------------------+
+ |      printCode                                                       |
+ +----------------------------------------------------------------------*/
+
+static
+void printCode(FILE *fp, const char *name, const int *code, int len,
+        const struct vmInstruction *instructions, int start)
+{
+        int n = 0;
+        for (int pc=start; pc<len; pc+=instructions[code[pc]].length) {
+                n++;
+        }
+
+        fprintf(fp, "%s:", name);
+        for (int i=0; i<len; i++) {
+                fprintf(fp, " %d", code[i]);
+        }
+        fprintf(fp, " (length: %d, instructions: %d)\n", len, n);
+}
+
+/*----------------------------------------------------------------------+
+ |      execute                                                         |
  +----------------------------------------------------------------------*/
 
-int main(void)
+/*
+ *  Code from an image isn't verified yet. That is done in a copy,
+ *  because the image may be read-only.
+ */
+static
+err_t encodeBytes(struct xRap *rap, const int *code, int len, byteList *bytes)
 {
         err_t err = OK;
+        intList copy = emptyList;
 
-        struct xRap rap;
-        err = xInit(&rap);
+        if ((code[vmHeaderFlags] & vmFlagVerified) == 0) {
+                for (int i=0; i<len; i++) {
+                        listPush(copy, code[i]);
+                }
+                err = xVerifyCode(rap, copy.v, len);
+                check(err);
+                code = copy.v;
+        }
+
+        err = xEncodeBytes(code, len, bytes);
         check(err);
+cleanup:
+        freeList(copy);
+        return err;
+}
 
-        for(;;) {
-                size_t len;
-                char *line = fgetln(stdin, &len);
+/*
+ *  Run one program and print its result
+ */
+static
+err_t execute(FILE *fp, struct xRap *rap, int *code, int len,
+        bool useRegisters, bool useNative, bool useBytes)
+{
+        err_t err = OK;
 
-                if (line == NULL) break;
-                xAssert(len > 0);
+        xValue_t locals[2];
+        int nrArrays = rap->arrays.len; // Those of this program are freed after it
 
-                if (line[len-1] != '\n') {
-                        xRaise("Incomplete input line");
+        struct xNative *native = NULL;
+        if (useNative) {
+                err = xCompileNative(rap, code, len, &native);
+                check(err);
+                if (native != NULL) {
+                        fprintf(fp, "Native: %zu bytes\n", native->size);
+                } else {
+                        fprintf(fp, "Native: not supported\n");
                 }
-                line[len-1] = '\0';
+        }
+
+        if (native != NULL) {
+                err = xExecuteNative(native, arrayLen(locals) - 1, locals + 1);
+                xFreeNative(native);
+                check(err);
+        } else if (useRegisters) {
+                intList regCode = emptyList;
+                err = xTranslateRegisters(code, len, &regCode);
+                check(err);
 
-                printf("Source: %s\n", line);
+                printCode(fp, "Registers", regCode.v, regCode.len, regInstructions,
+                        regHeaderSize + regCode.v[regHeaderConstants]);
+
+                err = xExecuteRegisters(regCode.v, arrayLen(locals) - 1, locals + 1);
+                freeList(regCode);
+                check(err);
+        } else if (useBytes) {
+                byteList bytes = emptyList;
+                err = encodeBytes(rap, code, len, &bytes);
+                check(err);
+
+                fprintf(fp, "Bytes:");
+                for (int i=0; i<bytes.len; i++) {
+                        fprintf(fp, " %d", bytes.v[i]);
+                }
+                fprintf(fp, " (length: %d, int code: %zu)\n", bytes.len, len * sizeof(int));
+
+                err = xExecuteBytes(bytes.v, arrayLen(locals) - 1, locals + 1);
+                freeList(bytes);
+                check(err);
+        } else {
+                err = xThreadCode(code, len);
+                check(err);
+
+                err = xExecute(code, arrayLen(locals) - 1, locals + 1);
+                check(err);
+        }
+
+        if (xIsDouble(locals[1])) {
+                err = xPrintDouble(NULL, 2, locals);
+        } else {
+                err = xPrintInt(NULL, 2, locals);
+        }
+        check(err);
+
+        fputc('\n', fp);
+
+cleanup:
+        xFreeArrays(rap, nrArrays);
+        return err;
+}
+
+/*
+ *  Only direct threading modifies the code. Code owned by the cache must
+ *  stay as compiled, so then it is copied into `code' for the stack VM.
+ */
+static
+err_t runnableCode(intList *code, const int *compiled, int len, int **runnable)
+{
+        err_t err = OK;
+
+        *runnable = (int *) compiled;
+        if (xDispatch == 2 && compiled != code->v) {
+                code->len = 0;
+                for (int i=0; i<len; i++) {
+                        listPush(*code, compiled[i]);
+                }
+                *runnable = code->v;
+        }
+cleanup:
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      compileProgram                                                  |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Print a program and get its code, from the cache when possible. The
+ *  code is left in `code' when the cache doesn't take it. Programs that
+ *  define functions aren't cached, because the definition happens when
+ *  they are compiled.
+ */
+static
+err_t compileProgram(FILE *fp, struct xRap *rap, struct xCache *cache, struct sourceMap *map,
+        const char *program, size_t len, intList *code, const int **compiled, int *compiledLen)
+{
+        err_t err = OK;
+
+        xAssert(len > 0 && len <= 0x7fffffff);
+        fprintf(fp, "Source: %.*s\n", (int) len - 1, program); // Without the newline
+
+        err = xCacheLookup(cache, program, len, compiled, compiledLen);
+        check(err);
 
+        if (*compiled == NULL) {
                 struct tokenize tokenize = {
-                        .source = line,
+                        .source = program,
+                        .end = program + len,
                 };
 
                 err = tokenizeStart(&tokenize);
                 check(err);
 
-                intList code = emptyList;
+                int nrFunctions = rap->functions.len;
+                err = compileLine(rap, &tokenize, code, map);
+                check(err);
+
+                *compiled = code->v;
+                *compiledLen = code->len;
+                if (cache->budget > 0 && rap->functions.len == nrFunctions) {
+                        err = xCacheInsert(cache, program, len, code);
+                        check(err);
+                }
+        }
+
+        printCode(fp, "Object", *compiled, *compiledLen, vmInstructions, vmHeaderSize);
+cleanup:
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      Batch mode                                                      |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  A pool of threads runs the programs, each thread with its own
+ *  interpreter and cache. The output of each program is collected in
+ *  memory, and the main thread prints it in input order. The main thread
+ *  also reads the input, so at most nrSlots programs are in flight.
+ *
+ *  Functions are defined while compiling, in the interpreter that does
+ *  so. A program that uses `fun' therefore hands the code of its
+ *  functions to the batch once it is compiled, and each worker binds them
+ *  with xDefine before it runs a later program. The workers have their
+ *  own symbol tables, so the code refers to symbols by name meanwhile.
+ */
+
+struct batchFunction {
+        int name;               // Offset into the names of the definition
+        int *code;              // With offsets into the names for symbols
+        int len;
+};
+
+struct batchDefinition {
+        long long program;      // That defines the functions
+        bool ready;             // It is compiled, and the functions are here
+        List(struct batchFunction) functions;
+        charList names;         // Null terminated
+        const struct batchWorker *worker; // That has them already
+};
+
+struct batchSlot {
+        charList source;        // Copy, as the reader may reuse its buffer
+        int definition;         // Index in batch.definitions, or -1
+        char *output;           // From open_memstream
+        size_t outputLen;
+        bool done;
+        err_t err;
+};
+
+struct batch {
+        pthread_mutex_t lock;
+        pthread_cond_t work;    // More programs, or the end
+        pthread_cond_t done;    // A program has finished
+        pthread_cond_t defined; // A definition is ready
+        struct batchSlot *slots;
+        int nrSlots;
+        long long nrQueued;     // Programs read so far
+        long long nrTaken;      // Programs started by the workers
+        bool eof;               // No more programs will be queued
+        bool stop;
+        List(struct batchDefinition) definitions; // In program order
+        bool useRegisters;
+        bool useNative;
+        bool useBytes;
+};
+
+struct batchWorker {
+        struct batch *batch;
+        struct xRap rap;
+        struct xCache cache;
+        intList code;           // When not owned by the cache
+        int nrBound;            // Definitions taken over in `rap'
+        pthread_t thread;
+};
 
-                err = compileLine(&tokenize, &code);
+/*
+ *  Offset of `name' in `names', adding it when it isn't there yet
+ */
+static
+err_t addName(charList *names, const char *name, int *offset)
+{
+        err_t err = OK;
+
+        *offset = 0;
+        while (*offset < names->len && 0!=strcmp(&names->v[*offset], name)) {
+                *offset += strlen(&names->v[*offset]) + 1;
+        }
+        if (*offset == names->len) {
+                for (int i=0; i<=strlen(name); i++) {
+                        listPush(*names, name[i]);
+                }
+        }
+cleanup:
+        return err;
+}
+
+/*
+ *  Hand the functions that compiling program `definition' made over to
+ *  the batch, and wake up the workers that wait for them. Also when there
+ *  are none, because it failed.
+ */
+static
+err_t publishDefinition(struct batchWorker *worker, int definition, xDefinitionList *defined)
+{
+        err_t err = OK;
+        struct batch *batch = worker->batch;
+        const struct xRap *rap = &worker->rap;
+
+        List(struct batchFunction) functions = emptyList;
+        charList names = emptyList;
+
+        for (int i=0; i<defined->len; i++) {
+                struct xDefinition *d = &defined->v[i];
+                for (int pc=vmHeaderSize; pc<d->len; pc+=vmInstructions[d->code[pc]].length) {
+                        if (d->code[pc] == vmSymbol) {
+                                err = addName(&names, rap->symbols.v[d->code[pc+1]].name, &d->code[pc+1]);
+                                check(err);
+                        }
+                }
+                struct batchFunction f = { .code = d->code, .len = d->len };
+                err = addName(&names, rap->symbols.v[d->symbol].name, &f.name);
                 check(err);
+                listPush(functions, f);
+                d->code = NULL;
+        }
+cleanup:
+        if (err != OK) {
+                for (int i=0; i<functions.len; i++) {
+                        free(functions.v[i].code);
+                }
+                functions.len = 0;
+        }
+        for (int i=0; i<defined->len; i++) {
+                free(defined->v[i].code);
+        }
+        defined->len = 0;
 
-                printf("Object:");
-                for (int i=0; i<code.len; i++) {
-                        printf(" %d", code.v[i]);
+        pthread_mutex_lock(&batch->lock);
+        struct batchDefinition *d = &batch->definitions.v[definition];
+        d->functions.v = functions.v;
+        d->functions.len = functions.len;
+        d->functions.maxLen = functions.maxLen;
+        d->names = names;
+        d->worker = worker;
+        d->ready = true;
+        pthread_cond_broadcast(&batch->defined);
+        pthread_mutex_unlock(&batch->lock);
+        return err;
+}
+
+/*
+ *  Define the functions of a definition in another interpreter
+ */
+static
+err_t bindDefinition(struct xRap *rap, const struct batchDefinition *d)
+{
+        err_t err = OK;
+        int *copy = NULL;
+
+        for (int i=0; i<d->functions.len; i++) {
+                const struct batchFunction *f = &d->functions.v[i];
+                copy = malloc(f->len * sizeof(int));
+                if (copy == NULL) {
+                        xRaise("Out of memory");
                 }
-                printf(" (length: %d)\n", code.len);
+                memcpy(copy, f->code, f->len * sizeof(int));
 
-                xValue_t locals[2];
+                for (int pc=vmHeaderSize; pc<f->len; pc+=vmInstructions[copy[pc]].length) {
+                        if (copy[pc] == vmSymbol) {
+                                const char *name = &d->names.v[copy[pc+1]];
+                                err = xIntern(rap, name, strlen(name), &copy[pc+1]);
+                                check(err);
+                        }
+                }
 
-                err = xExecute(code.v, arrayLen(locals) - 1, locals + 1);
+                const char *name = &d->names.v[f->name];
+                int symbol;
+                err = xIntern(rap, name, strlen(name), &symbol);
+                check(err);
+                err = xDefine(rap, symbol, copy, f->len);
                 check(err);
+                copy = NULL;
+        }
+cleanup:
+        free(copy);
+        return err;
+}
 
-                freeList(code);
+/*
+ *  Bind the functions of the programs before `program', waiting for
+ *  those that aren't compiled yet. With the lock held.
+ */
+static
+err_t bindDefinitions(struct batchWorker *worker, long long program)
+{
+        err_t err = OK;
+        struct batch *batch = worker->batch;
 
-                err = xPrintInt(NULL, 2, locals);
+        while (worker->nrBound < batch->definitions.len) {
+                const struct batchDefinition *d = &batch->definitions.v[worker->nrBound];
+                if (d->program >= program) {
+                        break;
+                }
+                if (!d->ready) {
+                        pthread_cond_wait(&batch->defined, &batch->lock);
+                        continue;
+                }
+                if (d->worker != worker) {
+                        err = bindDefinition(&worker->rap, d);
+                        check(err);
+                }
+                worker->nrBound++;
+        }
+cleanup:
+        return err;
+}
+
+static
+err_t runSlot(struct batchWorker *worker, struct batchSlot *slot)
+{
+        err_t err = OK;
+        const struct batch *batch = worker->batch;
+
+        intList *code = &worker->code;
+        FILE *fp = open_memstream(&slot->output, &slot->outputLen);
+        if (fp == NULL) {
+                xRaise("Cannot create output buffer");
+        }
+        worker->rap.out = fp;
+
+        const int *compiled;
+        int compiledLen;
+        xDefinitionList defined = emptyList;
+        if (slot->definition >= 0) {
+                worker->rap.defined = &defined;
+        }
+        err = compileProgram(fp, &worker->rap, &worker->cache, NULL,
+                slot->source.v, slot->source.len, code, &compiled, &compiledLen);
+        worker->rap.defined = NULL;
+        if (slot->definition >= 0) {
+                err_t publishErr = publishDefinition(worker, slot->definition, &defined);
+                if (err == OK) {
+                        err = publishErr;
+                } else if (publishErr != OK) {
+                        (void) err_free(publishErr);
+                }
+        }
+        freeList(defined);
+        check(err);
+
+        int *runnable = (int *) compiled;
+        if (!batch->useRegisters && !batch->useNative && !batch->useBytes) {
+                err = runnableCode(code, compiled, compiledLen, &runnable);
                 check(err);
+        }
 
-                putchar('\n');
+        err = execute(fp, &worker->rap, runnable, compiledLen,
+                batch->useRegisters, batch->useNative, batch->useBytes);
+        check(err);
+cleanup:
+        worker->rap.out = stdout;
+        if (fp != NULL) {
+                fclose(fp);
+        }
+        return err;
+}
+
+static
+void *batchWorker(void *arg)
+{
+        struct batchWorker *worker = arg;
+        struct batch *batch = worker->batch;
+
+        xCurrentRap = &worker->rap; // Initialized by the main thread
+
+        pthread_mutex_lock(&batch->lock);
+        for (;;) {
+                while (!batch->stop && !batch->eof && batch->nrTaken == batch->nrQueued) {
+                        pthread_cond_wait(&batch->work, &batch->lock);
+                }
+                if (batch->stop || batch->nrTaken == batch->nrQueued) {
+                        break;
+                }
+                long long program = batch->nrTaken++;
+                struct batchSlot *slot = &batch->slots[program % batch->nrSlots];
+                err_t err = bindDefinitions(worker, program);
+                pthread_mutex_unlock(&batch->lock);
+
+                if (err == OK) {
+                        err = runSlot(worker, slot);
+                }
+
+                pthread_mutex_lock(&batch->lock);
+                if (slot->definition >= 0 && !batch->definitions.v[slot->definition].ready) {
+                        // Not compiled, so without functions
+                        batch->definitions.v[slot->definition].ready = true;
+                        pthread_cond_broadcast(&batch->defined);
+                }
+                slot->err = err;
+                slot->done = true;
+                pthread_cond_signal(&batch->done);
+        }
+        pthread_mutex_unlock(&batch->lock);
+
+        return NULL;
+}
+
+static
+err_t copySource(charList *source, const char *program, size_t len)
+{
+        err_t err = OK;
+
+        xAssert(len > 0 && len <= 0x7fffffff);
+        void *v = source->v;
+        err = list_ensure_len(&v, &source->maxLen, len, 1, firstListSize);
+        check(err);
+        source->v = v;
+        memcpy(source->v, program, len);
+        source->len = len;
+cleanup:
+        return err;
+}
+
+/*
+ *  Announce that the next program to queue defines functions
+ */
+static
+err_t addDefinition(struct batch *batch, int *definition)
+{
+        err_t err = OK;
+
+        struct batchDefinition d = {
+                .program = batch->nrQueued,
+                .ready = false,
+                .functions = emptyList,
+                .names = emptyList,
+                .worker = NULL,
+        };
+        listPush(batch->definitions, d);
+        *definition = batch->definitions.len - 1;
+cleanup:
+        return err;
+}
+
+/*
+ *  Whether a program uses `fun'
+ */
+static
+bool isDefinitionSource(const charList *source)
+{
+        struct tokenize tokenize = {
+                .source = source->v,
+                .end = source->v + source->len,
+        };
+        err_t err = tokenizeStart(&tokenize);
+        if (err != OK) {
+                (void) err_free(err);
+                return false;
+        }
+        return isDefinition(&tokenize);
+}
+
+static
+err_t runBatch(struct xRap *rap, struct xReader *reader, int nrThreads,
+        bool useRegisters, bool useNative, bool useBytes, size_t cacheBudget)
+{
+        err_t err = OK;
+        err_t readErr = OK;
+
+        struct batch batch = {
+                .slots = calloc(16 * nrThreads, sizeof(struct batchSlot)),
+                .nrSlots = 16 * nrThreads,
+                .useRegisters = useRegisters,
+                .useNative = useNative,
+                .useBytes = useBytes,
+        };
+        pthread_mutex_init(&batch.lock, NULL);
+        pthread_cond_init(&batch.work, NULL);
+        pthread_cond_init(&batch.done, NULL);
+        pthread_cond_init(&batch.defined, NULL);
+
+        struct batchWorker *workers = calloc(nrThreads, sizeof(*workers));
+        int nrInitialized = 0;
+        int nrStarted = 0;
+
+        if (batch.slots == NULL || workers == NULL) {
+                xRaise("Out of memory");
+        }
+
+        for (; nrInitialized<nrThreads; nrInitialized++) {
+                struct batchWorker *worker = &workers[nrInitialized];
+                worker->batch = &batch;
+                xInitCache(&worker->cache, cacheBudget / nrThreads);
+                err = xInit(&worker->rap);
+                check(err);
+                worker->rap.optimize = rap->optimize;
+        }
+        xCurrentRap = rap; // Undo xInit
+
+        for (; nrStarted<nrThreads; nrStarted++) {
+                if (pthread_create(&workers[nrStarted].thread, NULL, batchWorker, &workers[nrStarted]) != 0) {
+                        xRaise("Cannot create thread");
+                }
+        }
+
+        long long nrPrinted = 0;
+        pthread_mutex_lock(&batch.lock);
+        for (;;) {
+                // Print the finished programs in order
+                struct batchSlot *slot = &batch.slots[nrPrinted % batch.nrSlots];
+                if (nrPrinted < batch.nrQueued && slot->done) {
+                        pthread_mutex_unlock(&batch.lock);
+                        fwrite(slot->output, 1, slot->outputLen, stdout);
+                        free(slot->output);
+                        slot->output = NULL;
+                        slot->done = false;
+                        err = slot->err;
+                        pthread_mutex_lock(&batch.lock);
+                        nrPrinted++;
+                        if (err != OK) {
+                                break;
+                        }
+                        continue;
+                }
+
+                if (batch.eof || batch.nrQueued - nrPrinted == batch.nrSlots) {
+                        if (batch.eof && nrPrinted == batch.nrQueued) {
+                                break;
+                        }
+                        pthread_cond_wait(&batch.done, &batch.lock);
+                        continue;
+                }
+
+                // Queue the next program. Only this thread changes nrQueued.
+                pthread_mutex_unlock(&batch.lock);
+                const char *program;
+                size_t len;
+                readErr = xReadProgram(reader, &program, &len);
+                bool defines = false;
+                if (readErr == OK && program != NULL) {
+                        slot = &batch.slots[batch.nrQueued % batch.nrSlots];
+                        readErr = copySource(&slot->source, program, len);
+                        defines = (readErr == OK && isDefinitionSource(&slot->source));
+                }
+                pthread_mutex_lock(&batch.lock);
+                if (readErr == OK && program != NULL) {
+                        slot->definition = -1;
+                        if (defines) {
+                                readErr = addDefinition(&batch, &slot->definition);
+                        }
+                }
+                if (readErr != OK || program == NULL) {
+                        batch.eof = true;
+                        pthread_cond_broadcast(&batch.work);
+                } else {
+                        batch.nrQueued++;
+                        pthread_cond_signal(&batch.work);
+                }
+        }
+        batch.stop = true;
+        pthread_cond_broadcast(&batch.work);
+        pthread_mutex_unlock(&batch.lock);
+
+        if (err == OK) {
+                err = readErr;
+        }
+
+cleanup:
+        if (nrStarted < nrThreads) {
+                // Release the workers that did start
+                pthread_mutex_lock(&batch.lock);
+                batch.stop = true;
+                pthread_cond_broadcast(&batch.work);
+                pthread_mutex_unlock(&batch.lock);
+        }
+        for (int i=0; i<nrStarted; i++) {
+                pthread_join(workers[i].thread, NULL);
+        }
+        for (int i=0; i<nrInitialized; i++) {
+                xFree(&workers[i].rap);
+                xFreeCache(&workers[i].cache);
+                freeList(workers[i].code);
+        }
+        xCurrentRap = rap;
+        if (batch.slots != NULL) {
+                for (int i=0; i<batch.nrSlots; i++) {
+                        free(batch.slots[i].output);
+                        freeList(batch.slots[i].source);
+                }
+        }
+        free(batch.slots);
+        free(workers);
+        for (int i=0; i<batch.definitions.len; i++) {
+                for (int j=0; j<batch.definitions.v[i].functions.len; j++) {
+                        free(batch.definitions.v[i].functions.v[j].code);
+                }
+                freeList(batch.definitions.v[i].functions);
+                freeList(batch.definitions.v[i].names);
+        }
+        freeList(batch.definitions);
+        pthread_cond_destroy(&batch.defined);
+        pthread_cond_destroy(&batch.done);
+        pthread_cond_destroy(&batch.work);
+        pthread_mutex_destroy(&batch.lock);
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      main                                                            |
+ +----------------------------------------------------------------------*/
+
+int main(int argc, char *argv[])
+{
+        err_t err = OK;
+
+        struct xRap rap;
+        err = xInit(&rap);
+        check(err);
+
+        bool printHistogram = false;
+        bool useRegisters = false;
+        bool useNative = false;
+        bool useBytes = false;
+        const char *imageOut = NULL;
+        const char *imageIn = NULL;
+        const char *stacksOut = NULL;
+
+        intList code = emptyList;       // When not owned by the cache
+        intList image = emptyList;      // For -c
+        intList starts = emptyList;
+        struct xImage loaded = { .map = NULL };
+        struct xReader reader = { .map = NULL, .buffer = emptyList };
+        struct sourceMap map = { emptyList, emptyList }; // For -s
+        struct xSamples samples = { emptyList, emptyList };
+        int nrPrograms = 0;
+        struct xCache cache;
+        size_t cacheBudget = 16 << 20;
+        bool printCache = false;
+        int nrThreads = 0;
+        xInitCache(&cache, 0); // Sized after the options
+
+        for (int i=1; i<argc; i++) {
+                if (0==strcmp(argv[i], "-O") && i+1 < argc) {
+                        rap.optimize = strtoul(argv[++i], NULL, 0);
+                } else if (0==strcmp(argv[i], "-H")) {
+                        printHistogram = true;
+                } else if (0==strcmp(argv[i], "-r")) {
+                        useRegisters = true;
+                } else if (0==strcmp(argv[i], "-j")) {
+                        useNative = true;
+                } else if (0==strcmp(argv[i], "-b")) {
+                        useBytes = true;
+                } else if (0==strcmp(argv[i], "-c") && i+1 < argc) {
+                        imageOut = argv[++i];
+                } else if (0==strcmp(argv[i], "-l") && i+1 < argc) {
+                        imageIn = argv[++i];
+                } else if (0==strcmp(argv[i], "-s") && i+1 < argc) {
+                        stacksOut = argv[++i];
+                } else if (0==strcmp(argv[i], "-C") && i+1 < argc) {
+                        cacheBudget = strtoul(argv[++i], NULL, 0);
+                        printCache = true;
+                } else if (0==strcmp(argv[i], "-t") && i+1 < argc) {
+                        nrThreads = atoi(argv[++i]);
+                        if (nrThreads < 1 || nrThreads > 1024) {
+                                xRaise("Invalid number of threads");
+                        }
+                } else {
+                        fputs(usage, stderr);
+                        xRaise("Invalid option");
+                }
+        }
+
+        bool batchConflict = printHistogram || imageOut != NULL || imageIn != NULL || stacksOut != NULL;
+        if ((imageOut != NULL && imageIn != NULL) || (stacksOut != NULL && imageIn != NULL)
+         || (nrThreads > 0 && batchConflict)) {
+                fputs(usage, stderr);
+                xRaise("Invalid option");
+        }
+
+#if xProfile
+        // The report is printed at exit
+        rap.profile = calloc(1, sizeof(*rap.profile));
+        if (rap.profile == NULL) {
+                xRaise("Out of memory");
+        }
+#endif
+
+        if (stacksOut != NULL) {
+                err = xStartSampler(1000);
+                check(err);
+        }
+
+        if (imageIn != NULL) {
+                err = xLoadImage(&rap, imageIn, &loaded);
+                check(err);
+
+                for (int i=0; i<loaded.nrPrograms; i++) {
+                        int *code = &loaded.code[loaded.programs[i].start];
+                        int len = loaded.programs[i].len;
+                        printCode(stdout, "Object", code, len, vmInstructions, vmHeaderSize);
+                        if (!useRegisters && !useNative && !useBytes) {
+                                err = xThreadImage(&loaded, i);
+                                check(err);
+                        }
+                        err = execute(stdout, &rap, code, len, useRegisters, useNative, useBytes);
+                        check(err);
+                }
+                goto cleanup;
+        }
+
+        if (useRegisters || useNative || imageOut != NULL) {
+                // The translators only know the basic instructions, and
+                // images may be run with them
+                rap.optimize &= ~xOptimizeSuperinstructions;
+        }
+
+        if (printHistogram) {
+                int n = vmNrInstructions;
+                rap.sequences = calloc(n*n + n*n*n, sizeof(int));
+                if (rap.sequences == NULL) {
+                        xRaise("Out of memory");
+                }
+        }
+
+        if (printHistogram || stacksOut != NULL) {
+                // These need every program compiled
+                cacheBudget = 0;
+        }
+        xInitCache(&cache, cacheBudget);
+
+        err = xOpenReader(&reader, 0); // stdin
+        check(err);
+
+        if (nrThreads > 0) {
+                err = runBatch(&rap, &reader, nrThreads, useRegisters, useNative, useBytes, cacheBudget);
+                check(err);
+                goto cleanup;
+        }
+
+        for(;;) {
+                const char *program;
+                size_t len;
+                err = xReadProgram(&reader, &program, &len);
+                check(err);
+
+                if (program == NULL) break;
+
+                const int *compiled;
+                int compiledLen;
+
+                err = compileProgram(stdout, &rap, &cache, (stacksOut != NULL) ? &map : NULL,
+                        program, len, &code, &compiled, &compiledLen);
+                check(err);
+
+                if (imageOut != NULL) {
+                        listPush(starts, image.len);
+                        for (int i=0; i<compiledLen; i++) {
+                                listPush(image, compiled[i]);
+                        }
+                        // Code from disk isn't trusted: it runs with checks
+                        image.v[starts.v[starts.len-1] + vmHeaderFlags] &= ~vmFlagVerified;
+                        continue;
+                }
+
+                int *runnable = (int *) compiled;
+                if (!useRegisters && !useNative && !useBytes) {
+                        err = runnableCode(&code, compiled, compiledLen, &runnable);
+                        check(err);
+                }
+
+                err = execute(stdout, &rap, runnable, compiledLen, useRegisters, useNative, useBytes);
+                check(err);
+
+                if (stacksOut != NULL) {
+                        err = xCollectSamples(&samples, ++nrPrograms, runnable, &map, program);
+                        check(err);
+                }
+        }
+
+        if (imageOut != NULL) {
+                err = xWriteImage(&rap, imageOut, &image, &starts);
+                check(err);
+        }
+
+        if (printHistogram) {
+                printSequences(stderr, rap.sequences);
+        }
+
+        if (printCache) {
+                xPrintCacheStatistics(stderr, &cache);
+        }
+
+        if (stacksOut != NULL) {
+                xStopSampler();
+                xPrintHotSpots(stderr, &samples);
+                err = xWriteFoldedStacks(&samples, stacksOut);
+                check(err);
         }
 
 cleanup:
+        if (rap.profile != NULL) {
+                xPrintProfile(stderr, rap.profile);
+        }
+        xFree(&rap);
+        freeList(code);
+        freeList(image);
+        freeList(starts);
+        xUnloadImage(&loaded);
+        xCloseReader(&reader);
+        freeSourceMap(&map);
+        xFreeCache(&cache);
+        xFreeSamples(&samples);
+
         return xExitMain(err);
 }
 
@@ -5,24 +5,67 @@
  |                                                                      |
  +----------------------------------------------------------------------*/
 
+#define _DEFAULT_SOURCE // For MAP_ANONYMOUS
+
+#include <limits.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "cplus.h"
 #include "rap.h"
 
+#include "array.h"
+#include "assemble.h"
 #include "library.h"
 
 /*----------------------------------------------------------------------+
- |      Data                                                            |
+ |      Global interpreter data                                         |
  +----------------------------------------------------------------------*/
 
-static const xTypeId_t boolTypeIds[] = { xFalseId, xTrueId };
+__thread struct xRap *xCurrentRap;
+__thread volatile struct xFrame *volatile xCurrentFrame;
 
-/*----------------------------------------------------------------------+
- |      Global interpreter data                                         |
- +----------------------------------------------------------------------*/
+/*
+ *  Map the values with a guard page on each side. The end of the stack
+ *  is against the upper one, where overflows go.
+ */
+static
+err_t initStack(struct xStack *stack)
+{
+        err_t err = OK;
+
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t size = (xStackSize * sizeof(xValue_t) + page - 1) / page * page;
+
+        stack->returns = malloc(xMaxCallDepth * sizeof(struct xReturn));
+        if (stack->returns == NULL) {
+                xRaise("Out of memory");
+        }
+        stack->returnsTop = stack->returns;
+        stack->returnsEnd = stack->returns + xMaxCallDepth;
+
+        char *map = mmap(NULL, size + 2 * page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+                xRaise("Out of memory");
+        }
+        stack->map = map;
+        stack->mapSize = size + 2 * page;
+
+        if (mprotect(map + page, size, PROT_READ | PROT_WRITE) != 0) {
+                xRaise("mprotect failed");
+        }
+        stack->end = (xValue_t *) (map + page + size);
+        stack->base = stack->end - xStackSize;
+        stack->top = stack->base;
+cleanup:
+        return err;
+}
 
 /*
  *  xInit may not give variable size exceptions
@@ -34,147 +77,1151 @@ err_t xInit(struct xRap *rap)
 
         xAssert(rap != NULL);
 
+        *rap = (struct xRap) {
+                .optimize = xOptimizeAll,
+                .sequences = NULL,
+                .symbols = emptyList,
+                .symbolSlots = NULL,
+                .symbolMask = -1,
+                .instructions = 0,
+                .profile = NULL,
+                .out = stdout,
+                .arena = emptyArena,
+                .functions = emptyList,
+                .defined = NULL,
+                .arrays = emptyList,
+                .kernels = xSelectArrayKernels(NULL),
+                .stack = { .map = NULL, .returns = NULL },
+        };
+        xCurrentRap = rap;
+
+        err = initStack(&rap->stack);
+        check(err);
+
         // TODO: Initialize typeId generator
 
-        // TODO: Initialize basic method tables
+        err = xRegisterLibrary(rap);
+        check(err);
+
+        err = initAssembler();
+        check(err);
+
+cleanup:
+        return err;
+}
+
+void xFree(struct xRap *rap)
+{
+        for (int i=0; i<rap->symbols.len; i++) {
+                free(rap->symbols.v[i].name);
+        }
+        freeList(rap->symbols);
+        for (int i=0; i<rap->functions.len; i++) {
+                free(rap->functions.v[i]);
+        }
+        freeList(rap->functions);
+        xFreeArrays(rap, 0);
+        freeList(rap->arrays);
+        if (rap->stack.map != NULL) {
+                munmap(rap->stack.map, rap->stack.mapSize);
+        }
+        free(rap->stack.returns);
+        free(rap->symbolSlots);
+        free(rap->sequences);
+        free(rap->profile);
+        xFreeArena(&rap->arena);
+        if (xCurrentRap == rap) {
+                xCurrentRap = NULL;
+        }
+}
+
+/*----------------------------------------------------------------------+
+ |      Symbols                                                         |
+ +----------------------------------------------------------------------*/
+
+// FNV-1a
+static
+unsigned hashName(const char *name, int len)
+{
+        unsigned hash = 2166136261u;
+        for (int i=0; i<len; i++) {
+                hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+        }
+        return hash;
+}
+
+/*
+ *  Find the slot for a name: either the one holding it, or the empty slot
+ *  where it should go
+ */
+static
+int findSlot(const struct xRap *rap, const char *name, int len, unsigned hash)
+{
+        int slot = hash & rap->symbolMask;
+        for (;;) {
+                int index = rap->symbolSlots[slot] - 1;
+                if (index < 0) {
+                        return slot;
+                }
+                const struct xSymbol *symbol = &rap->symbols.v[index];
+                if (symbol->hash == hash && symbol->len == len
+                 && 0==memcmp(symbol->name, name, len)) {
+                        return slot;
+                }
+                slot = (slot + 1) & rap->symbolMask;
+        }
+}
+
+// Keep the table at most half full
+static
+err_t growSymbolSlots(struct xRap *rap)
+{
+        err_t err = OK;
+
+        int nrSlots = max(64, 2 * (rap->symbolMask + 1));
+        int *slots = calloc(nrSlots, sizeof(int));
+        if (slots == NULL) {
+                xRaise("Out of memory");
+        }
+
+        free(rap->symbolSlots);
+        rap->symbolSlots = slots;
+        rap->symbolMask = nrSlots - 1;
+
+        for (int i=0; i<rap->symbols.len; i++) {
+                const struct xSymbol *symbol = &rap->symbols.v[i];
+                int slot = findSlot(rap, symbol->name, symbol->len, symbol->hash);
+                slots[slot] = i + 1;
+        }
+cleanup:
+        return err;
+}
+
+int xLookup(const struct xRap *rap, const char *name, int len)
+{
+        if (rap->symbolSlots == NULL) {
+                return -1;
+        }
+        int slot = findSlot(rap, name, len, hashName(name, len));
+        return rap->symbolSlots[slot] - 1;
+}
+
+err_t xIntern(struct xRap *rap, const char *name, int len, int *index)
+{
+        err_t err = OK;
+
+        xAssert(len >= 0);
+
+        if (2 * (rap->symbols.len + 1) > rap->symbolMask + 1) {
+                err = growSymbolSlots(rap);
+                check(err);
+        }
+
+        unsigned hash = hashName(name, len);
+        int slot = findSlot(rap, name, len, hash);
+        if (rap->symbolSlots[slot] > 0) {
+                *index = rap->symbolSlots[slot] - 1;
+                goto cleanup;
+        }
+
+        struct xSymbol symbol = {
+                .name = malloc(len + 1),
+                .len = len,
+                .hash = hash,
+                .value = xNone,
+                .flags = 0,
+        };
+        if (symbol.name == NULL) {
+                xRaise("Out of memory");
+        }
+        memcpy(symbol.name, name, len);
+        symbol.name[len] = '\0';
+
+        listPush(rap->symbols, symbol);
+        *index = rap->symbols.len - 1;
+        rap->symbolSlots[slot] = *index + 1;
+
+cleanup:
+        return err;
+}
+
+err_t xRegister(struct xRap *rap, const char *name, xFunction_t *fn, unsigned flags)
+{
+        err_t err = OK;
+
+        int index;
+        err = xIntern(rap, name, strlen(name), &index);
+        check(err);
+
+        rap->symbols.v[index].value = xFunction(fn);
+        rap->symbols.v[index].flags = flags;
+cleanup:
+        return err;
+}
+
+/*
+ *  Older code may still run while a function is redefined, so the code
+ *  of all definitions is kept until xFree
+ */
+err_t xDefine(struct xRap *rap, int index, int *code, int len)
+{
+        err_t err = OK;
+        int *copy = NULL;
+
+        xAssert(0 <= index && index < rap->symbols.len);
+        xAssert(len >= vmHeaderSize && code[vmHeaderArguments] >= 1);
 
-        // TODO: Initialize assembler jump tables
+        if (xIsFunction(rap->symbols.v[index].value)) {
+                xRaise("Can't redefine a builtin function");
+        }
 
-        rap->dummy = 1;
+        if (rap->defined != NULL) {
+                copy = malloc(len * sizeof(int));
+                if (copy == NULL) {
+                        xRaise("Out of memory");
+                }
+                memcpy(copy, code, len * sizeof(int));
+                struct xDefinition d = { .symbol = index, .code = copy, .len = len };
+                listPush(*rap->defined, d);
+                copy = NULL;
+        }
 
+        err = xThreadCode(code, len);
+        check(err);
+
+        listPush(rap->functions, code);
+        rap->symbols.v[index].value = xRapFunction(code);
+        rap->symbols.v[index].flags = 0;
 cleanup:
+        free(copy);
         return err;
 }
 
+/*----------------------------------------------------------------------+
+ |      Arrays                                                          |
+ +----------------------------------------------------------------------*/
+
+// A cache line, and enough for the widest vectors of the kernels
+#define arrayAlignment 64
+
+err_t xNewArray(struct xRap *rap, int len, struct xArray **array)
+{
+        err_t err = OK;
+
+        struct xArray *a = NULL;
+        void *v = NULL;
+
+        if (len < 0) {
+                xRaise("Negative array length");
+        }
+
+        a = malloc(sizeof(*a));
+        if (a == NULL || posix_memalign(&v, arrayAlignment, max(len, 1) * sizeof(int)) != 0) {
+                xRaise("Out of memory");
+        }
+        *a = (struct xArray) { .v = v, .len = len };
+
+        listPush(rap->arrays, a);
+        *array = a;
+        a = NULL;
+        v = NULL;
+cleanup:
+        free(v);
+        free(a);
+        return err;
+}
+
+void xFreeArrays(struct xRap *rap, int keep)
+{
+        for (int i=keep; i<rap->arrays.len; i++) {
+                free(rap->arrays.v[i]->v);
+                free(rap->arrays.v[i]);
+        }
+        rap->arrays.len = min(rap->arrays.len, keep);
+}
+
 /*----------------------------------------------------------------------+
  |      The virtual machine                                             |
  +----------------------------------------------------------------------*/
 
+const struct vmInstruction vmInstructions[] = {
+        [vmInt]                         = { "vmInt",                            2 },
+        [vmSubtractInt]                 = { "vmSubtractInt",                    1 },
+        [vmMultiplyInt]                 = { "vmMultiplyInt",                    1 },
+        [vmIncrementInt]                = { "vmIncrementInt",                   1 },
+        [vmLessEqualInt]                = { "vmLessEqualInt",                   1 },
+        [vmSymbol]                      = { "vmSymbol",                         2 },
+        [vmCall]                        = { "vmCall",                           2 },
+        [vmTailCall]                    = { "vmTailCall",                       2 },
+        [vmReturn]                      = { "vmReturn",                         1 },
+        [vmDrop]                        = { "vmDrop",                           2 },
+        [vmJump]                        = { "vmJump",                           2, 1 },
+        [vmJumpF]                       = { "vmJumpF",                          2, 1 },
+        [vmJumpT]                       = { "vmJumpT",                          2, 1 },
+        [vmGetLocal]                    = { "vmGetLocal",                       2 },
+        [vmSetLocal]                    = { "vmSetLocal",                       2 },
+        [vmCheckType]                   = { "vmCheckType",                      3 },
+        [vmLoopInt]                     = { "vmLoopInt",                        4, 3 },
+        [vmDouble]                      = { "vmDouble",                         3 },
+        [vmAddDouble]                   = { "vmAddDouble",                      1 },
+        [vmSubtractDouble]              = { "vmSubtractDouble",                 1 },
+        [vmMultiplyDouble]              = { "vmMultiplyDouble",                 1 },
+        [vmDivideDouble]                = { "vmDivideDouble",                   1 },
+        [vmMultiplyAddDouble]           = { "vmMultiplyAddDouble",              1 },
+        [vmMaxDouble]                   = { "vmMaxDouble",                      1 },
+        [vmMinDouble]                   = { "vmMinDouble",                      1 },
+        [vmLessEqualDouble]             = { "vmLessEqualDouble",                1 },
+        [vmNegateDouble]                = { "vmNegateDouble",                   1 },
+        [vmAbsDouble]                   = { "vmAbsDouble",                      1 },
+        [vmExpDouble]                   = { "vmExpDouble",                      1 },
+        [vmLogDouble]                   = { "vmLogDouble",                      1 },
+        [vmInverseDouble]               = { "vmInverseDouble",                  1 },
+        [vmSqrtDouble]                  = { "vmSqrtDouble",                     1 },
+        [vmSigmoidDouble]               = { "vmSigmoidDouble",                  1 },
+        [vmRoundFloat]                  = { "vmRoundFloat",                     1 },
+        [vmIntToDouble]                 = { "vmIntToDouble",                    1 },
+        [vmDoubleToInt]                 = { "vmDoubleToInt",                    1 },
+
+        [vmGetLocalIntLessEqualJumpT]   = { "vmGetLocalIntLessEqualJumpT",      4, 3 },
+        [vmGetLocalIncrementSetLocal]   = { "vmGetLocalIncrementSetLocal",      3 },
+        [vmGetLocalMultiplyInt]         = { "vmGetLocalMultiplyInt",            2 },
+        [vmIntSubtractInt]              = { "vmIntSubtractInt",                 2 },
+        [vmDropJump]                    = { "vmDropJump",                       3, 2 },
+        [vmGetLocalIntSubtractSetLocalDrop] = { "vmGetLocalIntSubtractSetLocalDrop", 5 },
+};
+
+/*
+ *  Dispatch primitives
+ *
+ *  dispatch    start executing at pc
+ *  op(name)    start of the handler for instruction `name'
+ *  next        continue with the instruction at pc
+ *
+ *  Instructions that check their operands are split in two parts:
+ *
+ *  checked(name)       start of the checks, for code that isn't verified
+ *  unchecked(name)     start of the rest, where verified code enters
+ *
+ *  With computed goto each handler ends in its own indirect jump, which
+ *  gives the branch predictor one history per handler instead of one for
+ *  the whole loop. The non-standard parts are wrapped in __extension__ to
+ *  keep -pedantic quiet.
+ */
+
+#if xCountInstructions
+ #define count()        (instructions++)
+#else
+ #define count()        ((void) 0)
+#endif
+
+#if xProfile
+ #define profile(name)  profileEnter(&profile, name)
+#else
+ #define profile(name)  ((void) 0)
+#endif
+
+#if xSampling
+ #define sample()       (frame.pc = pc)
+ #define sampleCode()   (frame.code = code)
+#else
+ #define sample()       ((void) 0)
+ #define sampleCode()   ((void) 0)
+#endif
+
+#if xDispatch == 0
+
+ #define dispatch       count(); switch (*(int *)pc)
+ #define op(name)       case name: profile(name); sample();
+ #define checked(name)  case name: if (verified) goto L_##name;
+ #define next           continue
+
+#elif xDispatch == 1
+
+ #define dispatch       next;
+ #define op(name)       L_##name: profile(name); sample();
+ #define checked(name)  C_##name:
+ #define next           __extension__ ({ count(); goto *table[*(int *)pc]; })
+
+#elif xDispatch == 2
+
+ #define dispatch       next;
+ #define op(name)       L_##name: profile(name); sample();
+ #define checked(name)  C_##name:
+ #define next           __extension__ ({ count(); goto *((char *) &&L_vmInt + *(int *)pc); })
+
+#else
+ #error "Unknown xDispatch method"
+#endif
+
+#define unchecked(name) L_##name: profile(name); sample();
+
+#if xDispatch != 0
+ #define label(name)    [name] = __extension__ &&L_##name
+ #define checkedLabel(name) [name] = __extension__ &&C_##name
+#endif
+
+#define operand(i)      (((int *)pc)[i])
+
+#if xDispatch == 1
+ #define selectHandlers() (table = verified ? labels : checkedLabels)
+#else
+ #define selectHandlers() ((void) 0)
+#endif
+
+/*
+ *  Continue in the code of another frame, after a call or a return
+ */
+#define switchCode() do{\
+        nrLocals = code[vmHeaderLocals];\
+        verified = (code[vmHeaderFlags] & vmFlagVerified) != 0;\
+        selectHandlers();\
+        sampleCode();\
+}while(0)
+
+/*
+ *  Instrumentation, see xProfile
+ *
+ *  The cycles of a handler are taken until the next handler starts, so
+ *  they include the dispatch and part of the counting overhead. About one
+ *  in profileSampleRate handlers is timed to keep that overhead low. The
+ *  choice is pseudo-random, because a fixed interval can fall in step with
+ *  a loop and only ever time some of its instructions.
+ */
+
+#if xProfile
+
+#define profileSampleRate 64 // Power of two
+
+#if xProfile >= 2 && (defined(__x86_64__) || defined(__i386__))
+ #define readCycles()   __builtin_ia32_rdtsc()
+#elif xProfile >= 2
+ #error "Cycle sampling needs x86"
+#endif
+
+struct profileState {
+        struct xProfileData *profile; // Or NULL to not count
+        int previous;           // Last opcode, or -1
+        int sampled;            // Opcode being timed, or -1
+        unsigned tick;          // Sampling random state
+        unsigned long long start;
+};
+
+static inline
+void profileEnter(struct profileState *state, int opcode)
+{
+        struct xProfileData *profile = state->profile;
+        if (profile == NULL) {
+                return;
+        }
+        profile->counts[opcode]++;
+        if (state->previous >= 0) {
+                profile->pairs[state->previous][opcode]++;
+        }
+        state->previous = opcode;
+#if xProfile >= 2
+        unsigned long long now = readCycles();
+        if (state->sampled >= 0) {
+                profile->cycles[state->sampled] += now - state->start;
+                profile->samples[state->sampled]++;
+                state->sampled = -1;
+        }
+        state->tick = state->tick * 1103515245 + 12345;
+        if (((state->tick >> 16) & (profileSampleRate - 1)) == 0) {
+                state->sampled = opcode;
+                state->start = readCycles();
+        }
+#endif
+}
+
+static
+void profileLeave(struct profileState *state)
+{
+#if xProfile >= 2
+        if (state->profile != NULL && state->sampled >= 0) {
+                state->profile->cycles[state->sampled] += readCycles() - state->start;
+                state->profile->samples[state->sampled]++;
+        }
+#endif
+}
+
+#endif
+
 /*
  *  Builtin function to jump to assembled code
+ *
+ *  Code with vmFlagVerified skips the checks of the operands and the
+ *  stack bounds, because xVerifyCode has proven them.
+ *
+ *  The frames live on the stack of struct xRap. A call to a Rap function
+ *  pushes a struct xReturn and continues in the callee, with the function
+ *  and its arguments as the first locals of the new frame. They are
+ *  already in place on the stack of the caller, so nothing is copied, and
+ *  the result ends up where the caller had the function. vmTailCall moves
+ *  them down to the start of the current frame instead, so that tail
+ *  recursion runs in constant space. Builtin functions get the stack
+ *  above the current frame.
+ *
+ *  With direct threading a negative argc requests the handler offsets
+ *  instead, because only this function knows the handler addresses. They
+ *  are written to `data' (see xThreadCode): first those for verified
+ *  code, then those for other code.
  */
 err_t xExecute(void *data, int argc, xValue_t argv[])
 {
         err_t err = OK;
 
+#if xDispatch != 0
+        static void * const labels[] = { // Verified code
+                label(vmInt),
+                label(vmSubtractInt),
+                label(vmMultiplyInt),
+                label(vmIncrementInt),
+                label(vmLessEqualInt),
+                label(vmSymbol),
+                label(vmCall),
+                label(vmTailCall),
+                label(vmReturn),
+                label(vmDrop),
+                label(vmJump),
+                label(vmJumpF),
+                label(vmJumpT),
+                label(vmGetLocal),
+                label(vmSetLocal),
+                label(vmCheckType),
+                label(vmLoopInt),
+                label(vmDouble),
+                label(vmAddDouble),
+                label(vmSubtractDouble),
+                label(vmMultiplyDouble),
+                label(vmDivideDouble),
+                label(vmMultiplyAddDouble),
+                label(vmMaxDouble),
+                label(vmMinDouble),
+                label(vmLessEqualDouble),
+                label(vmNegateDouble),
+                label(vmAbsDouble),
+                label(vmExpDouble),
+                label(vmLogDouble),
+                label(vmInverseDouble),
+                label(vmSqrtDouble),
+                label(vmSigmoidDouble),
+                label(vmRoundFloat),
+                label(vmIntToDouble),
+                label(vmDoubleToInt),
+                label(vmGetLocalIntLessEqualJumpT),
+                label(vmGetLocalIncrementSetLocal),
+                label(vmGetLocalMultiplyInt),
+                label(vmIntSubtractInt),
+                label(vmDropJump),
+                label(vmGetLocalIntSubtractSetLocalDrop),
+        };
+        static void * const checkedLabels[] = {
+                checkedLabel(vmInt),
+                label(vmSubtractInt),
+                label(vmMultiplyInt),
+                label(vmIncrementInt),
+                label(vmLessEqualInt),
+                checkedLabel(vmSymbol),
+                checkedLabel(vmCall),
+                checkedLabel(vmTailCall),
+                label(vmReturn),
+                label(vmDrop),
+                label(vmJump),
+                label(vmJumpF),
+                label(vmJumpT),
+                checkedLabel(vmGetLocal),
+                checkedLabel(vmSetLocal),
+                label(vmCheckType),
+                checkedLabel(vmLoopInt),
+                checkedLabel(vmDouble),
+                label(vmAddDouble),
+                label(vmSubtractDouble),
+                label(vmMultiplyDouble),
+                label(vmDivideDouble),
+                label(vmMultiplyAddDouble),
+                label(vmMaxDouble),
+                label(vmMinDouble),
+                label(vmLessEqualDouble),
+                label(vmNegateDouble),
+                label(vmAbsDouble),
+                label(vmExpDouble),
+                label(vmLogDouble),
+                label(vmInverseDouble),
+                label(vmSqrtDouble),
+                label(vmSigmoidDouble),
+                label(vmRoundFloat),
+                label(vmIntToDouble),
+                label(vmDoubleToInt),
+                checkedLabel(vmGetLocalIntLessEqualJumpT),
+                checkedLabel(vmGetLocalIncrementSetLocal),
+                checkedLabel(vmGetLocalMultiplyInt),
+                label(vmIntSubtractInt),
+                label(vmDropJump),
+                checkedLabel(vmGetLocalIntSubtractSetLocalDrop),
+        };
+#endif
+
         char *pc = data;
+#if xCountInstructions
+        unsigned long long instructions = 0;
+#endif
+#if xProfile
+        struct profileState profile = {
+                .profile = (xCurrentRap != NULL) ? xCurrentRap->profile : NULL,
+                .previous = -1,
+                .sampled = -1,
+        };
+#endif
 
-        int nrLocals = *(int *)pc;
-        pc += sizeof(int);
+#if xDispatch == 2
+        if (argc < 0) {
+                // Export the handler offsets relative to the first handler
+                int *offsets = data;
+                for (int i=0; i<vmNrInstructions; i++) {
+                        offsets[i] = (char *) labels[i] - (char *) __extension__ &&L_vmInt;
+                        offsets[vmNrInstructions + i] = (char *) checkedLabels[i] - (char *) __extension__ &&L_vmInt;
+                }
+                return OK; // Not `goto cleanup': there is no frame yet
+        }
+#endif
+
+#if xSampling
+        volatile struct xFrame frame = {
+                .code = data,
+                .pc = pc,
+                .caller = xCurrentFrame,
+        };
+        xCurrentFrame = &frame;
+#endif
+
+        struct xRap *rap = xCurrentRap;
+        xValue_t *stack = rap->stack.top;       // Restored when leaving
+        struct xReturn *returns = rap->stack.returnsTop;
+        struct xReturn *ret = returns;          // Pushed by calls from here
+        xValue_t *locals = stack;
+
+        const int *code = data;
+        int nrLocals = code[vmHeaderLocals];
+        bool verified = (code[vmHeaderFlags] & vmFlagVerified) != 0;
+        int argc2 = code[vmHeaderArguments];
+        pc += vmHeaderSize * sizeof(int);
 
-        xValue_t locals[nrLocals];
         xAssert(nrLocals > 0);
+        if (nrLocals > rap->stack.end - locals) {
+                xRaise("Stack overflow");
+        }
+#if xDispatch == 1
+        void * const *table = verified ? labels : checkedLabels;
+#elif xDispatch == 2
+        xAssert(code[vmHeaderFlags] & vmFlagThreaded);
+        (void) verified; // Chosen by xThreadCode
+#endif
 
         xValue_t *sp = &locals[0];
+        if (argc2 > 0) {
+                // A Rap function, see xCall
+                if (argc != argc2) {
+                        xRaise("Wrong number of arguments");
+                }
+                memcpy(locals, argv, argc * sizeof(xValue_t));
+                sp += argc;
+        }
 
         for (;;) {
-                switch (*(int *)pc) {
-                case vmInt:
+                dispatch {
+                checked(vmInt)
+                        xAssert(sp < &locals[nrLocals]);
+                unchecked(vmInt)
                         pc += sizeof(int);
                         *sp++ = xInt(*(int *)pc);
                         pc += sizeof(int);
-                        continue;
+                        next;
 
-                case vmSubtractInt:
+                op(vmSubtractInt)
                         pc += sizeof(int);
                         sp--;
                         sp[-1].Int -= sp[0].Int;
-                        continue;
+                        next;
 
-                case vmMultiplyInt:
+                op(vmMultiplyInt)
                         pc += sizeof(int);
                         sp--;
                         sp[-1].Int *= sp[0].Int;
-                        continue;
+                        next;
 
-                case vmIncrementInt:
+                op(vmIncrementInt)
                         pc += sizeof(int);
                         sp[-1].Int++;
-                        continue;
+                        next;
 
-                case vmLessEqualInt:
+                op(vmLessEqualInt)
                         pc += sizeof(int);
                         sp--;
-                        sp[-1].typeId = boolTypeIds[ (sp[-1].Int <= sp[0].Int) ];
-                        continue;
-
-                case vmFunctionSubtractInt:
-                        pc += sizeof(int);
-                        *sp++ = xFunction(xSubtractInt);
-                        continue;
+                        sp[-1] = xBool(sp[-1].Int <= sp[0].Int);
+                        next;
 
-                case vmFunctionPrintInt:
-                        pc += sizeof(int);
-                        *sp++ = xFunction(xPrintInt);
-                        continue;
+                checked(vmSymbol)
+                        xAssert(0 <= operand(1) && operand(1) < xCurrentRap->symbols.len);
+                        xAssert(sp < &locals[nrLocals]);
+                unchecked(vmSymbol)
+                        int index = ((int *)pc)[1];
+                        *sp++ = xCurrentRap->symbols.v[index].value;
+                        pc += 2 * sizeof(int);
+                        next;
 
-                case vmCall:
+                checked(vmCall)
+                        xAssert(1 <= operand(1) && operand(1) <= sp - &locals[0]);
+                unchecked(vmCall)
                         pc += sizeof(int);
-                        int argc2 = *(int *)pc;
+                        argc2 = *(int *)pc;
                         sp -= argc2;
                         pc += sizeof(int);
-                        xAssert(sp->typeId == xFunctionId);
-                        xFunction_t *fn = (xFunction_t *) sp->VoidFunction;
-                        err = fn(NULL, argc2, sp);
-                        check(err);
-                        sp++;
-                        continue;
+                        if (xIsFunction(*sp)) {
+                                rap->stack.top = &locals[nrLocals];
+                                rap->stack.returnsTop = ret;
+                                xFunction_t *fn = (xFunction_t *) xVoidFunction(*sp);
+                                err = fn(NULL, argc2, sp);
+                                check(err);
+                                sp++;
+                                next;
+                        }
+                        if (ret == rap->stack.returnsEnd) {
+                                xRaise("Stack overflow");
+                        }
+                        *ret++ = (struct xReturn) { .pc = pc, .locals = locals, .code = code };
+                        locals = sp;
+                enter:
+                        // The function and its arguments are in locals[0..argc2-1]
+                        if (!xIsRapFunction(locals[0])) {
+                                xRaise("Type error");
+                        }
+                        code = xRapCode(locals[0]);
+                        if (code[vmHeaderArguments] != argc2) {
+                                xRaise("Wrong number of arguments");
+                        }
+                        switchCode();
+                        if (nrLocals > rap->stack.end - locals) {
+                                xRaise("Stack overflow");
+                        }
+                        sp = &locals[argc2];
+                        pc = (char *) &code[vmHeaderSize];
+                        next;
 
-                case vmReturn:
-                        argv[0] = locals[0];
-                        goto cleanup;
+                checked(vmTailCall)
+                        xAssert(1 <= operand(1) && operand(1) <= sp - &locals[0]);
+                unchecked(vmTailCall)
+                        argc2 = operand(1);
+                        sp -= argc2;
+                        if (xIsFunction(*sp)) {
+                                rap->stack.top = &locals[nrLocals];
+                                rap->stack.returnsTop = ret;
+                                xFunction_t *fn = (xFunction_t *) xVoidFunction(*sp);
+                                err = fn(NULL, argc2, sp);
+                                check(err);
+                                locals[0] = *sp;
+                                goto leave;
+                        }
+                        memmove(locals, sp, argc2 * sizeof(xValue_t));
+                        goto enter;
 
-                case vmDrop:
+                op(vmReturn)
+                leave:
+                        if (ret == returns) {
+                                argv[0] = locals[0];
+                                goto cleanup;
+                        }
+                        // The result stays in locals[0], where the caller had the function
+                        sp = &locals[1];
+                        ret--;
+                        pc = (char *) ret->pc;
+                        locals = ret->locals;
+                        code = ret->code;
+                        switchCode();
+                        next;
+
+                op(vmDrop)
                         sp -= ((int *)pc)[1];
                         pc += 2 * sizeof(int);
-                        continue;
+                        next;
 
-                case vmJump:
+                op(vmJump)
                         pc += ((int *)pc)[1];
-                        continue;
+                        next;
 
-                case vmJumpF:
-                        if (sp[-1].typeId == xFalseId) {
+                op(vmJumpF)
+                        if (xIsFalse(sp[-1])) {
                                 pc += ((int *)pc)[1];
                         } else {
                                 pc += 2 * sizeof(int);
                         }
-                        continue;
+                        next;
 
-                case vmJumpT:
-                        if (sp[-1].typeId == xTrueId) {
+                op(vmJumpT)
+                        if (xIsTrue(sp[-1])) {
                                 pc += ((int *)pc)[1];
                         } else {
                                 pc += 2 * sizeof(int);
                         }
-                        continue;
+                        next;
 
-                case vmGetLocal:
-                        ;
+                checked(vmGetLocal)
+                        xAssert(operand(1) >= 0);
+                        xAssert(operand(1) < sp - &locals[0]);
+                        xAssert(sp < &locals[nrLocals]);
+                unchecked(vmGetLocal)
                         int offset = ((int *)pc)[1];
-                        xAssert(offset >= 0);
-                        xAssert(offset < sp - &locals[0]);
                         pc += 2 * sizeof(int);
                         *sp++ = locals[offset];
-                        continue;
+                        next;
 
-                case vmSetLocal:
+                checked(vmSetLocal)
+                        xAssert(operand(1) >= 0);
+                        xAssert(operand(1) < sp - &locals[0]);
+                unchecked(vmSetLocal)
                         offset = ((int *)pc)[1];
-                        xAssert(offset >= 0);
-                        xAssert(offset < sp - &locals[0]);
                         pc += 2 * sizeof(int);
                         locals[offset] = sp[-1];;
-                        continue;
+                        next;
+
+                op(vmCheckType)
+                        if (xTypeId(sp[-1 - ((int *)pc)[1]]) != (xTypeId_t) ((int *)pc)[2]) {
+                                xRaise("Type error");
+                        }
+                        pc += 3 * sizeof(int);
+                        next;
+
+                checked(vmLoopInt)
+                        xAssert(operand(1) >= 0);
+                        xAssert(operand(1) < sp - &locals[0]);
+                        xAssert(operand(2) >= 0);
+                        xAssert(operand(2) < sp - &locals[0]);
+                unchecked(vmLoopInt)
+                        offset = ((int *)pc)[1];
+                        if (++locals[offset].Int <= locals[((int *)pc)[2]].Int) {
+                                pc += ((int *)pc)[3];
+                        } else {
+                                pc += 4 * sizeof(int);
+                        }
+                        next;
+
+                checked(vmDouble)
+                        xAssert(sp < &locals[nrLocals]);
+                unchecked(vmDouble)
+                        double d;
+                        memcpy(&d, &((int *)pc)[1], sizeof(d));
+                        *sp++ = xDouble(d);
+                        pc += 3 * sizeof(int);
+                        next;
+
+                op(vmAddDouble)
+                        pc += sizeof(int);
+                        sp--;
+                        sp[-1].Double += sp[0].Double;
+                        next;
+
+                op(vmSubtractDouble)
+                        pc += sizeof(int);
+                        sp--;
+                        sp[-1].Double -= sp[0].Double;
+                        next;
+
+                op(vmMultiplyDouble)
+                        pc += sizeof(int);
+                        sp--;
+                        sp[-1].Double *= sp[0].Double;
+                        next;
+
+                op(vmDivideDouble)
+                        pc += sizeof(int);
+                        sp--;
+                        sp[-1].Double /= sp[0].Double;
+                        next;
+
+                op(vmMultiplyAddDouble)
+                        pc += sizeof(int);
+                        sp -= 2;
+                        sp[-1].Double = fma(sp[-1].Double, sp[0].Double, sp[1].Double);
+                        next;
+
+                op(vmMaxDouble)
+                        pc += sizeof(int);
+                        sp--;
+                        sp[-1].Double = fmax(sp[-1].Double, sp[0].Double);
+                        next;
+
+                op(vmMinDouble)
+                        pc += sizeof(int);
+                        sp--;
+                        sp[-1].Double = fmin(sp[-1].Double, sp[0].Double);
+                        next;
+
+                op(vmLessEqualDouble)
+                        pc += sizeof(int);
+                        sp--;
+                        sp[-1] = xBool(sp[-1].Double <= sp[0].Double);
+                        next;
+
+                op(vmNegateDouble)
+                        pc += sizeof(int);
+                        sp[-1].Double = -sp[-1].Double;
+                        next;
+
+                op(vmAbsDouble)
+                        pc += sizeof(int);
+                        sp[-1].Double = fabs(sp[-1].Double);
+                        next;
+
+                op(vmExpDouble)
+                        pc += sizeof(int);
+                        sp[-1].Double = exp(sp[-1].Double);
+                        next;
+
+                op(vmLogDouble)
+                        pc += sizeof(int);
+                        sp[-1].Double = log(sp[-1].Double);
+                        next;
+
+                op(vmInverseDouble)
+                        pc += sizeof(int);
+                        sp[-1].Double = 1.0 / sp[-1].Double;
+                        next;
+
+                op(vmSqrtDouble)
+                        pc += sizeof(int);
+                        sp[-1].Double = sqrt(sp[-1].Double);
+                        next;
+
+                op(vmSigmoidDouble)
+                        pc += sizeof(int);
+                        sp[-1].Double = 1.0 / (1.0 + exp(-sp[-1].Double));
+                        next;
 
+                op(vmRoundFloat)
+                        pc += sizeof(int);
+                        sp[-1].Double = (float) sp[-1].Double;
+                        next;
+
+                op(vmIntToDouble)
+                        pc += sizeof(int);
+                        sp[-1] = xDouble(sp[-1].Int);
+                        next;
+
+                op(vmDoubleToInt)
+                        pc += sizeof(int);
+                        if (!(sp[-1].Double > INT_MIN - 1.0 && sp[-1].Double < INT_MAX + 1.0)) {
+                                xRaise("Double out of int range");
+                        }
+                        sp[-1] = xInt((int) sp[-1].Double);
+                        next;
+
+                checked(vmGetLocalIntLessEqualJumpT)
+                        xAssert(operand(1) >= 0);
+                        xAssert(operand(1) < sp - &locals[0]);
+                        xAssert(sp < &locals[nrLocals]);
+                unchecked(vmGetLocalIntLessEqualJumpT)
+                        offset = ((int *)pc)[1];
+                        *sp = xBool(locals[offset].Int <= ((int *)pc)[2]);
+                        if (xIsTrue(*sp++)) {
+                                pc += ((int *)pc)[3];
+                        } else {
+                                pc += 4 * sizeof(int);
+                        }
+                        next;
+
+                checked(vmGetLocalIncrementSetLocal)
+                        xAssert(operand(1) >= 0);
+                        xAssert(operand(1) < sp - &locals[0]);
+                        xAssert(operand(2) >= 0);
+                        xAssert(operand(2) <= sp - &locals[0]);
+                        xAssert(sp < &locals[nrLocals]);
+                unchecked(vmGetLocalIncrementSetLocal)
+                        offset = ((int *)pc)[1];
+                        *sp = locals[offset];
+                        sp->Int++;
+                        offset = ((int *)pc)[2];
+                        locals[offset] = *sp++;
+                        pc += 3 * sizeof(int);
+                        next;
+
+                checked(vmGetLocalMultiplyInt)
+                        xAssert(operand(1) >= 0);
+                        xAssert(operand(1) < sp - &locals[0]);
+                unchecked(vmGetLocalMultiplyInt)
+                        offset = ((int *)pc)[1];
+                        sp[-1].Int *= locals[offset].Int;
+                        pc += 2 * sizeof(int);
+                        next;
+
+                op(vmIntSubtractInt)
+                        sp[-1].Int -= ((int *)pc)[1];
+                        pc += 2 * sizeof(int);
+                        next;
+
+                op(vmDropJump)
+                        sp -= ((int *)pc)[1];
+                        pc += ((int *)pc)[2];
+                        next;
+
+                checked(vmGetLocalIntSubtractSetLocalDrop)
+                        xAssert(operand(1) >= 0);
+                        xAssert(operand(1) < sp - &locals[0]);
+                        xAssert(operand(3) >= 0);
+                        xAssert(operand(3) <= sp - &locals[0]);
+                        xAssert(sp < &locals[nrLocals]);
+                unchecked(vmGetLocalIntSubtractSetLocalDrop)
+                        offset = ((int *)pc)[1];
+                        *sp = locals[offset];
+                        sp->Int -= ((int *)pc)[2];
+                        offset = ((int *)pc)[3];
+                        locals[offset] = *sp;
+                        sp += 1 - ((int *)pc)[4];
+                        pc += 5 * sizeof(int);
+                        next;
+
+#if xDispatch == 0
                 default:
                         xAssert(false);
+#endif
                 }
         }
 
+cleanup:
+        rap->stack.top = stack;
+        rap->stack.returnsTop = returns;
+#if xCountInstructions
+        xCurrentRap->instructions += instructions;
+#endif
+#if xProfile
+        profileLeave(&profile);
+#endif
+#if xSampling
+        xCurrentFrame = frame.caller;
+#endif
+        return err;
+}
+
+err_t xPushFrame(struct xRap *rap, int n, xValue_t **frame)
+{
+        err_t err = OK;
+
+        xAssert(n >= 0);
+        if (n > rap->stack.end - rap->stack.top) {
+                xRaise("Stack overflow");
+        }
+        *frame = rap->stack.top;
+        rap->stack.top += n;
+cleanup:
+        return err;
+}
+
+void xPopFrame(struct xRap *rap, xValue_t *frame)
+{
+        rap->stack.top = frame;
+}
+
+err_t xCall(int argc, xValue_t argv[])
+{
+        err_t err = OK;
+
+        xAssert(argc >= 1);
+        if (xIsFunction(argv[0])) {
+                xFunction_t *fn = (xFunction_t *) xVoidFunction(argv[0]);
+                err = fn(NULL, argc, argv);
+        } else if (xIsRapFunction(argv[0])) {
+                err = xExecute(xRapCode(argv[0]), argc, argv);
+        } else {
+                xRaise("Type error");
+        }
+cleanup:
+        return err;
+}
+
+/*
+ *  Prepare code for execution
+ */
+err_t xThreadCode(int *code, int len)
+{
+        err_t err = OK;
+
+        xAssert(len >= vmHeaderSize);
+#if xDispatch == 2
+        if ((code[vmHeaderFlags] & vmFlagThreaded) == 0) {
+                int offsets[2 * vmNrInstructions];
+                err = xExecute(offsets, -1, NULL);
+                check(err);
+
+                // Verified code enters the handlers after their checks
+                const int *handlers = (code[vmHeaderFlags] & vmFlagVerified) ?
+                        offsets : &offsets[vmNrInstructions];
+                for (int i=vmHeaderSize; i<len; ) {
+                        int opcode = code[i];
+                        xAssert(0 <= opcode && opcode < vmNrInstructions);
+                        code[i] = handlers[opcode];
+                        i += vmInstructions[opcode].length;
+                }
+                code[vmHeaderFlags] |= vmFlagThreaded;
+        }
+#endif
 cleanup:
         return err;
 }
 
+/*----------------------------------------------------------------------+
+ |      xPrintProfile                                                   |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Index of the largest nonzero count not yet printed, or -1
+ */
+static
+int largest(const unsigned long long *counts, int n, const bool *printed)
+{
+        int best = -1;
+        for (int i=0; i<n; i++) {
+                if (!printed[i] && counts[i] > 0 && (best < 0 || counts[i] > counts[best])) {
+                        best = i;
+                }
+        }
+        return best;
+}
+
+void xPrintProfile(FILE *fp, const struct xProfileData *profile)
+{
+        const int n = vmNrInstructions;
+        bool printed[vmNrInstructions * vmNrInstructions] = { false };
+
+        unsigned long long total = 0;
+        for (int i=0; i<n; i++) {
+                total += profile->counts[i];
+        }
+
+        fprintf(fp, "Instructions executed: %llu\n", total);
+        for (int i; (i = largest(profile->counts, n, printed)) >= 0; ) {
+                printed[i] = true;
+                fprintf(fp, "%12llu %5.1f%%", profile->counts[i], 100.0 * profile->counts[i] / total);
+#if xProfile >= 2
+                if (profile->samples[i] > 0) {
+                        fprintf(fp, " %7.1f cycles", (double) profile->cycles[i] / profile->samples[i]);
+                } else {
+                        fprintf(fp, " %14s", "");
+                }
+#endif
+                fprintf(fp, "  %s\n", vmInstructions[i].name);
+        }
+
+        const unsigned long long *pairs = &profile->pairs[0][0];
+        memset(printed, 0, sizeof(printed));
+
+        fprintf(fp, "Most frequent instruction pairs:\n");
+        for (int k=0; k<20; k++) {
+                int i = largest(pairs, n*n, printed);
+                if (i < 0) break;
+                printed[i] = true;
+                fprintf(fp, "%12llu %5.1f%%  %s, %s\n", pairs[i], 100.0 * pairs[i] / total,
+                        vmInstructions[i / n].name, vmInstructions[i % n].name);
+        }
+}
+
 /*----------------------------------------------------------------------+
  |                                                                      |
  +----------------------------------------------------------------------*/
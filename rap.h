@@ -13,17 +13,75 @@ typedef unsigned xTypeId_t;
 
 typedef void(xVoidFunction_t)(void);
 
+/*
+ *  Value representation, selectable at build time
+ *   0  compact: 8 bytes, the type is in the top 16 bits (NaN-boxing)
+ *   1  wide: a typeId followed by a union, 16 bytes on 64-bit platforms
+ *
+ *  Compact values are the bits of a quiet negative NaN with 0xfff9 + typeId
+ *  in the top 16 bits and the payload in the lower 48 bits. Ints live in the
+ *  low 32 bits, so arithmetic through `.Int' leaves the tag intact. Function,
+ *  code and array pointers must fit in 48 bits, as they do on current 64-bit
+ *  platforms.
+ *
+ *  Doubles are stored as themselves: all bit patterns below the first tag.
+ *  That includes the NaNs that the hardware and the C library produce, but
+ *  not every NaN, so doubles must never be built from arbitrary bits.
+ */
+#ifndef xWideValues
+ #define xWideValues 0
+#endif
+
+#if xWideValues
+
 struct xValue {
         xTypeId_t               typeId;
         union {
                 int             Int;
                 void            (*VoidFunction)(void);
+                int             *Code;
+                struct xArray   *Array;
+                double          Double;
         } u;
 };
 
 // Avoid need for C11 compiler
 #define Int          u.Int
 #define VoidFunction u.VoidFunction
+#define Code         u.Code
+#define Array        u.Array
+#define Double       u.Double
+
+#else
+
+struct xValue {
+        union {
+                unsigned long long bits;
+                struct {
+ #if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                        unsigned tag;
+                        int     Int;
+ #else
+                        int     Int;
+                        unsigned tag;
+ #endif
+                } s;
+                double  Double;
+        } u;
+};
+
+// Avoid need for C11 compiler
+#define Int          u.s.Int
+#define Double       u.Double
+
+#define xTagShift    48
+#define xTagBase     0xfff9
+#define xPayloadMask ((1ULL << xTagShift) - 1)
+
+#define xTag(typeId)\
+        ((unsigned long long) (xTagBase + (typeId)) << xTagShift)
+
+#endif
 
 typedef struct xValue xValue_t;
 
@@ -36,9 +94,23 @@ enum {
         xFalseId,
         xTrueId,
         xIntId,
-        xFunctionId // err_t (*fn)(*data, argc, argv[])
+        xFunctionId, // err_t (*fn)(*data, argc, argv[])
+        xRapFunctionId, // int *code, see xDefine
+        xArrayId,       // struct xArray *, see xNewArray
+        xDoubleId       // Unboxed, see xDouble
+};
+
+/*
+ *  Array of ints. The elements are aligned for the bulk kernels in
+ *  array.h. Arrays are values by reference: copies share the elements.
+ */
+struct xArray {
+        int *v;
+        int len;
 };
 
+#if xWideValues
+
 /*----------------------------------------------------------------------+
  |      Macros to construct basic values from C                         |
  +----------------------------------------------------------------------*/
@@ -49,6 +121,9 @@ enum {
 #define xTrue\
         ((xValue_t) { .typeId = xTrueId })
 
+#define xBool(b)\
+        ((xValue_t) { .typeId = (b) ? xTrueId : xFalseId })
+
 #define xInt(i)\
         ((xValue_t) {.typeId = xIntId, .Int = (i) })
 
@@ -57,21 +132,121 @@ enum {
                 .typeId = xFunctionId,\
                 .VoidFunction = (xVoidFunction_t*)(fn) })
 
+#define xRapFunction(code)\
+        ((xValue_t) {.typeId = xRapFunctionId, .Code = (code) })
+
+#define xArray(array)\
+        ((xValue_t) {.typeId = xArrayId, .Array = (array) })
+
+#define xDouble(d)\
+        ((xValue_t) {.typeId = xDoubleId, .Double = (d) })
+
+/*----------------------------------------------------------------------+
+ |      Macros to take basic values apart                               |
+ +----------------------------------------------------------------------*/
+
+#define xTypeId(v)\
+        ((v).typeId)
+
+#define xHasTypeId(v, typeId)\
+        (xTypeId(v) == (typeId))
+
+#define xIsDouble(v)\
+        xHasTypeId(v, xDoubleId)
+
+#define xVoidFunction(v)\
+        ((v).VoidFunction)
+
+#define xRapCode(v)\
+        ((v).Code)
+
+#define xArrayOf(v)\
+        ((v).Array)
+
+#else
+
+/*----------------------------------------------------------------------+
+ |      Macros to construct basic values from C                         |
+ +----------------------------------------------------------------------*/
+
+#define xNone\
+        ((xValue_t) { .u.bits = xTag(xNoneId) })
+
+#define xTrue\
+        ((xValue_t) { .u.bits = xTag(xTrueId) })
+
+#define xBool(b)\
+        ((xValue_t) { .u.bits = (b) ? xTag(xTrueId) : xTag(xFalseId) })
+
+#define xInt(i)\
+        ((xValue_t) { .u.bits = xTag(xIntId) | (unsigned) (i) })
+
+#define xFunction(fn)\
+        ((xValue_t) { .u.bits = xTag(xFunctionId) |\
+                ((unsigned long long) (size_t) (xVoidFunction_t*)(fn) & xPayloadMask) })
+
+#define xRapFunction(code)\
+        ((xValue_t) { .u.bits = xTag(xRapFunctionId) |\
+                ((unsigned long long) (size_t) (int*)(code) & xPayloadMask) })
+
+#define xArray(array)\
+        ((xValue_t) { .u.bits = xTag(xArrayId) |\
+                ((unsigned long long) (size_t) (struct xArray*)(array) & xPayloadMask) })
+
+#define xDouble(d)\
+        ((xValue_t) { .Double = (d) })
+
+/*----------------------------------------------------------------------+
+ |      Macros to take basic values apart                               |
+ +----------------------------------------------------------------------*/
+
+// Evaluates `v' twice
+#define xTypeId(v)\
+        ((xTypeId_t) ((v).u.bits < xTag(0) ? xDoubleId :\
+                ((v).u.bits >> xTagShift) - xTagBase))
+
+// For all types except xDoubleId
+#define xHasTypeId(v, typeId)\
+        (((v).u.bits >> xTagShift) == xTagBase + (typeId))
+
+#define xIsDouble(v)\
+        ((v).u.bits < xTag(0))
+
+#define xVoidFunction(v)\
+        ((xVoidFunction_t*) (size_t) ((v).u.bits & xPayloadMask))
+
+#define xRapCode(v)\
+        ((int*) (size_t) ((v).u.bits & xPayloadMask))
+
+#define xArrayOf(v)\
+        ((struct xArray*) (size_t) ((v).u.bits & xPayloadMask))
+
+#endif
+
 /*----------------------------------------------------------------------+
  |      Macros to test for basic C types                                |
  +----------------------------------------------------------------------*/
 
 #define xIsNone(v)\
-        ((v).typeId == xNoneId)
+        xHasTypeId(v, xNoneId)
 
 #define xIsTrue(v)\
-        ((v).typeId == xTrueId)
+        xHasTypeId(v, xTrueId)
+
+#define xIsFalse(v)\
+        xHasTypeId(v, xFalseId)
 
 #define xIsInt(v)\
-        ((v).typeId == xIntId)
+        xHasTypeId(v, xIntId)
 
 #define xIsFunction(v)\
-        ((v).typeId == xFunctionId)
+        xHasTypeId(v, xFunctionId)
+
+#define xIsRapFunction(v)\
+        xHasTypeId(v, xRapFunctionId)
+
+#define xIsArray(v)\
+        xHasTypeId(v, xArrayId)
 
 /*----------------------------------------------------------------------+
  |      Generic function type                                           |
@@ -93,8 +268,82 @@ typedef err_t(xFunction_t)(void *data, int argc, xValue_t argv[]);
  |      Global interpreter data                                         |
  +----------------------------------------------------------------------*/
 
+/*
+ *  Interned names. Code refers to them by their index in the symbol table.
+ */
+struct xSymbol {
+        char *name;             // Own copy, null terminated
+        int len;
+        unsigned hash;
+        xValue_t value;         // xNone until registered
+        unsigned flags;         // See xRegister
+};
+
+/*
+ *  Where a call from Rap code to Rap code returns to
+ */
+struct xReturn {
+        const char *pc;
+        xValue_t *locals;
+        const int *code;
+};
+
+/*
+ *  A function as it was defined, before xThreadCode. See xRap.defined.
+ */
+struct xDefinition {
+        int symbol;             // Index in the symbol table
+        int *code;              // Malloc'ed copy, owned by the host
+        int len;
+};
+
+typedef List(struct xDefinition) xDefinitionList;
+
+#define xStackSize      (1 << 20)       // Values, for all frames
+#define xMaxCallDepth   (1 << 14)       // Nested calls of Rap functions
+
+/*
+ *  The stack of the virtual machines. Each struct xRap has one, so each
+ *  thread does, and all executions reuse it. Frames go on top of the
+ *  frames of their callers, up to `end'. The values are mapped between
+ *  two guard pages, so that code that gets past the checks faults
+ *  instead of overwriting other memory. Pages are only committed when
+ *  they are used.
+ */
+struct xStack {
+        xValue_t *base;
+        xValue_t *top;          // First free value
+        xValue_t *end;
+        struct xReturn *returns; // Idem for the calls between Rap functions
+        struct xReturn *returnsTop;
+        struct xReturn *returnsEnd;
+        void *map;              // Including the guard pages, or NULL
+        size_t mapSize;
+};
+
 struct xRap {
-        int dummy;
+        unsigned optimize;      // Enabled assembler optimizations
+        int *sequences;         // Histogram of opcode pairs and triples, or NULL
+        List(struct xSymbol) symbols;
+        int *symbolSlots;       // Open addressing hash table: symbol index + 1, or 0
+        int symbolMask;         // Number of slots - 1
+        unsigned long long instructions; // Executed by xExecute, see xCountInstructions
+        struct xProfileData *profile; // Filled by xExecute when not NULL, see xProfile
+        FILE *out;              // For output by Rap code, stdout by default
+        struct xArena arena;    // Scratch memory of the assembler
+        List(int *) functions;  // Code of the Rap functions, see xDefine
+        xDefinitionList *defined; // Or NULL, see xDefine
+        List(struct xArray *) arrays; // See xNewArray
+        const struct xArrayKernels *kernels; // For the array functions, see array.h
+        struct xStack stack;
+};
+
+enum {
+        xOptimizeSuperinstructions = 1,
+        xOptimizeConstants = 2,
+        xOptimizeLoops = 4,
+        xOptimizeTypes = 8,
+        xOptimizeAll = ~0
 };
 
 /*
@@ -102,6 +351,74 @@ struct xRap {
  */
 err_t xInit(struct xRap *rap);
 
+void xFree(struct xRap *rap);
+
+/*
+ *  The interpreter of the calling thread: the last one passed to xInit.
+ *  The virtual machines find the symbol values through this.
+ */
+extern __thread struct xRap *xCurrentRap;
+
+/*
+ *  Find the symbol index of a name, adding it when needed
+ */
+err_t xIntern(struct xRap *rap, const char *name, int len, int *index);
+
+/*
+ *  Find the symbol index of a name, or -1
+ */
+int xLookup(const struct xRap *rap, const char *name, int len);
+
+/*
+ *  Make a builtin function available to Rap code under `name'. A pure
+ *  function depends on nothing but its arguments and has no side effects,
+ *  so the assembler may call it at compile time.
+ */
+enum {
+        xPure = 1
+};
+
+err_t xRegister(struct xRap *rap, const char *name, xFunction_t *fn, unsigned flags);
+
+/*
+ *  Make assembled code a Rap function under the symbol `index'. When this
+ *  succeeds the function takes over the code, which must be malloc'ed.
+ *  Builtin functions can't be redefined. When rap->defined isn't NULL, a
+ *  copy of the code is also added there, for hosts that bind the same
+ *  function in other interpreters.
+ */
+err_t xDefine(struct xRap *rap, int index, int *code, int len);
+
+/*
+ *  Make an array of `len' elements, with undefined values. Rap has no
+ *  garbage collection, so arrays are kept until xFreeArrays or xFree.
+ *  Code that loops should reuse its arrays, as the bulk functions allow
+ *  by writing into a given array.
+ */
+err_t xNewArray(struct xRap *rap, int len, struct xArray **array);
+
+/*
+ *  Free the arrays made after the first `keep'. Values can't hold on to
+ *  an array beyond the program that made it, so hosts call this when a
+ *  program has finished, with the count from before it started.
+ */
+void xFreeArrays(struct xRap *rap, int keep);
+
+/*
+ *  Take a frame of `n' values from the top of the stack, or raise "Stack
+ *  overflow" when it doesn't fit. Frames are given back in reverse order.
+ */
+err_t xPushFrame(struct xRap *rap, int n, xValue_t **frame);
+
+void xPopFrame(struct xRap *rap, xValue_t *frame);
+
+/*
+ *  Call a builtin or Rap function with the calling conventions of
+ *  xFunction_t. argv[0] is the function. For the other engines, because
+ *  xExecute calls Rap functions without recursion.
+ */
+err_t xCall(int argc, xValue_t argv[]);
+
 /*----------------------------------------------------------------------+
  |      The virtual machine                                             |
  +----------------------------------------------------------------------*/
@@ -112,9 +429,9 @@ enum {
         vmMultiplyInt,
         vmIncrementInt,
         vmLessEqualInt,
-        vmFunctionSubtractInt,
-        vmFunctionPrintInt,
+        vmSymbol,
         vmCall,
+        vmTailCall,             // Operand: argc, like vmCall, then returns
         vmReturn,
         vmDrop,
         vmJump,
@@ -122,13 +439,140 @@ enum {
         vmJumpT,
         vmGetLocal,
         vmSetLocal,
+        vmCheckType,            // Operands: depth below the top, typeId
+        vmLoopInt,              // Operands: counter, limit, offset. Increments
+                                // the counter local, jumps while <= limit local
+        vmDouble,               // Operands: the two halves of the double, as
+                                // they are in memory
+        vmAddDouble,
+        vmSubtractDouble,
+        vmMultiplyDouble,
+        vmDivideDouble,
+        vmMultiplyAddDouble,    // a * b + c, rounded once
+        vmMaxDouble,
+        vmMinDouble,
+        vmLessEqualDouble,
+        vmNegateDouble,
+        vmAbsDouble,
+        vmExpDouble,
+        vmLogDouble,
+        vmInverseDouble,
+        vmSqrtDouble,
+        vmSigmoidDouble,
+        vmRoundFloat,           // To single precision, and back
+        vmIntToDouble,
+        vmDoubleToInt,          // Truncates, raises when out of range
+
+        // Superinstructions, see superinstructions[] in assemble.c
+        vmGetLocalIntLessEqualJumpT,
+        vmGetLocalIncrementSetLocal,
+        vmGetLocalMultiplyInt,
+        vmIntSubtractInt,
+        vmDropJump,
+        vmGetLocalIntSubtractSetLocalDrop,
+
+        vmNrInstructions
+};
+
+/*
+ *  Code starts with a header, followed by the instructions
+ */
+enum {
+        vmHeaderLocals,         // Number of stack slots needed
+        vmHeaderFlags,
+        vmHeaderArguments,      // Slots filled by the caller: the function and
+                                // its arguments, or 0 for a program
+        vmHeaderSize
+};
+
+enum {
+        vmFlagThreaded = 1,     // Opcodes are translated by xThreadCode
+        vmFlagVerified = 2,     // Passed xVerifyCode, see verify.h
+};
+
+/*
+ *  Static properties of the instructions
+ */
+struct vmInstruction {
+        const char *name;
+        int length;             // In words, including the opcode
+        int jump;               // Index of the relative jump operand, or 0
 };
 
+extern const struct vmInstruction vmInstructions[];
+
+/*
+ *  Dispatch method of xExecute, selectable at build time
+ *   0  switch statement (portable)
+ *   1  token threading: computed goto through a label table (GCC)
+ *   2  direct threading: computed goto to the address in the code (GCC)
+ */
+#ifndef xDispatch
+ #define xDispatch 0
+#endif
+
+/*
+ *  Count the instructions executed by xExecute in struct xRap. For
+ *  benchmarks, it costs an increment per instruction.
+ */
+#ifndef xCountInstructions
+ #define xCountInstructions 0
+#endif
+
+/*
+ *  Instrumentation of xExecute, selectable at build time
+ *   0  none
+ *   1  count the executions of each instruction and instruction pair
+ *   2  also sample the cycles spent in the handlers (x86 only)
+ *  Counting happens in struct xRap when it has a struct xProfileData.
+ */
+#ifndef xProfile
+ #define xProfile 0
+#endif
+
+struct xProfileData {
+        unsigned long long counts[vmNrInstructions];
+        unsigned long long pairs[vmNrInstructions][vmNrInstructions]; // [first][second]
+        unsigned long long cycles[vmNrInstructions]; // Of the sampled executions
+        unsigned long long samples[vmNrInstructions];
+};
+
+/*
+ *  Print the instructions and pairs by frequency
+ */
+void xPrintProfile(FILE *fp, const struct xProfileData *profile);
+
+/*
+ *  Let xExecute publish where it is for a sampling profiler, see
+ *  sampler.h. This costs a store per instruction.
+ */
+#ifndef xSampling
+ #define xSampling 0
+#endif
+
+/*
+ *  An active xExecute. The fields are volatile because signal handlers
+ *  read them.
+ */
+struct xFrame {
+        const int *code;
+        const char *pc;         // Current instruction
+        volatile struct xFrame *caller;
+};
+
+extern __thread volatile struct xFrame *volatile xCurrentFrame;
+
 /*
  *  Builtin function to jump to assembled code
  */
 xFunction_t xExecute;
 
+/*
+ *  Prepare code for execution. With direct threading this replaces the
+ *  opcodes by handler addresses. Otherwise it does nothing.
+ */
+err_t xThreadCode(int *code, int len);
+
 /*----------------------------------------------------------------------+
  |                                                                      |
  +----------------------------------------------------------------------*/
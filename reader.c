@@ -0,0 +1,165 @@
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ |      reader.c -- splitting input into programs                       |
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
+#define _POSIX_C_SOURCE 200809L // For mmap and friends
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cplus.h"
+
+#include "reader.h"
+
+#define blockSize (1 << 20)
+
+/*----------------------------------------------------------------------+
+ |      xOpenReader                                                     |
+ +----------------------------------------------------------------------*/
+
+err_t xOpenReader(struct xReader *reader, int fd)
+{
+        err_t err = OK;
+
+        *reader = (struct xReader) {
+                .fd = fd,
+                .data = NULL,
+                .map = NULL,
+                .buffer = emptyList,
+        };
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+                xRaise("Cannot stat input");
+        }
+
+        if (S_ISREG(st.st_mode)) {
+                reader->eof = true;
+                if (st.st_size > 0) {
+                        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                        if (map == MAP_FAILED) {
+                                xRaise("Cannot map input");
+                        }
+                        (void) posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+                        reader->map = map;
+                        reader->data = map;
+                        reader->len = st.st_size;
+                }
+        }
+cleanup:
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      xReadProgram                                                    |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Drop the programs handed out and read the next block
+ */
+static
+err_t fill(struct xReader *reader)
+{
+        err_t err = OK;
+        charList *buffer = &reader->buffer;
+
+        size_t keep = reader->len - reader->start;
+        if (keep > 0 && reader->start > 0) {
+                memmove(buffer->v, &buffer->v[reader->start], keep);
+        }
+        reader->scan -= reader->start;
+        reader->start = 0;
+        buffer->len = keep;
+
+        if (keep + blockSize > (size_t) 0x7fffffff) {
+                xRaise("Program too long");
+        }
+        void *v = buffer->v;
+        err = list_ensure_len(&v, &buffer->maxLen, buffer->len + blockSize, 1, blockSize);
+        check(err);
+        buffer->v = v;
+
+        ssize_t n = read(reader->fd, &buffer->v[buffer->len], blockSize);
+        if (n < 0) {
+                xRaise("Read error on input");
+        }
+        if (n == 0) {
+                reader->eof = true;
+        }
+        buffer->len += n;
+
+        reader->data = buffer->v;
+        reader->len = buffer->len;
+cleanup:
+        return err;
+}
+
+err_t xReadProgram(struct xReader *reader, const char **program, size_t *len)
+{
+        err_t err = OK;
+
+        *program = NULL;
+        *len = 0;
+
+        for (;;) {
+                const char *data = reader->data;
+                size_t scan = reader->scan;
+                int depth = reader->depth;
+
+                while (scan < reader->len) {
+                        char c = data[scan++];
+                        if (c == '(') {
+                                depth++;
+                        } else if (c == ')') {
+                                depth--;
+                        } else if (c == '\n' && depth <= 0) {
+                                *program = &data[reader->start];
+                                *len = scan - reader->start;
+                                reader->start = reader->scan = scan;
+                                reader->depth = 0;
+                                goto cleanup;
+                        }
+                }
+                reader->scan = scan;
+                reader->depth = depth;
+
+                if (reader->eof) {
+                        if (reader->start < reader->len) {
+                                xRaise("Incomplete program at end of input");
+                        }
+                        goto cleanup;
+                }
+
+                err = fill(reader);
+                check(err);
+        }
+
+cleanup:
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      xCloseReader                                                    |
+ +----------------------------------------------------------------------*/
+
+void xCloseReader(struct xReader *reader)
+{
+        if (reader->map != NULL) {
+                (void) munmap(reader->map, reader->len);
+        }
+        freeList(reader->buffer);
+        *reader = (struct xReader) { .map = NULL, .buffer = emptyList };
+}
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
@@ -0,0 +1,48 @@
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ |      reader.h -- splitting input into programs                       |
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  A program is the text up to and including a newline outside of any
+ *  parentheses, so it may span lines. Regular files are mapped as a
+ *  whole. Other input is read in large blocks into a buffer that only
+ *  keeps the program being read. Either way, programs are handed out in
+ *  place, without copying.
+ */
+struct xReader {
+        int fd;
+        const char *data;       // Mapped file, or buffer.v
+        size_t len;             // Available in data
+        size_t start;           // Of the next program
+        size_t scan;            // End of the part already searched
+        int depth;              // Of parentheses at `scan'
+        bool eof;               // Nothing more to read
+        void *map;              // Or NULL
+        charList buffer;
+};
+
+/*----------------------------------------------------------------------+
+ |      Functions                                                       |
+ +----------------------------------------------------------------------*/
+
+err_t xOpenReader(struct xReader *reader, int fd);
+
+/*
+ *  Give the next program, or NULL at the end of the input. It stays valid
+ *  until the next call. `len' includes the final newline. Use
+ *  `.end = program + len' for the tokenizer.
+ */
+err_t xReadProgram(struct xReader *reader, const char **program, size_t *len);
+
+/*
+ *  Unmap or free the input. Doesn't close `fd'.
+ */
+void xCloseReader(struct xReader *reader);
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
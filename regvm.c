@@ -0,0 +1,663 @@
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ |      regvm.c -- register based virtual machine                       |
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cplus.h"
+#include "rap.h"
+
+#include "regvm.h"
+
+/*----------------------------------------------------------------------+
+ |      Data                                                            |
+ +----------------------------------------------------------------------*/
+
+const struct vmInstruction regInstructions[] = {
+        [regInt]                        = { "regInt",                   3 },
+        [regMove]                       = { "regMove",                  3 },
+        [regSubtractInt]                = { "regSubtractInt",           4 },
+        [regMultiplyInt]                = { "regMultiplyInt",           4 },
+        [regIncrementInt]               = { "regIncrementInt",          3 },
+        [regLessEqualInt]               = { "regLessEqualInt",          4 },
+        [regSymbol]                     = { "regSymbol",                3 },
+        [regCall]                       = { "regCall",                  3 },
+        [regReturn]                     = { "regReturn",                2 },
+        [regJump]                       = { "regJump",                  2, 1 },
+        [regJumpF]                      = { "regJumpF",                 3, 2 },
+        [regJumpT]                      = { "regJumpT",                 3, 2 },
+        [regCheckType]                  = { "regCheckType",             3 },
+        [regLoopInt]                    = { "regLoopInt",               4, 3 },
+        [regDouble]                     = { "regDouble",                4 },
+        [regAddDouble]                  = { "regAddDouble",             4 },
+        [regSubtractDouble]             = { "regSubtractDouble",        4 },
+        [regMultiplyDouble]             = { "regMultiplyDouble",        4 },
+        [regDivideDouble]               = { "regDivideDouble",          4 },
+        [regMultiplyAddDouble]          = { "regMultiplyAddDouble",     5 },
+        [regMaxDouble]                  = { "regMaxDouble",             4 },
+        [regMinDouble]                  = { "regMinDouble",             4 },
+        [regLessEqualDouble]            = { "regLessEqualDouble",       4 },
+        [regNegateDouble]               = { "regNegateDouble",          3 },
+        [regAbsDouble]                  = { "regAbsDouble",             3 },
+        [regExpDouble]                  = { "regExpDouble",             3 },
+        [regLogDouble]                  = { "regLogDouble",             3 },
+        [regInverseDouble]              = { "regInverseDouble",         3 },
+        [regSqrtDouble]                 = { "regSqrtDouble",            3 },
+        [regSigmoidDouble]              = { "regSigmoidDouble",         3 },
+        [regRoundFloat]                 = { "regRoundFloat",            3 },
+        [regIntToDouble]                = { "regIntToDouble",           3 },
+        [regDoubleToInt]                = { "regDoubleToInt",           3 },
+};
+
+/*----------------------------------------------------------------------+
+ |      Translation                                                     |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  The translator runs the stack machine symbolically. Each stack slot
+ *  is bound to the register that holds its value: its own register, the
+ *  register of a local it was loaded from, or a constant. Values move
+ *  into their own register only when needed: for calls, before the
+ *  register they refer to is overwritten, and at basic block boundaries,
+ *  where all slots are in their own register.
+ */
+
+struct translate {
+        int *loc;               // Register holding the value of each slot
+        int sp;
+        int nrSlots;
+        intList constants;
+        intList code;
+};
+
+static
+err_t constantRegister(struct translate *t, int value, int *reg)
+{
+        err_t err = OK;
+
+        int i;
+        for (i=0; i<t->constants.len && t->constants.v[i]!=value; i++)
+                ;
+        if (i == t->constants.len) {
+                listPush(t->constants, value);
+        }
+        *reg = t->nrSlots + i;
+cleanup:
+        return err;
+}
+
+/*
+ *  Copy register `from' into slot `to'. A constant is stored as an
+ *  immediate, so the copy doesn't have to read the register file.
+ */
+static
+err_t move(struct translate *t, int to, int from)
+{
+        err_t err = OK;
+
+        if (from >= t->nrSlots) {
+                listPush(t->code, regInt);
+                listPush(t->code, to);
+                listPush(t->code, t->constants.v[from - t->nrSlots]);
+        } else {
+                listPush(t->code, regMove);
+                listPush(t->code, to);
+                listPush(t->code, from);
+        }
+        t->loc[to] = to;
+cleanup:
+        return err;
+}
+
+static
+err_t materialize(struct translate *t, int slot)
+{
+        err_t err = OK;
+
+        if (t->loc[slot] != slot) {
+                err = move(t, slot, t->loc[slot]);
+                check(err);
+        }
+cleanup:
+        return err;
+}
+
+static
+err_t materializeAll(struct translate *t)
+{
+        err_t err = OK;
+
+        for (int i=0; i<t->sp; i++) {
+                err = materialize(t, i);
+                check(err);
+        }
+cleanup:
+        return err;
+}
+
+err_t xTranslateRegisters(const int *code, int len, intList *out)
+{
+        err_t err = OK;
+
+        struct translate t = {
+                .loc = NULL,
+                .sp = 0,
+                .nrSlots = code[vmHeaderLocals],
+                .constants = emptyList,
+                .code = emptyList,
+        };
+
+        int *depth = malloc((len + 1) * sizeof(int));   // At jump targets, or -1
+        int *newPc = malloc((len + 1) * sizeof(int));
+        intList jumps = emptyList;                      // Register pcs of jumps
+
+        t.loc = malloc((t.nrSlots + 1) * sizeof(int));
+        if (depth == NULL || newPc == NULL || t.loc == NULL) {
+                xRaise("Out of memory");
+        }
+        xAssert(code[vmHeaderArguments] == 0); // Programs only
+
+        for (int pc=0; pc<=len; pc++) {
+                depth[pc] = -1;
+        }
+        for (int pc=vmHeaderSize; pc<len; pc+=vmInstructions[code[pc]].length) {
+                xAssert(0 <= code[pc] && code[pc] < vmNrInstructions);
+                int jump = vmInstructions[code[pc]].jump;
+                if (jump > 0) {
+                        int target = pc + code[pc+jump] / (int)sizeof(int);
+                        xAssert(vmHeaderSize <= target && target <= len);
+                        depth[target] = -2; // Depth still unknown
+                }
+        }
+
+        bool reachable = true;
+
+        for (int pc=vmHeaderSize; pc<len; pc+=vmInstructions[code[pc]].length) {
+                if (depth[pc] != -1) {
+                        // Basic block boundary
+                        if (reachable) {
+                                err = materializeAll(&t);
+                                check(err);
+                                xAssert(depth[pc] == -2 || depth[pc] == t.sp);
+                        } else {
+                                xAssert(depth[pc] >= 0);
+                                t.sp = depth[pc];
+                                for (int i=0; i<t.sp; i++) {
+                                        t.loc[i] = i;
+                                }
+                                reachable = true;
+                        }
+                        depth[pc] = t.sp;
+                }
+
+                newPc[pc] = t.code.len;
+
+                if (!reachable) {
+                        continue;
+                }
+
+                const int *ip = &code[pc];
+                int sp = t.sp;
+                int reg;
+
+                switch (ip[0]) {
+                case vmInt:
+                        xAssert(sp < t.nrSlots);
+                        err = constantRegister(&t, ip[1], &reg);
+                        check(err);
+                        t.loc[t.sp++] = reg;
+                        break;
+
+                case vmSubtractInt:
+                case vmMultiplyInt:
+                case vmLessEqualInt:
+                        xAssert(sp >= 2);
+                        listPush(t.code, (ip[0] == vmSubtractInt) ? regSubtractInt :
+                                         (ip[0] == vmMultiplyInt) ? regMultiplyInt :
+                                                                    regLessEqualInt);
+                        listPush(t.code, sp - 2);
+                        listPush(t.code, t.loc[sp - 2]);
+                        listPush(t.code, t.loc[sp - 1]);
+                        t.loc[sp - 2] = sp - 2;
+                        t.sp--;
+                        break;
+
+                case vmIncrementInt:
+                        xAssert(sp >= 1);
+                        listPush(t.code, regIncrementInt);
+                        listPush(t.code, sp - 1);
+                        listPush(t.code, t.loc[sp - 1]);
+                        t.loc[sp - 1] = sp - 1;
+                        break;
+
+                case vmSymbol:
+                        xAssert(sp < t.nrSlots);
+                        listPush(t.code, regSymbol);
+                        listPush(t.code, sp);
+                        listPush(t.code, ip[1]);
+                        t.loc[t.sp++] = sp;
+                        break;
+
+                case vmCall:
+                        xAssert(1 <= ip[1] && ip[1] <= sp);
+                        for (int i=sp-ip[1]; i<sp; i++) {
+                                err = materialize(&t, i);
+                                check(err);
+                        }
+                        listPush(t.code, regCall);
+                        listPush(t.code, sp - ip[1]);
+                        listPush(t.code, ip[1]);
+                        t.sp -= ip[1] - 1;
+                        break;
+
+                case vmReturn:
+                        xAssert(sp >= 1);
+                        listPush(t.code, regReturn);
+                        listPush(t.code, t.loc[0]);
+                        reachable = false;
+                        break;
+
+                case vmDrop:
+                        xAssert(0 <= ip[1] && ip[1] <= sp);
+                        t.sp -= ip[1];
+                        break;
+
+                case vmJump:
+                case vmJumpF:
+                case vmJumpT:
+                        xAssert(ip[0] == vmJump || sp >= 1);
+                        err = materializeAll(&t);
+                        check(err);
+
+                        int target = pc + ip[1] / (int)sizeof(int);
+                        xAssert(depth[target] < 0 || depth[target] == sp);
+                        depth[target] = sp;
+
+                        listPush(jumps, t.code.len);
+                        if (ip[0] == vmJump) {
+                                listPush(t.code, regJump);
+                                reachable = false;
+                        } else {
+                                listPush(t.code, (ip[0] == vmJumpT) ? regJumpT : regJumpF);
+                                listPush(t.code, sp - 1);
+                        }
+                        listPush(t.code, target); // Relocated below
+                        break;
+
+                case vmLoopInt:
+                        xAssert(0 <= ip[1] && ip[1] < sp);
+                        xAssert(0 <= ip[2] && ip[2] < sp);
+                        err = materializeAll(&t);
+                        check(err);
+
+                        target = pc + ip[3] / (int)sizeof(int);
+                        xAssert(depth[target] < 0 || depth[target] == sp);
+                        depth[target] = sp;
+
+                        listPush(jumps, t.code.len);
+                        listPush(t.code, regLoopInt);
+                        listPush(t.code, ip[1]);
+                        listPush(t.code, ip[2]);
+                        listPush(t.code, target); // Relocated below
+                        break;
+
+                case vmGetLocal:
+                        xAssert(0 <= ip[1] && ip[1] < sp);
+                        xAssert(sp < t.nrSlots);
+                        t.loc[t.sp++] = t.loc[ip[1]];
+                        break;
+
+                case vmSetLocal:
+                        xAssert(0 <= ip[1] && ip[1] < sp);
+                        for (int i=0; i<sp; i++) {
+                                if (i != ip[1] && t.loc[i] == ip[1]) {
+                                        err = materialize(&t, i);
+                                        check(err);
+                                }
+                        }
+                        if (ip[1] == sp - 1) {
+                                err = materialize(&t, ip[1]);
+                                check(err);
+                        } else if (t.loc[sp - 1] != ip[1]) {
+                                err = move(&t, ip[1], t.loc[sp - 1]);
+                                check(err);
+                        }
+                        break;
+
+                case vmCheckType:
+                        xAssert(0 <= ip[1] && ip[1] < sp);
+                        listPush(t.code, regCheckType);
+                        listPush(t.code, t.loc[sp - 1 - ip[1]]);
+                        listPush(t.code, ip[2]);
+                        break;
+
+                case vmDouble:
+                        xAssert(sp < t.nrSlots);
+                        listPush(t.code, regDouble);
+                        listPush(t.code, sp);
+                        listPush(t.code, ip[1]);
+                        listPush(t.code, ip[2]);
+                        t.loc[t.sp++] = sp;
+                        break;
+
+                case vmMultiplyAddDouble:
+                        xAssert(sp >= 3);
+                        listPush(t.code, regMultiplyAddDouble);
+                        listPush(t.code, sp - 3);
+                        listPush(t.code, t.loc[sp - 3]);
+                        listPush(t.code, t.loc[sp - 2]);
+                        listPush(t.code, t.loc[sp - 1]);
+                        t.loc[sp - 3] = sp - 3;
+                        t.sp -= 2;
+                        break;
+
+                case vmAddDouble:
+                case vmSubtractDouble:
+                case vmMultiplyDouble:
+                case vmDivideDouble:
+                case vmMaxDouble:
+                case vmMinDouble:
+                case vmLessEqualDouble:
+                        xAssert(sp >= 2);
+                        listPush(t.code, regAddDouble + (ip[0] - vmAddDouble));
+                        listPush(t.code, sp - 2);
+                        listPush(t.code, t.loc[sp - 2]);
+                        listPush(t.code, t.loc[sp - 1]);
+                        t.loc[sp - 2] = sp - 2;
+                        t.sp--;
+                        break;
+
+                case vmNegateDouble:
+                case vmAbsDouble:
+                case vmExpDouble:
+                case vmLogDouble:
+                case vmInverseDouble:
+                case vmSqrtDouble:
+                case vmSigmoidDouble:
+                case vmRoundFloat:
+                case vmIntToDouble:
+                case vmDoubleToInt:
+                        xAssert(sp >= 1);
+                        listPush(t.code, regAddDouble + (ip[0] - vmAddDouble));
+                        listPush(t.code, sp - 1);
+                        listPush(t.code, t.loc[sp - 1]);
+                        t.loc[sp - 1] = sp - 1;
+                        break;
+
+                default:
+                        xRaise("Instruction not supported by register VM");
+                }
+        }
+        newPc[len] = t.code.len;
+
+        // Relocate jumps to byte offsets
+        for (int i=0; i<jumps.len; i++) {
+                int pc = jumps.v[i];
+                int jump = regInstructions[t.code.v[pc]].jump;
+                t.code.v[pc+jump] = (newPc[t.code.v[pc+jump]] - pc) * sizeof(int);
+        }
+
+        // Header, constants, instructions
+        out->len = 0;
+        listPush(*out, t.nrSlots + t.constants.len);
+        listPush(*out, 0);
+        listPush(*out, t.constants.len);
+        for (int i=0; i<t.constants.len; i++) {
+                listPush(*out, t.constants.v[i]);
+        }
+        for (int i=0; i<t.code.len; i++) {
+                listPush(*out, t.code.v[i]);
+        }
+
+cleanup:
+        freeList(jumps);
+        freeList(t.code);
+        freeList(t.constants);
+        free(t.loc);
+        free(newPc);
+        free(depth);
+
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      The register machine                                            |
+ +----------------------------------------------------------------------*/
+
+#define operand(i) (((int *)pc)[i])
+#define reg(i) r[operand(i)]
+
+/*
+ *  Builtin function to jump to register code
+ */
+err_t xExecuteRegisters(void *data, int argc, xValue_t argv[])
+{
+        err_t err = OK;
+
+        int *code = data;
+        int nrRegisters = code[regHeaderRegisters];
+        int nrConstants = code[regHeaderConstants];
+        int nrSlots = nrRegisters - nrConstants;
+
+        xValue_t *r = NULL;
+        xAssert(nrSlots > 0);
+        err = xPushFrame(xCurrentRap, nrRegisters, &r);
+        check(err);
+
+        for (int i=0; i<nrConstants; i++) {
+                r[nrSlots + i] = xInt(code[regHeaderSize + i]);
+        }
+
+        char *pc = (char *) &code[regHeaderSize + nrConstants];
+
+        for (;;) {
+                switch (operand(0)) {
+                case regInt:
+                        reg(1) = xInt(operand(2));
+                        pc += 3 * sizeof(int);
+                        continue;
+
+                case regMove:
+                        reg(1) = reg(2);
+                        pc += 3 * sizeof(int);
+                        continue;
+
+                case regSubtractInt:
+                        reg(1) = xInt(reg(2).Int - reg(3).Int);
+                        pc += 4 * sizeof(int);
+                        continue;
+
+                case regMultiplyInt:
+                        reg(1) = xInt(reg(2).Int * reg(3).Int);
+                        pc += 4 * sizeof(int);
+                        continue;
+
+                case regIncrementInt:
+                        reg(1) = xInt(reg(2).Int + 1);
+                        pc += 3 * sizeof(int);
+                        continue;
+
+                case regLessEqualInt:
+                        reg(1) = xBool(reg(2).Int <= reg(3).Int);
+                        pc += 4 * sizeof(int);
+                        continue;
+
+                case regSymbol:
+                        xAssert(0 <= operand(2) && operand(2) < xCurrentRap->symbols.len);
+                        reg(1) = xCurrentRap->symbols.v[operand(2)].value;
+                        pc += 3 * sizeof(int);
+                        continue;
+
+                case regCall:
+                        ;
+                        xValue_t *base = &reg(1);
+                        err = xCall(operand(2), base);
+                        check(err);
+                        pc += 3 * sizeof(int);
+                        continue;
+
+                case regReturn:
+                        argv[0] = reg(1);
+                        goto cleanup;
+
+                case regJump:
+                        pc += operand(1);
+                        continue;
+
+                case regJumpF:
+                        if (xIsFalse(reg(1))) {
+                                pc += operand(2);
+                        } else {
+                                pc += 3 * sizeof(int);
+                        }
+                        continue;
+
+                case regJumpT:
+                        if (xIsTrue(reg(1))) {
+                                pc += operand(2);
+                        } else {
+                                pc += 3 * sizeof(int);
+                        }
+                        continue;
+
+                case regCheckType:
+                        if (xTypeId(reg(1)) != (xTypeId_t) operand(2)) {
+                                xRaise("Type error");
+                        }
+                        pc += 3 * sizeof(int);
+                        continue;
+
+                case regLoopInt:
+                        reg(1).Int++;
+                        if (reg(1).Int <= reg(2).Int) {
+                                pc += operand(3);
+                        } else {
+                                pc += 4 * sizeof(int);
+                        }
+                        continue;
+
+                case regDouble:
+                        ;
+                        double d;
+                        memcpy(&d, &operand(2), sizeof(d));
+                        reg(1) = xDouble(d);
+                        pc += 4 * sizeof(int);
+                        continue;
+
+                case regAddDouble:
+                        reg(1) = xDouble(reg(2).Double + reg(3).Double);
+                        pc += 4 * sizeof(int);
+                        continue;
+
+                case regSubtractDouble:
+                        reg(1) = xDouble(reg(2).Double - reg(3).Double);
+                        pc += 4 * sizeof(int);
+                        continue;
+
+                case regMultiplyDouble:
+                        reg(1) = xDouble(reg(2).Double * reg(3).Double);
+                        pc += 4 * sizeof(int);
+                        continue;
+
+                case regDivideDouble:
+                        reg(1) = xDouble(reg(2).Double / reg(3).Double);
+                        pc += 4 * sizeof(int);
+                        continue;
+
+                case regMultiplyAddDouble:
+                        reg(1) = xDouble(fma(reg(2).Double, reg(3).Double, reg(4).Double));
+                        pc += 5 * sizeof(int);
+                        continue;
+
+                case regMaxDouble:
+                        reg(1) = xDouble(fmax(reg(2).Double, reg(3).Double));
+                        pc += 4 * sizeof(int);
+                        continue;
+
+                case regMinDouble:
+                        reg(1) = xDouble(fmin(reg(2).Double, reg(3).Double));
+                        pc += 4 * sizeof(int);
+                        continue;
+
+                case regLessEqualDouble:
+                        reg(1) = xBool(reg(2).Double <= reg(3).Double);
+                        pc += 4 * sizeof(int);
+                        continue;
+
+                case regNegateDouble:
+                        reg(1) = xDouble(-reg(2).Double);
+                        pc += 3 * sizeof(int);
+                        continue;
+
+                case regAbsDouble:
+                        reg(1) = xDouble(fabs(reg(2).Double));
+                        pc += 3 * sizeof(int);
+                        continue;
+
+                case regExpDouble:
+                        reg(1) = xDouble(exp(reg(2).Double));
+                        pc += 3 * sizeof(int);
+                        continue;
+
+                case regLogDouble:
+                        reg(1) = xDouble(log(reg(2).Double));
+                        pc += 3 * sizeof(int);
+                        continue;
+
+                case regInverseDouble:
+                        reg(1) = xDouble(1.0 / reg(2).Double);
+                        pc += 3 * sizeof(int);
+                        continue;
+
+                case regSqrtDouble:
+                        reg(1) = xDouble(sqrt(reg(2).Double));
+                        pc += 3 * sizeof(int);
+                        continue;
+
+                case regSigmoidDouble:
+                        reg(1) = xDouble(1.0 / (1.0 + exp(-reg(2).Double)));
+                        pc += 3 * sizeof(int);
+                        continue;
+
+                case regRoundFloat:
+                        reg(1) = xDouble((float) reg(2).Double);
+                        pc += 3 * sizeof(int);
+                        continue;
+
+                case regIntToDouble:
+                        reg(1) = xDouble(reg(2).Int);
+                        pc += 3 * sizeof(int);
+                        continue;
+
+                case regDoubleToInt:
+                        if (!(reg(2).Double > INT_MIN - 1.0 && reg(2).Double < INT_MAX + 1.0)) {
+                                xRaise("Double out of int range");
+                        }
+                        reg(1) = xInt((int) reg(2).Double);
+                        pc += 3 * sizeof(int);
+                        continue;
+
+                default:
+                        xAssert(false);
+                }
+        }
+
+cleanup:
+        if (r != NULL) {
+                xPopFrame(xCurrentRap, r);
+        }
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
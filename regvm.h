@@ -0,0 +1,77 @@
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ |      regvm.h -- register based virtual machine                       |
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Three-address instructions over a register file. The registers
+ *  are the slots of the stack machine, so `getl' and `setl' address
+ *  them directly, followed by the constants of the program.
+ *
+ *  Code layout: header, constant values, instructions
+ */
+
+enum {
+        regHeaderRegisters,     // Number of registers, including constants
+        regHeaderFlags,
+        regHeaderConstants,     // Number of constants
+        regHeaderSize
+};
+
+enum {
+        regInt,                 // d k          d = k
+        regMove,                // d a          d = a
+        regSubtractInt,         // d a b        d = a - b
+        regMultiplyInt,         // d a b        d = a * b
+        regIncrementInt,        // d a          d = a + 1
+        regLessEqualInt,        // d a b        d = a <= b
+        regSymbol,              // d s          d = value of symbol s
+        regCall,                // d argc       d = d(d+1 ... d+argc-1)
+        regReturn,              // a
+        regJump,                // offset
+        regJumpF,               // a offset
+        regJumpT,               // a offset
+        regCheckType,           // a t          error unless a has typeId t
+        regLoopInt,             // a b offset   a = a + 1, jump if a <= b
+        regDouble,              // d lo hi      d = the double with these halves
+
+        // The floating point instructions, in the order of the stack machine
+        regAddDouble,           // d a b        d = a + b
+        regSubtractDouble,      // d a b        d = a - b
+        regMultiplyDouble,      // d a b        d = a * b
+        regDivideDouble,        // d a b        d = a / b
+        regMultiplyAddDouble,   // d a b c      d = a * b + c
+        regMaxDouble,           // d a b        d = fmax(a, b)
+        regMinDouble,           // d a b        d = fmin(a, b)
+        regLessEqualDouble,     // d a b        d = a <= b
+        regNegateDouble,        // d a          d = -a
+        regAbsDouble,           // d a          d = fabs(a)
+        regExpDouble,           // d a          d = exp(a)
+        regLogDouble,           // d a          d = log(a)
+        regInverseDouble,       // d a          d = 1 / a
+        regSqrtDouble,          // d a          d = sqrt(a)
+        regSigmoidDouble,       // d a          d = 1 / (1 + exp(-a))
+        regRoundFloat,          // d a          d = (float) a
+        regIntToDouble,         // d a          d = (double) a
+        regDoubleToInt,         // d a          d = (int) a
+        regNrInstructions
+};
+
+extern const struct vmInstruction regInstructions[];
+
+/*
+ *  Translate stack machine code into register code
+ */
+err_t xTranslateRegisters(const int *code, int len, intList *out);
+
+/*
+ *  Builtin function to jump to register code
+ */
+xFunction_t xExecuteRegisters;
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
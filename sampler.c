@@ -0,0 +1,380 @@
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ |      sampler.c -- statistical profiler for Rap programs              |
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
+#define _XOPEN_SOURCE 600 // For setitimer and sigaction
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/time.h>
+
+#include "cplus.h"
+#include "rap.h"
+
+#include "assemble.h"
+#include "sampler.h"
+
+/*----------------------------------------------------------------------+
+ |      Recording                                                       |
+ +----------------------------------------------------------------------*/
+
+#define maxDepth        16
+#define bufferSize      8192
+
+struct sample {
+        int depth;
+        const int *code[maxDepth]; // Innermost frame first
+        int pc[maxDepth];       // In words from the start of the code
+};
+
+/*
+ *  Filled by the signal handler, emptied by xCollectSamples with the
+ *  signal blocked
+ */
+static struct sample buffer[bufferSize];
+static volatile sig_atomic_t bufferLen;
+static volatile sig_atomic_t idleCount; // Not in xExecute
+static volatile sig_atomic_t lostCount;
+
+static
+void handler(int sig)
+{
+        volatile struct xFrame *frame = xCurrentFrame;
+        if (frame == NULL) {
+                idleCount++;
+                return;
+        }
+
+        int n = bufferLen;
+        if (n >= bufferSize) {
+                lostCount++;
+                return;
+        }
+
+        struct sample *sample = &buffer[n];
+        int depth = 0;
+        for (; frame != NULL && depth < maxDepth; frame = frame->caller) {
+                sample->code[depth] = frame->code;
+                sample->pc[depth] = (frame->pc - (const char *) frame->code) / (int) sizeof(int);
+                depth++;
+        }
+        sample->depth = depth;
+        bufferLen = n + 1;
+}
+
+err_t xStartSampler(int frequency)
+{
+        err_t err = OK;
+
+        if (!xSampling) {
+                xRaise("Sampling needs a build with xSampling");
+        }
+        xAssert(0 < frequency && frequency <= 1000000);
+
+        struct sigaction action = {
+                .sa_handler = handler,
+                .sa_flags = SA_RESTART,
+        };
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGPROF, &action, NULL) != 0) {
+                xRaise("Cannot install SIGPROF handler");
+        }
+
+        struct itimerval timer = {
+                .it_interval = { .tv_sec = 0, .tv_usec = 1000000 / frequency },
+                .it_value = { .tv_sec = 0, .tv_usec = 1000000 / frequency },
+        };
+        if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+                xRaise("Cannot start profiling timer");
+        }
+cleanup:
+        return err;
+}
+
+void xStopSampler(void)
+{
+        struct itimerval timer = {
+                .it_interval = { .tv_sec = 0, .tv_usec = 0 },
+                .it_value = { .tv_sec = 0, .tv_usec = 0 },
+        };
+        (void) setitimer(ITIMER_PROF, &timer, NULL);
+
+        // A signal may still be on its way
+        struct sigaction action = {
+                .sa_handler = SIG_IGN,
+        };
+        sigemptyset(&action.sa_mask);
+        (void) sigaction(SIGPROF, &action, NULL);
+}
+
+/*----------------------------------------------------------------------+
+ |      xCollectSamples                                                 |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Readable start of an expression: whitespace collapsed, without the
+ *  `;' of the folded stack format, and shortened to fit
+ */
+static
+void describe(char *text, int size, const char *source, const struct sourceExpression *expression)
+{
+        int n = 0;
+        bool space = false;
+        int i;
+        for (i=expression->start; i<expression->end; i++) {
+                char c = source[i];
+                if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+                        space = true;
+                        continue;
+                }
+                if (space && n > 0) {
+                        if (n >= size-2) break;
+                        text[n++] = ' ';
+                }
+                if (n >= size-1) break;
+                space = false;
+                text[n++] = (c == ';') ? ',' : c;
+        }
+        if (i < expression->end && n >= 3) {
+                memcpy(&text[n-3], "...", 3);
+        }
+        text[n] = '\0';
+}
+
+/*
+ *  The hot spot of expression `e' of this program, or of its top level
+ *  when `e' is -1. `spots' caches their indices for the program.
+ */
+static
+err_t findSpot(struct xSamples *samples, int *spots, int program,
+        const struct sourceMap *map, const char *source, int e, int *index)
+{
+        err_t err = OK;
+
+        int *cached = &spots[e + 1];
+        if (*cached < 0) {
+                struct hotSpot spot = {
+                        .program = program,
+                        .offset = -1,
+                        .text = "(top level)",
+                        .self = 0,
+                        .total = 0,
+                };
+                if (e >= 0) {
+                        const struct sourceExpression *expression = &map->expressions.v[e];
+                        spot.offset = expression->start;
+                        describe(spot.text, sizeof(spot.text), source, expression);
+                }
+                *cached = samples->spots.len;
+                listPush(samples->spots, spot);
+        }
+        *index = *cached;
+cleanup:
+        return err;
+}
+
+static
+err_t countStack(struct xSamples *samples, const charList *frames)
+{
+        err_t err = OK;
+
+        for (int i=0; i<samples->stacks.len; i++) {
+                if (0==strcmp(samples->stacks.v[i].frames, frames->v)) {
+                        samples->stacks.v[i].count++;
+                        goto cleanup;
+                }
+        }
+
+        struct foldedStack stack = {
+                .frames = malloc(frames->len),
+                .count = 1,
+        };
+        if (stack.frames == NULL) {
+                xRaise("Out of memory");
+        }
+        memcpy(stack.frames, frames->v, frames->len);
+        listPush(samples->stacks, stack);
+cleanup:
+        return err;
+}
+
+err_t xCollectSamples(struct xSamples *samples, int program,
+        const int *code, const struct sourceMap *map, const char *source)
+{
+        err_t err = OK;
+
+        sigset_t block, saved;
+        sigemptyset(&block);
+        sigaddset(&block, SIGPROF);
+        sigprocmask(SIG_BLOCK, &block, &saved);
+
+        int *spots = malloc((map->expressions.len + 1) * sizeof(int));
+        intList chain = emptyList;
+        charList frames = emptyList;
+
+        if (spots == NULL) {
+                xRaise("Out of memory");
+        }
+        for (int i=0; i<map->expressions.len+1; i++) {
+                spots[i] = -1;
+        }
+
+        samples->count += idleCount + lostCount;
+        samples->outside += idleCount;
+        samples->lost += lostCount;
+        idleCount = 0;
+        lostCount = 0;
+
+        for (int i=0; i<bufferLen; i++) {
+                const struct sample *sample = &buffer[i];
+                samples->count++;
+                if (sample->code[0] != code) {
+                        samples->outside++;
+                        continue;
+                }
+
+                // Hot spots
+                int e = sourceExpressionAt(map, sample->pc[0]);
+                int index;
+                err = findSpot(samples, spots, program, map, source, e, &index);
+                check(err);
+                samples->spots.v[index].self++;
+                for (;;) {
+                        err = findSpot(samples, spots, program, map, source, e, &index);
+                        check(err);
+                        samples->spots.v[index].total++;
+                        if (e < 0) break;
+                        e = map->expressions.v[e].parent;
+                }
+
+                // Folded stack, outermost first
+                frames.len = 0;
+                for (int d=sample->depth-1; d>=0; d--) {
+                        char text[sizeof(samples->spots.v[0].text) + 16];
+                        if (sample->code[d] != code) {
+                                snprintf(text, sizeof(text), "%s[other code]", (frames.len > 0) ? ";" : "");
+                        } else {
+                                snprintf(text, sizeof(text), "%sprogram %d", (frames.len > 0) ? ";" : "", program);
+                        }
+                        for (int j=0; text[j]!='\0'; j++) {
+                                listPush(frames, text[j]);
+                        }
+                        if (sample->code[d] != code) {
+                                continue;
+                        }
+
+                        chain.len = 0;
+                        for (e=sourceExpressionAt(map, sample->pc[d]); e>=0; e=map->expressions.v[e].parent) {
+                                listPush(chain, e);
+                        }
+                        while (chain.len > 0) {
+                                e = listPop(chain);
+                                text[0] = ';';
+                                describe(&text[1], sizeof(text) - 1, source, &map->expressions.v[e]);
+                                for (int j=0; text[j]!='\0'; j++) {
+                                        listPush(frames, text[j]);
+                                }
+                        }
+                }
+                listPush(frames, '\0');
+                err = countStack(samples, &frames);
+                check(err);
+        }
+
+cleanup:
+        bufferLen = 0;
+        sigprocmask(SIG_SETMASK, &saved, NULL);
+
+        free(spots);
+        freeList(chain);
+        freeList(frames);
+
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      Reports                                                         |
+ +----------------------------------------------------------------------*/
+
+static
+int compareSpots(const void *a, const void *b)
+{
+        const struct hotSpot *x = a, *y = b;
+        if (x->self != y->self) {
+                return (x->self < y->self) ? 1 : -1;
+        }
+        return (x->total < y->total) ? 1 : (x->total > y->total) ? -1 : 0;
+}
+
+void xPrintHotSpots(FILE *fp, const struct xSamples *samples)
+{
+        int n = samples->spots.len;
+        struct hotSpot *spots = malloc(n * sizeof(*spots) + 1);
+        if (spots == NULL) {
+                return;
+        }
+        if (n > 0) {
+                memcpy(spots, samples->spots.v, n * sizeof(*spots));
+                qsort(spots, n, sizeof(*spots), compareSpots);
+        }
+
+        double scale = (samples->count > 0) ? 100.0 / samples->count : 0.0;
+
+        fprintf(fp, "Samples: %llu (outside programs: %llu, lost: %llu)\n",
+                samples->count, samples->outside, samples->lost);
+        fprintf(fp, "   self   total  program:offset  expression\n");
+        for (int i=0; i<n && i<30; i++) {
+                fprintf(fp, "%6.1f%% %6.1f%%  %7d:%-6d  %s\n",
+                        spots[i].self * scale, spots[i].total * scale,
+                        spots[i].program, spots[i].offset, spots[i].text);
+        }
+
+        free(spots);
+}
+
+err_t xWriteFoldedStacks(const struct xSamples *samples, const char *path)
+{
+        err_t err = OK;
+
+        FILE *fp = fopen(path, "w");
+        if (fp == NULL) {
+                xRaise("Cannot create stacks file");
+        }
+
+        for (int i=0; i<samples->stacks.len; i++) {
+                fprintf(fp, "%s %llu\n", samples->stacks.v[i].frames, samples->stacks.v[i].count);
+        }
+
+        int r = fclose(fp);
+        fp = NULL;
+        if (r != 0) {
+                xRaise("Write error on stacks file");
+        }
+cleanup:
+        if (fp != NULL) {
+                fclose(fp);
+        }
+        return err;
+}
+
+void xFreeSamples(struct xSamples *samples)
+{
+        for (int i=0; i<samples->stacks.len; i++) {
+                free(samples->stacks.v[i].frames);
+        }
+        freeList(samples->stacks);
+        freeList(samples->spots);
+        *samples = (struct xSamples) { .count = 0 };
+}
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
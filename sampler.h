@@ -0,0 +1,71 @@
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ |      sampler.h -- statistical profiler for Rap programs              |
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  A SIGPROF timer records the active xExecute frames of the thread it
+ *  interrupts. After running a program, xCollectSamples attributes the
+ *  recorded positions to its source expressions with the map from
+ *  compileLine. This needs a build with xSampling, or there is nothing to
+ *  record.
+ */
+
+struct hotSpot {
+        int program;            // Sequence number given to xCollectSamples
+        int offset;             // Of the expression in the program's source
+        char text[48];          // Start of the expression
+        unsigned long long self; // Samples in the expression itself
+        unsigned long long total; // Including subexpressions
+};
+
+struct foldedStack {
+        char *frames;           // Separated by `;'
+        unsigned long long count;
+};
+
+struct xSamples {
+        List(struct hotSpot) spots;
+        List(struct foldedStack) stacks;
+        unsigned long long count;
+        unsigned long long outside; // Not in a program given to xCollectSamples
+        unsigned long long lost; // Recording buffer was full
+};
+
+/*----------------------------------------------------------------------+
+ |      Functions                                                       |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Sample `frequency' times per second of CPU time
+ */
+err_t xStartSampler(int frequency);
+
+void xStopSampler(void);
+
+/*
+ *  Take the samples recorded since the last call. Those of other code
+ *  count as outside.
+ */
+err_t xCollectSamples(struct xSamples *samples, int program,
+        const int *code, const struct sourceMap *map, const char *source);
+
+/*
+ *  Print the expressions with the most samples
+ */
+void xPrintHotSpots(FILE *fp, const struct xSamples *samples);
+
+/*
+ *  One line per distinct stack with its count, as flame graph tools take
+ *  it. The outermost frame is the program.
+ */
+err_t xWriteFoldedStacks(const struct xSamples *samples, const char *path);
+
+void xFreeSamples(struct xSamples *samples);
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
@@ -0,0 +1,416 @@
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ |      verify.c -- proving code safe to run without checks             |
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cplus.h"
+#include "rap.h"
+
+#include "verify.h"
+
+#define unknownType (-1)
+
+/*----------------------------------------------------------------------+
+ |      Helpers                                                         |
+ +----------------------------------------------------------------------*/
+
+struct verify {
+        const struct xRap *rap;
+        int nrSlots;
+        int sp;
+        int *types;             // Of each slot: a typeId or unknownType
+        int *states;            // At each jump target: depth or -1, types
+        int *stateOf;           // Index of the jump target at each pc, or -1
+};
+
+static
+err_t push(struct verify *v, int type)
+{
+        err_t err = OK;
+        xAssert(v->sp < v->nrSlots);
+        v->types[v->sp++] = type;
+cleanup:
+        return err;
+}
+
+static
+err_t drop(struct verify *v, int n)
+{
+        err_t err = OK;
+        xAssert(0 <= n && n <= v->sp);
+        v->sp -= n;
+cleanup:
+        return err;
+}
+
+/*
+ *  Slot `i' exists and has type `type'. Use type -1 to only check that
+ *  it exists.
+ */
+static
+err_t need(const struct verify *v, int i, int type)
+{
+        err_t err = OK;
+        xAssert(0 <= i && i < v->sp);
+        xAssert(type < 0 || v->types[i] == type);
+cleanup:
+        return err;
+}
+
+static
+int *stateAt(const struct verify *v, int pc)
+{
+        return &v->states[(size_t) v->stateOf[pc] * (v->nrSlots + 1)];
+}
+
+/*
+ *  Merge the types at a jump target into its state. Sets `changed' when
+ *  the state changed.
+ */
+static
+err_t merge(struct verify *v, int target, bool *changed)
+{
+        err_t err = OK;
+
+        int *state = stateAt(v, target);
+        *changed = false;
+        if (state[0] < 0) {
+                state[0] = v->sp;
+                memcpy(&state[1], v->types, v->sp * sizeof(int));
+                *changed = true;
+                goto cleanup;
+        }
+
+        xAssert(state[0] == v->sp);
+        for (int i=0; i<v->sp; i++) {
+                if (state[1+i] != v->types[i] && state[1+i] != unknownType) {
+                        state[1+i] = unknownType;
+                        *changed = true;
+                }
+        }
+cleanup:
+        return err;
+}
+
+static
+int targetOf(const int *code, int pc)
+{
+        int jump = vmInstructions[code[pc]].jump;
+        return pc + code[pc+jump] / (int)sizeof(int);
+}
+
+/*
+ *  Follow the code once from the start. Sets `changed' when a jump back
+ *  made less known at its target, so that the code must be followed again.
+ */
+static
+err_t follow(struct verify *v, const int *code, int len, bool *changed)
+{
+        err_t err = OK;
+
+        const struct xRap *rap = v->rap;
+        bool reachable = true;
+        v->sp = code[vmHeaderArguments];
+        for (int i=0; i<v->sp; i++) {
+                v->types[i] = unknownType;
+        }
+        *changed = false;
+
+        for (int pc=vmHeaderSize; pc<len; pc+=vmInstructions[code[pc]].length) {
+                if (v->stateOf[pc] >= 0) {
+                        int *state = stateAt(v, pc);
+                        if (reachable) {
+                                bool merged;
+                                err = merge(v, pc, &merged);
+                                check(err);
+                        }
+                        reachable = (state[0] >= 0);
+                        if (reachable) {
+                                v->sp = state[0];
+                                memcpy(v->types, &state[1], v->sp * sizeof(int));
+                        }
+                }
+                if (!reachable) {
+                        continue;
+                }
+
+                const int *ip = &code[pc];
+                int sp = v->sp;
+                switch (ip[0]) {
+                case vmInt:
+                        err = push(v, xIntId);
+                        check(err);
+                        break;
+
+                case vmSubtractInt:
+                case vmMultiplyInt:
+                case vmLessEqualInt:
+                        err = need(v, sp - 2, xIntId);
+                        check(err);
+                        err = need(v, sp - 1, xIntId);
+                        check(err);
+                        v->sp--;
+                        v->types[sp - 2] = (ip[0] == vmLessEqualInt) ? unknownType : xIntId;
+                        break;
+
+                case vmIncrementInt:
+                case vmIntSubtractInt:
+                        err = need(v, sp - 1, xIntId);
+                        check(err);
+                        break;
+
+                case vmSymbol:
+                        xAssert(0 <= ip[1] && ip[1] < rap->symbols.len);
+                        err = push(v, xIsFunction(rap->symbols.v[ip[1]].value) ? xFunctionId : unknownType);
+                        check(err);
+                        break;
+
+                case vmCall:
+                case vmTailCall:
+                        xAssert(ip[1] >= 1);
+                        err = need(v, sp - ip[1], -1); // The type is checked at run time
+                        check(err);
+                        v->sp -= ip[1] - 1;
+                        v->types[v->sp - 1] = unknownType;
+                        reachable = (ip[0] == vmCall);
+                        break;
+
+                case vmReturn:
+                        xAssert(sp >= 1);
+                        reachable = false;
+                        break;
+
+                case vmDrop:
+                        err = drop(v, ip[1]);
+                        check(err);
+                        break;
+
+                case vmJump:
+                case vmJumpF:
+                case vmJumpT:
+                        xAssert(ip[0] == vmJump || sp >= 1);
+                        bool merged;
+                        err = merge(v, targetOf(code, pc), &merged);
+                        check(err);
+                        *changed |= merged && targetOf(code, pc) <= pc;
+                        reachable = (ip[0] != vmJump);
+                        break;
+
+                case vmGetLocal:
+                        err = need(v, ip[1], -1);
+                        check(err);
+                        err = push(v, v->types[ip[1]]);
+                        check(err);
+                        break;
+
+                case vmSetLocal:
+                        err = need(v, ip[1], -1);
+                        check(err);
+                        v->types[ip[1]] = v->types[sp - 1];
+                        break;
+
+                case vmCheckType:
+                        xAssert(ip[1] >= 0);
+                        err = need(v, sp - 1 - ip[1], -1);
+                        check(err);
+                        v->types[sp - 1 - ip[1]] = ip[2];
+                        break;
+
+                case vmLoopInt:
+                        err = need(v, ip[1], xIntId);
+                        check(err);
+                        err = need(v, ip[2], xIntId);
+                        check(err);
+                        err = merge(v, targetOf(code, pc), &merged);
+                        check(err);
+                        *changed |= merged && targetOf(code, pc) <= pc;
+                        break;
+
+                case vmDouble:
+                        err = push(v, xDoubleId);
+                        check(err);
+                        break;
+
+                case vmMultiplyAddDouble:
+                        err = need(v, sp - 3, xDoubleId);
+                        check(err);
+                        // fall through
+                case vmAddDouble:
+                case vmSubtractDouble:
+                case vmMultiplyDouble:
+                case vmDivideDouble:
+                case vmMaxDouble:
+                case vmMinDouble:
+                case vmLessEqualDouble:
+                        err = need(v, sp - 2, xDoubleId);
+                        check(err);
+                        err = need(v, sp - 1, xDoubleId);
+                        check(err);
+                        err = drop(v, (ip[0] == vmMultiplyAddDouble) ? 2 : 1);
+                        check(err);
+                        v->types[v->sp - 1] = (ip[0] == vmLessEqualDouble) ? unknownType : xDoubleId;
+                        break;
+
+                case vmNegateDouble:
+                case vmAbsDouble:
+                case vmExpDouble:
+                case vmLogDouble:
+                case vmInverseDouble:
+                case vmSqrtDouble:
+                case vmSigmoidDouble:
+                case vmRoundFloat:
+                case vmDoubleToInt:
+                        err = need(v, sp - 1, xDoubleId);
+                        check(err);
+                        v->types[sp - 1] = (ip[0] == vmDoubleToInt) ? xIntId : xDoubleId;
+                        break;
+
+                case vmIntToDouble:
+                        err = need(v, sp - 1, xIntId);
+                        check(err);
+                        v->types[sp - 1] = xDoubleId;
+                        break;
+
+                case vmGetLocalIntLessEqualJumpT:
+                        err = need(v, ip[1], xIntId);
+                        check(err);
+                        err = push(v, unknownType);
+                        check(err);
+                        err = merge(v, targetOf(code, pc), &merged);
+                        check(err);
+                        *changed |= merged && targetOf(code, pc) <= pc;
+                        break;
+
+                case vmGetLocalIncrementSetLocal:
+                        err = need(v, ip[1], xIntId);
+                        check(err);
+                        xAssert(0 <= ip[2] && ip[2] <= sp);
+                        err = push(v, xIntId);
+                        check(err);
+                        v->types[ip[2]] = xIntId;
+                        break;
+
+                case vmGetLocalMultiplyInt:
+                        err = need(v, ip[1], xIntId);
+                        check(err);
+                        err = need(v, sp - 1, xIntId);
+                        check(err);
+                        break;
+
+                case vmDropJump:
+                        err = drop(v, ip[1]);
+                        check(err);
+                        err = merge(v, targetOf(code, pc), &merged);
+                        check(err);
+                        *changed |= merged && targetOf(code, pc) <= pc;
+                        reachable = false;
+                        break;
+
+                case vmGetLocalIntSubtractSetLocalDrop:
+                        err = need(v, ip[1], xIntId);
+                        check(err);
+                        xAssert(0 <= ip[3] && ip[3] <= sp);
+                        err = push(v, xIntId);
+                        check(err);
+                        v->types[ip[3]] = xIntId;
+                        err = drop(v, ip[4]);
+                        check(err);
+                        break;
+
+                default:
+                        xAssert(false);
+                }
+        }
+
+        xAssert(!reachable); // Running past the end
+cleanup:
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |      xVerifyCode                                                     |
+ +----------------------------------------------------------------------*/
+
+err_t xVerifyCode(const struct xRap *rap, int *code, int len)
+{
+        err_t err = OK;
+
+        struct verify v = {
+                .rap = rap,
+                .types = NULL,
+                .states = NULL,
+                .stateOf = NULL,
+        };
+        char *isStart = NULL;
+
+        xAssert(len >= vmHeaderSize);
+        xAssert((code[vmHeaderFlags] & vmFlagThreaded) == 0);
+
+        // Each slot takes an instruction or an argument to fill
+        v.nrSlots = code[vmHeaderLocals];
+        int nrArguments = code[vmHeaderArguments];
+        xAssert(0 <= nrArguments && nrArguments <= v.nrSlots);
+        xAssert(0 < v.nrSlots && v.nrSlots <= len + nrArguments);
+
+        v.types = malloc((v.nrSlots + 1) * sizeof(int));
+        v.stateOf = malloc((len + 1) * sizeof(int));
+        isStart = calloc(len + 1, sizeof(char));
+        if (v.types == NULL || v.stateOf == NULL || isStart == NULL) {
+                xRaise("Out of memory");
+        }
+
+        for (int pc=vmHeaderSize; pc<len; pc+=vmInstructions[code[pc]].length) {
+                xAssert(0 <= code[pc] && code[pc] < vmNrInstructions);
+                xAssert(vmInstructions[code[pc]].length <= len - pc);
+                isStart[pc] = 1;
+        }
+
+        int nrTargets = 0;
+        for (int pc=0; pc<=len; pc++) {
+                v.stateOf[pc] = -1;
+        }
+        for (int pc=vmHeaderSize; pc<len; pc+=vmInstructions[code[pc]].length) {
+                int jump = vmInstructions[code[pc]].jump;
+                if (jump > 0) {
+                        xAssert(code[pc+jump] % (int)sizeof(int) == 0);
+                        int target = targetOf(code, pc);
+                        xAssert(vmHeaderSize <= target && target < len && isStart[target]);
+                        if (v.stateOf[target] < 0) {
+                                v.stateOf[target] = nrTargets++;
+                        }
+                }
+        }
+
+        v.states = malloc((size_t) nrTargets * (v.nrSlots + 1) * sizeof(int) + 1);
+        if (v.states == NULL) {
+                xRaise("Out of memory");
+        }
+        for (int i=0; i<nrTargets; i++) {
+                v.states[(size_t) i * (v.nrSlots + 1)] = -1; // Not reached
+        }
+
+        for (bool changed=true; changed; ) {
+                err = follow(&v, code, len, &changed);
+                check(err);
+        }
+
+        code[vmHeaderFlags] |= vmFlagVerified;
+cleanup:
+        free(v.types);
+        free(v.states);
+        free(v.stateOf);
+        free(isStart);
+        return err;
+}
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
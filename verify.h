@@ -0,0 +1,35 @@
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ |      verify.h -- proving code safe to run without checks             |
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  The verifier follows the stack depth and the types of the stack slots
+ *  along all paths through the code, and proves that:
+ *   - the instructions are complete and the jumps land on them
+ *   - the depth at an instruction is the same for all paths to it
+ *   - the stack stays within the slots given by the header
+ *   - locals, vmDrop and the calls stay within the stack
+ *   - integer instructions get ints
+ *   - execution can't run past the end of the code
+ *  Code from the assembler passes, because it checks with vmCheckType
+ *  what it can't prove itself.
+ */
+
+/*----------------------------------------------------------------------+
+ |      Functions                                                       |
+ +----------------------------------------------------------------------*/
+
+/*
+ *  Check code that isn't threaded yet, and mark it with vmFlagVerified
+ *  when it passes. Symbols may be added later, but registered functions
+ *  stay functions, so the result remains valid for `rap'.
+ */
+err_t xVerifyCode(const struct xRap *rap, int *code, int len);
+
+/*----------------------------------------------------------------------+
+ |                                                                      |
+ +----------------------------------------------------------------------*/
+